@@ -19,12 +19,19 @@
 
 #pragma once
 
-#include <windows.h>
-#include <netlistmgr.h>
-#include <ocidl.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <netlistmgr.h>
+    #include <ocidl.h>
+#endif
+
+#include "InterfaceSampler.h"
+#include "Pollable.h"
 
 namespace NetworkCandy {
 
+#ifdef _WIN32
+
 class CMEventHandler : public INetworkListManagerEvents {
  public:
     CMEventHandler();
@@ -44,25 +51,67 @@ class CMEventHandler : public INetworkListManagerEvents {
     DWORD m_dwCookie;
 };
 
-class ConnectivityManager : private CMEventHandler {
+#endif
+
+#ifdef _WIN32
+class ConnectivityManager : private CMEventHandler, public Pollable {
+#else
+class ConnectivityManager : public Pollable {
+#endif
  public:
     ConnectivityManager();
     ~ConnectivityManager();
 
     bool isConnectedToInternet();
 
+    // on Linux, opens / closes the rtnetlink sockets instead of COM
     void initCOM();
     void listenForConnectivityChanges();
     void releaseCOM();
 
+    // makes listenForConnectivityChanges() return, callable from any thread
+    void stopListening();
+
+    // instead of listenForConnectivityChanges(), once initCOM() called; the initial state is reported on first process()
+    // on Windows, COM notifications come as thread messages : no fds, process() pumps them at each nextDeadline(),
+    // and must be called from the thread that called initCOM()
+    std::vector<intptr_t> fds() const override;
+    Clock::time_point nextDeadline() const override;
+    void process(const std::vector<intptr_t>& readyFds) override;
+
+    // shared per-interface counters sampler, so consumers do not have to poll the OS themselves
+    InterfaceSampler& interfaceSampler();
+
  protected:
-    void _connectivityChanged(bool isConnectedToInternet) override;
+    #ifdef _WIN32
+        void _connectivityChanged(bool isConnectedToInternet) override;
+    #else
+        virtual void _connectivityChanged(bool isConnectedToInternet);
+    #endif
 
  private:
-    INetworkListManager* _manager = nullptr;
-    IConnectionPointContainer* _managerCPC = nullptr;
-    IConnectionPoint* _cp = nullptr;
-    DWORD _cookie;
+    InterfaceSampler _sampler;
+
+    #ifdef _WIN32
+        INetworkListManager* _manager = nullptr;
+        IConnectionPointContainer* _managerCPC = nullptr;
+        IConnectionPoint* _cp = nullptr;
+        DWORD _cookie;
+        DWORD _listeningThreadId = 0;
+        bool _hasReportedInitial = false;
+    #else
+        int _eventsFd = -1;  // rtnetlink socket subscribed to link / address / route changes
+        int _queryFd = -1;  // rtnetlink socket used for dumps
+        int _stopFd = -1;  // eventfd waking the listening loop up
+        bool _hasProcessed = false;
+        bool _bInternet = false;
+
+        // any running interface holding a default route
+        bool _hasDefaultRoute();
+
+        // reports the current state if it changed, or if never reported
+        void _evaluate();
+    #endif
 };
 
 }  // namespace NetworkCandy
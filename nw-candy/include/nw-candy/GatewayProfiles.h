@@ -0,0 +1,128 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace NetworkCandy {
+
+enum class Support {
+    Unknown,
+    Works,
+    Fails
+};
+
+// what worked against one service of the gateway (WANIPConnection for IPv4, FirewallControl for IPv6)
+struct GatewayServiceProfile {
+    Support mapping = Support::Unknown;  // Fails only when the service lacks the action, see isCapabilityFailure()
+    int64_t failedAt = 0;  // when mapping was found to fail, seconds since epoch; 0 for seeded, permanent failures
+    Support optimistic = Support::Unknown;  // adds answered unambiguously
+    std::string leaseDuration;  // lease accepted last time, empty if unknown
+    double checkLatencyMs = 0;  // moving averages
+    double addLatencyMs = 0;
+    Support reachable = Support::Unknown;  // connections to the mapped port actually arrive
+    Support hairpin = Support::Unknown;  // ... even from the LAN, through the external address
+    double reachLatencyMs = 0;  // moving average of the connect latency
+    std::vector<int> addSuccessCodes;  // add errors meaning success with this gateway (501 : mapping already there...)
+
+    // known to fail, and not worth trying again yet
+    bool isKnownToFail(std::chrono::system_clock::time_point now = std::chrono::system_clock::now()) const;
+    bool isAddSuccess(int errorCode) const;
+};
+
+// the service lacks the action (401 InvalidAction, 602 OptionalActionNotImplemented), as opposed to
+// failures telling about this network or this moment (718 conflict, 606 unauthorized, transient rejects...)
+bool isCapabilityFailure(int errorCode);
+
+struct GatewayProfile {
+    GatewayServiceProfile ipv4;
+    GatewayServiceProfile ipv6;
+    unsigned int sessions = 0;
+};
+
+// from the root device description
+struct GatewayIdentity {
+    std::string manufacturer;
+    std::string model;
+    std::string firmware;  // modelNumber, most vendors put the firmware version there
+
+    std::string key() const;  // "manufacturer|model|firmware"
+};
+
+// from the root description of the IGD, returns if identified
+bool parseGatewayIdentity(const std::string& rootDescription, GatewayIdentity* out);
+
+// Quirks and best known strategy per router model, seeded with built-in profiles and
+// optionally persisted in an INI-like file so that later sessions skip trial-and-error.
+// Only learnt profiles are persisted, seeds being merged under them on lookup.
+class GatewayProfiles {
+ public:
+    // learnt failures are probed again after this long, firmware updates may have fixed them
+    static constexpr std::chrono::hours FAILURE_EXPIRY {24 * 7};
+
+    static GatewayProfiles& shared();
+    ~GatewayProfiles();
+
+    // merges profiles read from file, returns if read
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+
+    // loads from path, then saves back there on flush()
+    void setPersistencePath(const std::string& path);
+
+    // writes to the persistence path if anything was learnt since last time, returns if written;
+    // updates only mark the profiles dirty, callers flush once done talking to the gateway
+    bool flush();
+
+    // exact match first, then wildcards on firmware, model and manufacturer; the most specific value wins, field by field
+    GatewayProfile find(const GatewayIdentity& identity) const;
+
+    // "updater" gets what was learnt about this very identity, without the values it inherits
+    void update(const GatewayIdentity& identity, const std::function<void(GatewayProfile&)>& updater);
+
+    // learnt profiles, returns if parsed
+    bool parse(const std::string& content);
+    std::string serialize() const;
+
+ private:
+    GatewayProfiles();
+
+    mutable std::mutex _mutex;
+    std::map<std::string, GatewayProfile> _seeds;
+    std::map<std::string, GatewayProfile> _profiles;  // learnt, or loaded from file
+    std::string _persistencePath;
+    uint64_t _changes = 0;  // bumped on each update
+
+    std::mutex _flushMutex;  // writes in order, outside of _mutex
+    uint64_t _flushedChanges = 0;
+
+    GatewayProfile _find(const GatewayIdentity& identity) const;
+    static bool _parse(const std::string& content, std::map<std::string, GatewayProfile>* into);
+    static bool _write(const std::string& path, const std::string& content);
+    std::string _serialize() const;
+};
+
+}  // namespace NetworkCandy
@@ -0,0 +1,168 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TimeSeries.h"
+
+namespace NetworkCandy {
+
+// raw cumulative counters of an interface, as reported by the OS
+struct InterfaceCounters {
+    uint64_t rxBytes = 0;
+    uint64_t txBytes = 0;
+    uint64_t rxPackets = 0;
+    uint64_t txPackets = 0;
+    uint64_t rxErrors = 0;
+    uint64_t txErrors = 0;
+    uint64_t rxDropped = 0;
+    uint64_t txDropped = 0;
+};
+
+// counters of a single interface at one point in time
+struct InterfaceReading {
+    unsigned int ifIndex = 0;
+    std::string name;
+    InterfaceCounters counters;
+};
+
+// rates computed between two consecutive samples, per second
+struct InterfaceQuality {
+    int64_t timestampMs = 0;  // steady clock
+    double rxBytesPerSec = 0;
+    double txBytesPerSec = 0;
+    double errorsPerSec = 0;
+    double dropsPerSec = 0;
+};
+
+enum class QualityMetric {
+    RxThroughput,
+    TxThroughput,
+    ErrorRate,
+    DropRate
+};
+
+// Periodically reads per-interface counters (netlink IFLA_STATS64 on Linux, GetIfTable2 on Windows)
+// and keeps a small fixed-memory history per interface. Readers never lock.
+class InterfaceSampler {
+ public:
+    static constexpr std::size_t MAX_INTERFACES = 32;
+    static constexpr std::size_t HISTORY_SIZE = 60;
+
+    using Series = TimeSeries<InterfaceQuality, HISTORY_SIZE>;
+
+    // "isAbove" is true when the metric went over the threshold, false when it came back under
+    using ThresholdCallback = std::function<void(const std::string& ifName, QualityMetric metric, double value, bool isAbove)>;
+
+    InterfaceSampler();
+    ~InterfaceSampler();
+
+    // spawns the sampling thread, does nothing if already running
+    void start(std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+    void stop();
+    bool isRunning() const;
+
+    // takes a single sample on the calling thread, returns if succeeded
+    bool sampleOnce();
+
+    // handles readings as if they were read from the OS at "nowMs" (steady clock); interfaces
+    // missing from "readings" are considered gone
+    void ingest(const std::vector<InterfaceReading>& readings, int64_t nowMs);
+
+    // lock-free, returns if the interface is known and has at least one computed sample
+    bool latest(const std::string& ifName, InterfaceQuality* out) const;
+
+    // lock-free, history of an interface, most recent first; nullptr if unknown. Once the interface
+    // is gone, its slot may be recycled for another one
+    const Series* history(const std::string& ifName) const;
+
+    // names of the interfaces sampled so far
+    std::vector<std::string> interfaces() const;
+
+    // returns a subscription ID to be used with unsubscribe()
+    int subscribe(QualityMetric metric, double threshold, ThresholdCallback callback);
+    void unsubscribe(int subscriptionId);
+
+ private:
+    struct Slot {
+        std::atomic<uint32_t> seq {0};  // odd while claimed or released, readers retry on a torn name
+        std::atomic<bool> used {false};
+        std::atomic<uint64_t> claimOrder {0};  // the newest one wins when names collide
+        char name[64] = "\0";
+        unsigned int ifIndex = 0;  // writer side only
+        bool hasPrevious = false;  // writer side only
+        int64_t previousMs = 0;  // writer side only
+        InterfaceCounters previous;  // writer side only
+        Series series;
+    };
+
+    struct Subscription {
+        int id;
+        QualityMetric metric;
+        double threshold;
+        ThresholdCallback callback;
+        std::array<bool, MAX_INTERFACES> isAbove {};
+    };
+
+    std::array<Slot, MAX_INTERFACES> _slots;
+    uint64_t _claims = 0;  // writer side only
+    bool _isFullWarned = false;  // writer side only
+
+    std::mutex _subscriptionsMutex;
+    std::vector<Subscription> _subscriptions;
+    int _nextSubscriptionId = 1;
+
+    std::mutex _samplingMutex;
+    std::thread _thread;
+    std::atomic<bool> _running {false};
+    std::mutex _stopMutex;
+    std::condition_variable _stopCV;
+
+    int _netlinkFd = -1;  // Linux only, kept open between samples
+
+    // fills "out" with a reading for each interface, returns if succeeded
+    bool _readCounters(std::vector<InterfaceReading>* out);
+    void _closePlatformHandle();
+
+    Slot* _slotFor(unsigned int ifIndex, const std::string& name);
+    void _claim(Slot& slot, unsigned int ifIndex, const std::string& name);
+    void _release(Slot& slot, std::size_t slotIndex);
+    const Slot* _findSlot(const std::string& ifName) const;
+
+    // returns if the slot is in use and was not recycled while copying its name
+    static bool _readName(const Slot& slot, char* out, std::size_t size);
+    void _ingestReadings(const std::vector<InterfaceReading>& readings, int64_t nowMs);  // _samplingMutex held
+    void _ingest(Slot& slot, std::size_t slotIndex, const InterfaceCounters& counters, int64_t nowMs);
+    void _notifySubscribers(std::size_t slotIndex, const char* ifName, const InterfaceQuality& quality);
+
+    static double _metricValue(const InterfaceQuality& quality, QualityMetric metric);
+};
+
+}  // namespace NetworkCandy
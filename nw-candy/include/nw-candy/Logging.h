@@ -0,0 +1,37 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <memory>
+
+namespace NetworkCandy {
+
+// nw-candy messages go through this logger. By default an asynchronous one named "nw-candy",
+// writing to the sinks of spdlog's default logger from a background thread, so that
+// formatting and I/O stay off the network paths.
+spdlog::logger& logger();
+
+// replaces it (synchronous logger, own sinks...), nullptr restoring the default one;
+// to be called while no other nw-candy call is running
+void setLogger(std::shared_ptr<spdlog::logger> logger);
+
+}  // namespace NetworkCandy
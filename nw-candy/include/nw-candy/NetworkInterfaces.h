@@ -0,0 +1,37 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace NetworkCandy {
+
+struct NetworkInterface {
+    std::string name;  // "eth0" on Linux, friendly name on Windows
+    unsigned int index = 0;
+    std::string ipv4;  // empty if none
+    std::string ipv6;  // global address preferred over link-local, empty if none
+};
+
+// up, multicast-capable, non-loopback interfaces
+std::vector<NetworkInterface> listMulticastInterfaces();
+
+}  // namespace NetworkCandy
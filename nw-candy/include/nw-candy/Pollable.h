@@ -0,0 +1,46 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace NetworkCandy {
+
+// Lets the caller's own event loop (poll, epoll, io_uring...) drive nw-candy instead of library threads :
+// wait until any of fds() is readable or nextDeadline() is reached, then hand the readable ones to process().
+class Pollable {
+ public:
+    using Clock = std::chrono::steady_clock;
+
+    virtual ~Pollable() = default;
+
+    // sockets to watch for readability, as intptr_t like everywhere else in public headers; may change after process()
+    virtual std::vector<intptr_t> fds() const = 0;
+
+    // when process() is to be called even if nothing is readable, Clock::time_point::max() if never
+    virtual Clock::time_point nextDeadline() const { return Clock::time_point::max(); }
+
+    // never blocks; readyFds may be empty, on deadlines
+    virtual void process(const std::vector<intptr_t>& readyFds) = 0;
+};
+
+}  // namespace NetworkCandy
@@ -0,0 +1,63 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace NetworkCandy {
+
+enum class ReachabilityPath {
+    Hairpin,  // from the LAN to the external address, looping back through the gateway
+    Reflector  // an outside echo reflector connecting back
+};
+
+struct ReachabilityResult {
+    ReachabilityPath path = ReachabilityPath::Hairpin;
+    bool isReachable = false;
+    bool isVerified = false;  // the connection was seen arriving on our own listener
+    double latencyMs = 0;  // connect latency through the mapping, if reachable
+    int64_t timestampMs = 0;  // steady clock
+};
+
+// Checks that connections to externalIP:port really end up on localIP:port.
+//
+// Listens on localIP:port for the duration of the check and expects a random nonce there. When the port is
+// already in use (the application's own server), only the connection itself can be checked.
+//
+// Reflector protocol, one line each way : the probe sends "NWC-PROBE <ip> <port> <nonce>\n", the reflector
+// connects to ip:port, writes "<nonce>\n" and answers "OK\n" or "FAIL\n".
+class ReachabilityProbe {
+ public:
+    ReachabilityProbe(const std::string& localIP, unsigned short port);
+
+    // "host:port" of an echo reflector; empty to go through the hairpin path
+    void setReflector(const std::string& hostAndPort);
+
+    ReachabilityResult run(const std::string& externalIP, unsigned short externalPort, std::chrono::milliseconds timeout);
+
+ private:
+    std::string _localIP;
+    unsigned short _port;
+    std::string _reflector;
+};
+
+}  // namespace NetworkCandy
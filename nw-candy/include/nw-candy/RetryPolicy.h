@@ -0,0 +1,103 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <random>
+
+namespace NetworkCandy {
+
+// gateway operations, each having its own RTT estimate
+enum class GatewayOperation {
+    Discovery,
+    Validation,
+    Check,
+    Add,
+    Delete
+};
+
+struct RetryOptions {
+    unsigned int maxAttempts = 4;
+    std::chrono::milliseconds initialBackoff {100};
+    std::chrono::milliseconds maxBackoff {2000};
+    double backoffMultiplier = 2.0;
+
+    // per-attempt timeouts, before the gateway RTT is known and bounds afterwards
+    std::chrono::milliseconds initialAttemptTimeout {2000};
+    std::chrono::milliseconds minAttemptTimeout {250};
+    std::chrono::milliseconds maxAttemptTimeout {8000};
+};
+
+// smoothed RTT and variation, as TCP does (RFC 6298)
+class RttEstimator {
+ public:
+    void sample(std::chrono::milliseconds rtt);
+    void reset();
+
+    bool hasSamples() const;
+    std::chrono::milliseconds smoothed() const;
+    std::chrono::milliseconds timeout() const;  // smoothed + 4 * variation
+
+ private:
+    double _srttMs = 0;
+    double _rttvarMs = 0;
+    bool _hasSamples = false;
+};
+
+// runs gateway operations under an overall deadline : jittered exponential backoff between attempts,
+// per-attempt timeouts following the observed gateway RTT, and retries only on errors that may go away.
+class RetryPolicy {
+ public:
+    using Clock = std::chrono::steady_clock;
+
+    // returns an error code, 0 if succeeded; "attemptTimeout" is what this attempt should not exceed
+    using Attempt = std::function<int(std::chrono::milliseconds attemptTimeout)>;
+
+    explicit RetryPolicy(const RetryOptions& options = RetryOptions());
+
+    void setOptions(const RetryOptions& options);
+    RetryOptions options() const;
+
+    // returns the last error code, 0 if succeeded
+    int run(GatewayOperation operation, Clock::time_point deadline, const Attempt& attempt);
+
+    // timeouts / transport failures, generic ActionFailed; not discovery finding nothing, having waited already
+    static bool isRetryable(int errorCode);
+
+    // doubled for each retry, as the gateway might just be slow
+    std::chrono::milliseconds attemptTimeout(GatewayOperation operation, unsigned int attemptIndex) const;
+
+    // forgets what was observed, when changing gateway
+    void reset();
+
+ private:
+    mutable std::mutex _mutex;
+    RetryOptions _options;
+    RttEstimator _rtt[5];
+    std::mt19937 _random;
+
+    std::chrono::milliseconds _backoff(unsigned int retryIndex);
+    std::chrono::milliseconds _expectedDuration(GatewayOperation operation, std::chrono::milliseconds timeout,
+                                                std::chrono::milliseconds previous) const;
+};
+
+}  // namespace NetworkCandy
@@ -0,0 +1,128 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Trace.h"
+
+namespace NetworkCandy {
+
+// most urgent first
+enum class SOAPPriority {
+    Mapping,  // adds and deletes
+    Check,  // existence checks, external address
+    Poll  // statistics, status
+};
+
+struct SOAPSchedulerOptions {
+    double requestsPerSecond = 10;  // sustained
+    double burst = 4;  // requests allowed back to back
+    unsigned int maxInFlight = 2;  // concurrent requests, IPv4 and IPv6 being mapped at once
+    std::size_t maxQueue = 32;  // waiting requests, past it new ones are refused
+    std::chrono::milliseconds maxWait {10000};  // in queue, before giving up
+};
+
+struct SOAPSchedulerStats {
+    std::size_t queueDepth = 0;
+    std::size_t maxQueueDepth = 0;
+    unsigned int inFlight = 0;
+    uint64_t executed = 0;
+    uint64_t coalesced = 0;  // answered by an identical request instead of being sent
+    uint64_t rejected = 0;  // queue full
+    uint64_t timedOut = 0;  // waited more than maxWait, or past the caller's deadline
+    double meanWaitMs = 0;  // in queue, executed requests
+    double maxWaitMs = 0;
+};
+
+// Paces the SOAP requests sent to one gateway, whatever the number of handlers, renewals and samplers
+// talking to it : token bucket, bounded queue served by priority, and identical queued requests merged.
+// Calls stay blocking, each caller running its own request once its turn comes.
+class SOAPScheduler {
+ public:
+    static constexpr int QUEUE_FULL = -990;
+    static constexpr int QUEUE_TIMEOUT = -991;
+
+    using Clock = std::chrono::steady_clock;
+
+    // returns the outputs of the call, filled by whoever actually sent it; returns the UPnP result code
+    using Call = std::function<int(TraceArguments& outputs)>;
+
+    // shared by everything talking to the same gateway (host:port of the control URL)
+    static std::shared_ptr<SOAPScheduler> forGateway(const std::string& controlURL);
+
+    // applies to schedulers created afterwards
+    static void setDefaultOptions(const SOAPSchedulerOptions& options);
+
+    explicit SOAPScheduler(const SOAPSchedulerOptions& options = SOAPSchedulerOptions());
+
+    void setOptions(const SOAPSchedulerOptions& options);
+    SOAPSchedulerOptions options() const;
+
+    // "key" identifies the request (service, action and arguments), a queued one with the same key is joined
+    // instead of sending another; empty never joins. Waits in queue until "deadline" or maxWait, whichever
+    // comes first, joined requests giving up along with the one they joined. Returns the result code,
+    // QUEUE_FULL or QUEUE_TIMEOUT
+    int run(SOAPPriority priority, const std::string& key, const Call& call, TraceArguments* outputs = nullptr,
+            Clock::time_point deadline = Clock::time_point::max());
+
+    SOAPSchedulerStats stats() const;
+
+ private:
+    struct _Request {
+        SOAPPriority priority;
+        uint64_t sequence;
+        std::string key;
+        Clock::time_point enqueuedAt;
+        bool isDone = false;
+        int result = 0;
+        TraceArguments outputs;
+    };
+
+    static inline std::mutex _registryMutex;
+    static inline std::map<std::string, std::weak_ptr<SOAPScheduler>> _registry;
+    static inline SOAPSchedulerOptions _defaultOptions;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    SOAPSchedulerOptions _options;
+    std::vector<std::shared_ptr<_Request>> _queue;
+    uint64_t _sequence = 0;
+    double _tokens;
+    Clock::time_point _refilledAt;
+    SOAPSchedulerStats _stats;
+    double _totalWaitMs = 0;
+
+    void _refill(Clock::time_point now);
+
+    // the one to go next, by priority then arrival
+    std::shared_ptr<_Request> _next() const;
+    void _dequeue(const std::shared_ptr<_Request>& request);
+};
+
+}  // namespace NetworkCandy
@@ -0,0 +1,67 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <string_view>
+
+namespace NetworkCandy {
+
+// SSDP multicast group and port, IPv4
+inline constexpr const char * SSDP_MULTICAST_ADDRESS = "239.255.255.250";
+inline constexpr unsigned short SSDP_PORT = 1900;
+
+enum class SSDPMessageType {
+    Unknown,
+    Notify,  // NOTIFY * HTTP/1.1
+    SearchResponse,  // HTTP/1.1 200 OK
+    Search  // M-SEARCH * HTTP/1.1
+};
+
+// Headers of interest of a SSDP datagram. Views point into the parsed buffer, nothing is copied.
+struct SSDPMessage {
+    SSDPMessageType type = SSDPMessageType::Unknown;
+    std::string_view nt;  // NOTIFY only
+    std::string_view nts;  // ssdp:alive, ssdp:byebye, ssdp:update
+    std::string_view st;  // search responses only
+    std::string_view usn;
+    std::string_view location;
+    std::string_view server;
+    std::string_view cacheControl;
+    std::string_view bootId;  // BOOTID.UPNP.ORG
+    std::string_view nextBootId;  // NEXTBOOTID.UPNP.ORG
+    std::string_view configId;  // CONFIGID.UPNP.ORG
+
+    // NT for NOTIFY, ST for search responses
+    std::string_view target() const { return type == SSDPMessageType::Notify ? nt : st; }
+
+    // "uuid:xxx" part of the USN
+    std::string_view uuid() const;
+};
+
+// returns if the datagram looks like a SSDP message
+bool parseSSDPMessage(const char * data, std::size_t length, SSDPMessage* out);
+
+// IGD device or one of its WAN services
+bool isIGDSearchTarget(std::string_view target);
+
+// "upnp:rootdevice", which any UPnP device answers, IGDs failing to answer their own types included
+bool isRootDeviceTarget(std::string_view target);
+
+}  // namespace NetworkCandy
@@ -0,0 +1,115 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "SSDP.h"
+
+namespace NetworkCandy {
+
+// Discovery results of a crowded LAN, kept compact : strings live in arena chunks allocated as answers are kept,
+// records are fixed-size, and duplicates (same USN) or targets the filter rejects are dropped as they arrive. Nothing
+// is allocated up front; views handed out stay valid until clear(), chunks never moving.
+class SSDPDeviceTable {
+ public:
+    struct Entry {
+        std::string_view usn;
+        std::string_view st;
+        std::string_view location;
+        std::string_view server;
+        std::chrono::steady_clock::time_point seenAt;
+        uint32_t tag = 0;  // caller defined, the interface it was found on for instance
+    };
+
+    enum class Insertion {
+        Added,
+        Duplicate,  // USN already known
+        Filtered,  // not an accepted target, or not an answer / announcement
+        Full  // out of records or arena
+    };
+
+    // search targets worth keeping
+    using Filter = bool (*)(std::string_view target);
+
+    explicit SSDPDeviceTable(std::size_t maxDevices = 256, std::size_t maxBytes = 64 * 1024, Filter filter = isIGDSearchTarget);
+
+    // search responses, and ssdp:alive announcements
+    Insertion insert(const SSDPMessage& message, uint32_t tag = 0);
+    Insertion insert(std::string_view usn, std::string_view st, std::string_view location, std::string_view server, uint32_t tag = 0);
+
+    std::size_t size() const;
+    bool empty() const;
+    Entry operator[](std::size_t index) const;
+
+    // arena bytes in use
+    std::size_t bytes() const;
+
+    // everything allocated so far : arena chunks, records and hash slots
+    std::size_t reservedBytes() const;
+
+    // keeps what was allocated
+    void clear();
+
+ private:
+    static constexpr std::size_t _CHUNK_SIZE = 4096;
+
+    struct _Chunk {
+        std::unique_ptr<char[]> data;
+        std::size_t capacity;
+        std::size_t used;
+    };
+
+    struct _Record {
+        uint32_t chunk;
+        uint32_t offset;  // usn, st, location and server, one after the other
+        uint16_t usnLength;
+        uint16_t stLength;
+        uint16_t locationLength;
+        uint16_t serverLength;
+        uint32_t tag;
+        std::chrono::steady_clock::time_point seenAt;
+    };
+
+    std::size_t _maxDevices;
+    std::size_t _maxBytes;
+    Filter _filter;
+    std::vector<_Chunk> _chunks;
+    std::size_t _currentChunk = 0;
+    std::size_t _bytes = 0;
+    std::vector<_Record> _records;
+    std::vector<uint32_t> _slots;  // open addressing on USN hashes, record index + 1, 0 when free; at most half full
+
+    const char * _dataOf(const _Record& record) const;
+    std::string_view _usnOf(const _Record& record) const;
+
+    // room for "length" contiguous bytes, in the current chunk or a further one
+    char* _allocate(std::size_t length, uint32_t* chunk, uint32_t* offset);
+
+    // doubles the slots, re-placing every record
+    void _grow();
+};
+
+}  // namespace NetworkCandy
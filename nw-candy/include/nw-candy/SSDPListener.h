@@ -0,0 +1,98 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Pollable.h"
+#include "SSDP.h"
+
+namespace NetworkCandy {
+
+enum class GatewayEvent {
+    Appeared,  // first ssdp:alive seen, or alive again after a byebye
+    Rebooted,  // BOOTID.UPNP.ORG changed, or LOCATION changed for devices not sending BOOTID
+    ConfigChanged,  // CONFIGID.UPNP.ORG changed
+    Left  // ssdp:byebye
+};
+
+struct GatewayPresence {
+    std::string uuid;
+    std::string location;
+    std::string bootId;
+    std::string configId;
+    std::chrono::steady_clock::time_point lastSeen;
+    bool isAlive = false;
+};
+
+// Passively listens to the NOTIFY messages gateways multicast on 239.255.255.250:1900,
+// so that reboots and configuration changes are noticed without any active discovery.
+class SSDPListener : public Pollable {
+ public:
+    using EventCallback = std::function<void(GatewayEvent event, const GatewayPresence& gateway)>;
+
+    explicit SSDPListener(EventCallback callback);
+    ~SSDPListener();
+
+    // joins the multicast group on "interfaceIPv4", OS default if empty; returns if succeeded
+    // without "ownThread", nothing is received until process() is called from the caller's loop
+    bool start(const std::string& interfaceIPv4 = std::string(), bool ownThread = true);
+    void stop();
+    bool isRunning() const;
+
+    // only report the device announcing this description URL, any IGD if empty
+    void watchLocation(const std::string& location);
+
+    std::vector<GatewayPresence> gateways() const;
+
+    // handles a datagram as if it was received from the network
+    void ingest(const char * data, std::size_t length);
+
+    std::vector<intptr_t> fds() const override;
+    void process(const std::vector<intptr_t>& readyFds) override;
+
+ private:
+    EventCallback _callback;
+
+    mutable std::mutex _mutex;
+    std::map<std::string, GatewayPresence> _gateways;  // by uuid
+    std::string _watchedLocation;
+    std::string _watchedUUID;
+
+    intptr_t _socket = -1;
+    std::thread _thread;
+    std::atomic<bool> _running {false};
+
+    void _listen();
+    void _receive();  // what is pending, without blocking
+
+    // returns if an event has to be emitted
+    bool _update(const SSDPMessage& message, GatewayPresence* gateway, GatewayEvent* event);
+};
+
+}  // namespace NetworkCandy
@@ -0,0 +1,96 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Pollable.h"
+#include "SSDP.h"
+#include "SSDPDeviceTable.h"
+
+namespace NetworkCandy {
+
+// answer to a M-SEARCH
+struct SSDPDevice {
+    std::string usn;
+    std::string st;
+    std::string location;
+    std::string server;
+    std::chrono::steady_clock::time_point seenAt;
+};
+
+// Non-blocking IGD discovery : sends M-SEARCH and collects answers until the wait is over, either from the
+// caller's loop through Pollable, or blocking in wait(). Pass a found location to uPnPHandler::setGatewayDescriptionURL().
+class SSDPSearch : public Pollable {
+ public:
+    SSDPSearch();
+    ~SSDPSearch();
+
+    // searches from "interfaceIPv4", OS default if empty; sent again once a third of "wait" elapsed, as UDP may be lost.
+    // "destination" may be a known device, as unicast M-SEARCH are answered too; returns if sent
+    bool start(const std::string& interfaceIPv4 = std::string(),
+               std::chrono::milliseconds wait = std::chrono::milliseconds(2000),
+               const std::string& destination = SSDP_MULTICAST_ADDRESS,
+               unsigned short port = SSDP_PORT);
+    void stop();
+
+    // waited long enough, or stopped
+    bool isDone() const;
+
+    // blocks until done
+    void wait();
+
+    // IGD answers, once per USN, in arrival order; root devices instead if no IGD answered, as miniupnpc falls back to
+    std::vector<SSDPDevice> devices() const;
+    const SSDPDeviceTable& table() const;  // same, without copies; once done only
+
+    // handles a datagram as if it was received from the network
+    void ingest(const char * data, std::size_t length);
+
+    std::vector<intptr_t> fds() const override;
+    Clock::time_point nextDeadline() const override;
+    void process(const std::vector<intptr_t>& readyFds) override;
+
+ private:
+    intptr_t _socket = -1;
+    std::vector<std::string> _requests;  // one per search target
+    std::string _destination;
+    unsigned short _port = 0;
+    Clock::time_point _resendAt;
+    Clock::time_point _endsAt;
+    bool _hasResent = false;
+
+    mutable std::mutex _mutex;
+    SSDPDeviceTable _table;
+    SSDPDeviceTable _rootDevices {32, 8 * 1024, isRootDeviceTarget};
+
+    const SSDPDeviceTable& _found() const;
+
+    // returns if sent
+    bool _send();
+    void _receive();
+    void _close();
+};
+
+}  // namespace NetworkCandy
@@ -0,0 +1,100 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Pollable.h"
+
+namespace NetworkCandy {
+
+// what a STUN server sees of us
+struct StunResult {
+    bool succeeded = false;
+    std::string address;  // mapped, public address
+    unsigned short port = 0;
+    std::string server;  // the one that answered first
+    double rttMs = 0;
+};
+
+// how many address translations stand between us and the Internet
+enum class NATTopology {
+    Unknown,
+    None,  // our own address is public
+    Single,  // the IGD is the edge
+    Double,  // another NAT behind the IGD, mappings on the IGD alone will not make us reachable
+    CarrierGrade  // the IGD itself has a shared address (100.64.0.0/10), same outcome
+};
+
+// compares what the IGD reports (GetExternalIPAddress) with what STUN saw; empty when unknown
+NATTopology classifyNAT(const std::string& localIP, const std::string& gatewayExternalIP, const std::string& stunIP);
+
+// STUN (RFC 5389) Binding requests over UDP, to several servers at once, the first answer winning.
+// Follows the SSDPSearch pattern : blocking wait(), or driven by the caller's loop through Pollable.
+class StunClient : public Pollable {
+ public:
+    static constexpr unsigned short DEFAULT_PORT = 3478;
+
+    StunClient();
+    ~StunClient();
+
+    // "host[:port]" servers, resolved here (blocking); requests are sent again as RFC 5389 does, the
+    // retransmission timeout doubling from "initialRto", until "timeout"; returns if any was sent
+    bool start(const std::vector<std::string>& servers,
+               std::chrono::milliseconds timeout = std::chrono::milliseconds(1000),
+               std::chrono::milliseconds initialRto = std::chrono::milliseconds(100));
+    void stop();
+
+    // answered, timed out, or stopped
+    bool isDone() const;
+
+    // blocks until done
+    StunResult wait();
+    StunResult result() const;
+
+    std::vector<intptr_t> fds() const override;
+    Clock::time_point nextDeadline() const override;
+    void process(const std::vector<intptr_t>& readyFds) override;
+
+ private:
+    struct _Server {
+        std::string name;
+        uint32_t address = 0;  // network order
+        unsigned short port = 0;
+        uint8_t transactionId[12];
+    };
+
+    intptr_t _socket = -1;
+    std::vector<_Server> _servers;
+    Clock::time_point _startedAt;
+    Clock::time_point _retransmitAt;
+    Clock::time_point _endsAt;
+    std::chrono::milliseconds _rto {0};
+    StunResult _result;
+
+    void _send();
+    void _receive();
+    void _close();
+};
+
+}  // namespace NetworkCandy
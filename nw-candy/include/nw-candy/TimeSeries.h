@@ -0,0 +1,107 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace NetworkCandy {
+
+// Fixed-capacity ring of samples, written by a single thread and readable from any thread without locking.
+// Each slot is guarded by its own sequence counter (odd while being written), readers retry on a torn read.
+template<typename T, std::size_t N>
+class TimeSeries {
+    static_assert(std::is_trivially_copyable<T>::value, "TimeSeries samples must be trivially copyable");
+    static_assert(N > 0, "TimeSeries must hold at least one sample");
+
+ public:
+    static constexpr std::size_t capacity = N;
+
+    // single writer only
+    void push(const T& sample) {
+        auto index = _written.load(std::memory_order_relaxed);
+        auto &slot = _slots[index % N];
+
+        auto seq = slot.seq.load(std::memory_order_relaxed);
+        slot.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        std::memcpy(slot.data, &sample, sizeof(T));
+
+        slot.seq.store(seq + 2, std::memory_order_release);
+        _written.store(index + 1, std::memory_order_release);
+    }
+
+    // returns if a sample has ever been pushed
+    bool latest(T* out) const {
+        return at(0, out);
+    }
+
+    // 0 is the most recent sample, returns if such a sample is available
+    bool at(std::size_t age, T* out) const {
+        for (;;) {
+            auto written = _written.load(std::memory_order_acquire);
+            if (age >= written || age >= N) return false;
+
+            auto &slot = _slots[(written - 1 - age) % N];
+            auto before = slot.seq.load(std::memory_order_acquire);
+            if (before & 1) continue;
+
+            std::memcpy(out, slot.data, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // slot untouched and not recycled meanwhile
+            if (slot.seq.load(std::memory_order_relaxed) == before &&
+                _written.load(std::memory_order_relaxed) - written < N - age) return true;
+        }
+    }
+
+    // copies up to "max" samples, most recent first; returns how many were copied
+    std::size_t snapshot(T* out, std::size_t max) const {
+        std::size_t copied = 0;
+        while (copied < max && at(copied, &out[copied])) copied++;
+        return copied;
+    }
+
+    std::size_t size() const {
+        auto written = _written.load(std::memory_order_acquire);
+        return written < N ? static_cast<std::size_t>(written) : N;
+    }
+
+    // not thread safe, writer side only
+    void clear() {
+        _written.store(0, std::memory_order_release);
+    }
+
+ private:
+    struct Slot {
+        std::atomic<uint32_t> seq {0};
+        alignas(T) unsigned char data[sizeof(T)];
+    };
+
+    std::array<Slot, N> _slots;
+    std::atomic<uint64_t> _written {0};
+};
+
+}  // namespace NetworkCandy
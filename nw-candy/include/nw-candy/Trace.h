@@ -0,0 +1,92 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace NetworkCandy {
+
+using TraceArguments = std::vector<std::pair<std::string, std::string>>;
+
+struct TraceEvent {
+    enum class Kind {
+        SSDPResponse,  // url = LOCATION, action = ST, service = USN; at search start, lasting until received
+        Description,  // url = description URL, body = XML
+        SOAP  // url = control URL, service = service type
+    };
+
+    Kind kind = Kind::SOAP;
+    int64_t atMs = 0;  // since capture start
+    int64_t durationMs = 0;
+    std::string url;
+    std::string action;
+    std::string service;
+    TraceArguments arguments;  // SOAP in
+    int resultCode = 0;  // UPnP error code, or negative miniupnpc error
+    TraceArguments outputs;  // SOAP out
+    std::string body;
+};
+
+// SSDP / SOAP exchanges of a session, one line per event in files
+struct Trace {
+    std::vector<TraceEvent> events;
+
+    // returns if succeeded
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+
+    // returns if parsed
+    bool parse(const std::string& content);
+    std::string serialize() const;
+};
+
+// Process-wide capture of what uPnPHandler and the forwarders exchange with gateways.
+class TraceRecorder {
+ public:
+    // events are written to "path" when stopped
+    static void start(const std::string& path);
+    static void stop();
+    static bool isRecording();
+
+    static void recordSSDPResponse(std::string_view location, std::string_view st, std::string_view usn,
+                                   std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point receivedAt);
+    static void recordDescription(const char * url, const std::string& xml, std::chrono::steady_clock::time_point since);
+    static void recordSOAP(const char * controlURL, const char * serviceType, const char * action, TraceArguments arguments,
+                           int resultCode, TraceArguments outputs, std::chrono::steady_clock::time_point since);
+
+ private:
+    static inline std::mutex _mutex;
+    static inline std::atomic<bool> _recording {false};
+    static inline std::string _path;
+    static inline Trace _trace;
+    static inline std::chrono::steady_clock::time_point _startedAt;
+
+    static void _record(TraceEvent event, std::chrono::steady_clock::time_point since,
+                        std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now());
+};
+
+}  // namespace NetworkCandy
@@ -0,0 +1,121 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "SOAPScheduler.h"
+#include "TimeSeries.h"
+
+namespace NetworkCandy {
+
+// WAN side of the gateway, rates computed between two consecutive samples
+struct WANLinkQuality {
+    int64_t timestampMs = 0;  // steady clock
+    double rxBytesPerSec = 0;
+    double txBytesPerSec = 0;
+    double rxPacketsPerSec = 0;
+    double txPacketsPerSec = 0;
+    uint32_t downstreamMaxBitRate = 0;  // bits per second, 0 if the gateway does not tell
+    uint32_t upstreamMaxBitRate = 0;
+    double downstreamUsage = 0;  // throughput over capacity, 0 if capacity unknown
+    double upstreamUsage = 0;
+};
+
+// Periodically polls the WANCommonInterfaceConfig service of the IGD (total bytes / packets,
+// link max bit rates) and keeps a small fixed-memory history. Readers never lock.
+class WANLinkSampler {
+ public:
+    static constexpr std::size_t HISTORY_SIZE = 60;
+
+    using Series = TimeSeries<WANLinkQuality, HISTORY_SIZE>;
+
+    WANLinkSampler();
+    ~WANLinkSampler();
+
+    // WANCommonInterfaceConfig control URL and service type; an empty URL pauses sampling
+    void setService(const std::string& controlURL, const std::string& serviceType);
+
+    // WANIPConnection or WANPPPConnection of the same gateway, whose uptime tells counters started over
+    // with the connection from counters wrapping around; empty URL if unknown
+    void setConnectionService(const std::string& controlURL, const std::string& serviceType);
+
+    // the gateway rebooted (SSDP BOOTID...), its counters started over : the next sample only sets the baseline
+    void resetCounters();
+
+    // spawns the sampling thread, does nothing if already running
+    void start(std::chrono::milliseconds interval = std::chrono::milliseconds(5000));
+    void stop();
+    bool isRunning() const;
+
+    // takes a single sample on the calling thread, returns if succeeded
+    bool sampleOnce();
+
+    // lock-free, returns if at least one sample was computed
+    bool latest(WANLinkQuality* out) const;
+
+    // lock-free, most recent first
+    const Series& history() const;
+
+ private:
+    // 32 bits cumulative counters, as IGDs report them
+    struct Counters {
+        uint32_t bytesReceived = 0;
+        uint32_t bytesSent = 0;
+        uint32_t packetsReceived = 0;
+        uint32_t packetsSent = 0;
+    };
+
+    std::mutex _samplingMutex;
+    std::string _controlURL;
+    std::string _serviceType;
+    std::shared_ptr<SOAPScheduler> _scheduler;  // polls come last
+    std::string _connectionURL;
+    std::string _connectionType;
+    std::atomic<bool> _isResetPending {false};
+    bool _hasPrevious = false;
+    int64_t _previousMs = 0;
+    Counters _previous;
+
+    Series _series;
+
+    std::thread _thread;
+    std::atomic<bool> _running {false};
+    std::mutex _stopMutex;
+    std::condition_variable _stopCV;
+
+    // returns if the gateway answered
+    bool _readCounters(Counters* out) const;
+
+    // returns if the WAN connection came up less than "withinMs" ago, false if unknown
+    bool _hasRestarted(int64_t withinMs) const;
+
+    // same as the forwarders', so that identical polls are merged
+    std::string _requestKey(const char * action) const;
+};
+
+}  // namespace NetworkCandy
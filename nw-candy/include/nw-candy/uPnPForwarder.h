@@ -19,27 +19,55 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
+#include <vector>
+
+#include "SOAPScheduler.h"
 
 class uPnPForwarderImpl {
  public:
     uPnPForwarderImpl(const std::string& port, const std::string& PROTOCOL, const char * controlURL, const char * servicetype);
     virtual ~uPnPForwarderImpl();
 
-    // returns error code if any
-    virtual int portforwardExists(bool* isForwarded) = 0;
+    // returns error code if any; with "localIp", an entry for another client is a conflict (718), not ours
+    virtual int portforwardExists(bool* isForwarded, const char* localIp = nullptr) = 0;
     
-    // returns error code if any, defaults leaseTime to 12 hours
-    virtual int portforward(bool* isForwarded, const char* localIp, const char* leaseTime = "43200") = 0;
+    // returns error code if any, defaults leaseTime to a permanent lease
+    virtual int portforward(bool* isForwarded, const char* localIp, const char* leaseTime = "0") = 0;
 
     // returns error code if any
     virtual int removePortforward(bool* isForwarded) = 0;
 
+    // adds without checking for existence first; "isAmbiguous" is set when the answer does not tell whether the mapping is there
+    // returns error code if any, defaults leaseTime to a permanent lease
+    virtual int portforwardOptimistic(bool* isForwarded, bool* isAmbiguous, const char* localIp, const char* leaseTime = "0") = 0;
+
+    // identifies the gateway service this forwarder talks to
+    std::string serviceKey() const;
+
+    // add errors this gateway means as success, from its profile
+    void setAddSuccessCodes(const std::vector<int>& codes);
+
+    // requests still waiting for their turn then are given up (QUEUE_TIMEOUT); none by default
+    void setDeadline(NetworkCandy::SOAPScheduler::Clock::time_point deadline);
+
  protected:
     const std::string _portToForward;
     const std::string _protocol;
     const char * _controlURL;
     const char * _servicetype;
+
+    // paced along with everything else talking to this gateway
+    std::shared_ptr<NetworkCandy::SOAPScheduler> _scheduler;
+    NetworkCandy::SOAPScheduler::Clock::time_point _deadline = NetworkCandy::SOAPScheduler::Clock::time_point::max();
+
+    std::vector<int> _addSuccessCodes;
+    bool _isAddSuccess(int result) const;
+
+    // identifies a request for coalescing : service, action, and what may differ between callers
+    std::string _requestKey(const char * action, const std::string& arguments = std::string()) const;
+    static std::string _outputOf(const NetworkCandy::TraceArguments& outputs, const char * name);
 };
 
 class IGDv1Forwarder : public uPnPForwarderImpl {
@@ -47,12 +75,16 @@ class IGDv1Forwarder : public uPnPForwarderImpl {
     IGDv1Forwarder(const std::string& port, const std::string& PROTOCOL, const char * controlURL, const char * servicetype, const char * description);
     ~IGDv1Forwarder();
 
-    int portforwardExists(bool* isForwarded) final;
+    int portforwardExists(bool* isForwarded, const char* localIp) final;
     int portforward(bool* isForwarded, const char* localIp, const char* leaseTime) final;
     int removePortforward(bool* isForwarded) final;
+    int portforwardOptimistic(bool* isForwarded, bool* isAmbiguous, const char* localIp, const char* leaseTime) final;
  
  private:
     const char * _description;
+
+    // raw AddPortMapping, returns its result code
+    int _addPortMapping(const char* localIp, const char* leaseTime);
 };
 
 class IGDv2Forwarder : public uPnPForwarderImpl {
@@ -60,10 +92,14 @@ class IGDv2Forwarder : public uPnPForwarderImpl {
     IGDv2Forwarder(const std::string& port, const std::string& PROTOCOL, const char * controlURL, const char * servicetype);
     ~IGDv2Forwarder();
 
-    int portforwardExists(bool* isForwarded) final;
+    int portforwardExists(bool* isForwarded, const char* localIp) final;
     int portforward(bool* isForwarded, const char* localIp, const char* leaseTime) final;
     int removePortforward(bool* isForwarded) final;
+    int portforwardOptimistic(bool* isForwarded, bool* isAmbiguous, const char* localIp, const char* leaseTime) final;
  
  private:
     char _wp_id[16] = "\0";
+
+    // raw AddPinhole, returns its result code
+    int _addPinhole(const char* localIp, const char* leaseTime);
 };
\ No newline at end of file
@@ -26,22 +26,110 @@
 
 #include <miniupnpc/miniupnpc.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "GatewayProfiles.h"
+#include "NetworkInterfaces.h"
+#include "Reachability.h"
+#include "RetryPolicy.h"
+#include "SOAPScheduler.h"
+#include "SSDPListener.h"
+#include "Stun.h"
+#include "WANLinkSampler.h"
 #include "uPnPForwarder.h"
 
 namespace NetworkCandy {
 
+enum class AddressFamily {
+    IPv4,
+    IPv6
+};
+
+enum class ExternalAddressSource {
+    UPnP,  // GetExternalIPAddress
+    Stun
+};
+
 class uPnPHandler {
  public:
     uPnPHandler(const std::string &portToMap, const std::string &serviceDescription);
 
-    bool ensurePortMapping();  // returns if port mapping is set
+    // maps IPv4 (WANIPConnection) and pinholes IPv6 (FirewallControl) at once, when available
+    bool ensurePortMapping();  // returns if port mapping is set, on any family
     void mayDeletePortMapping();
+
+    // same, giving up once "budget" is spent, retries included
+    bool ensurePortMapping(std::chrono::milliseconds budget);
+    void mayDeletePortMapping(std::chrono::milliseconds budget);
+
+    // how gateway operations are retried and timed out
+    void setRetryOptions(const RetryOptions& options);
     ~uPnPHandler();
 
+    bool hasPortMapping(AddressFamily family) const;
+
+    // adds mappings straight away, without checking if they exist first, on gateways answering unambiguously
+    void setOptimisticMapping(bool enabled);
+
+    // forgets the known IGD, next ensurePortMapping() will discover again
+    void invalidateGateway();
+
+    // passively follows the IGD announcements, and remaps only when it rebooted or changed its configuration
+    bool watchGateway();  // returns if listening
+    void stopWatchingGateway();
+
+    // as the IGD reports it, else as STUN saw it
     const std::string externalIP() const;
     const std::string localIP() const;
+    const std::string localIP(AddressFamily family) const;
+
+    // restricts discovery to these interfaces, by name; empty means all of them. None of them being
+    // usable (down, loopback...), nothing is discovered
+    void pinInterfaces(const std::vector<std::string>& ifNames);
+
+    // never discover on these interfaces (docker bridges, management VLAN...)
+    void excludeInterfaces(const std::vector<std::string>& ifNames);
+
+    // name of the interface the IGD in use was found on, empty if unknown
+    const std::string gatewayInterface() const;
+
+    // WAN throughput and capacity, as the IGD in use reports them; start() it to poll
+    WANLinkSampler& wanLinkSampler();
+
+    // pacing of the requests sent to the IGD in use, shared with other handlers of the process; null until found
+    std::shared_ptr<SOAPScheduler> soapScheduler();
+
+    // skips SSDP discovery and uses the IGD described at this URL (known gateway, trace replay...); empty to discover again
+    void setGatewayDescriptionURL(const std::string& rootDescURL);
+
+    // checks that the IPv4 mapping really lets connections in, and records it in the gateway profile
+    ReachabilityResult checkReachability(std::chrono::milliseconds timeout = std::chrono::milliseconds(3000));
+    ReachabilityResult lastReachability() const;
+
+    // "host:port" of an echo reflector outside the LAN; hairpinning through the gateway otherwise
+    void setReflector(const std::string& hostAndPort);
+
+    // checks again periodically, while the IPv4 mapping is set
+    void scheduleReachabilityChecks(std::chrono::milliseconds interval = std::chrono::milliseconds(300000));
+    void stopReachabilityChecks();
+
+    // "host[:port]" STUN servers raced against GetExternalIPAddress on each gateway lookup, on their own thread; mappings
+    // never wait for them. None by default
+    void setStunServers(const std::vector<std::string>& servers);
+
+    // called with the first external address known, from whichever thread got it
+    void setExternalAddressCallback(const std::function<void(const std::string&, ExternalAddressSource)>& callback);
+
+    // IGD and STUN views compared, Unknown until both answered, which may be after ensurePortMapping() returned
+    NATTopology natTopology() const;
 
  protected:
     static inline const std::string PROTOCOL = "TCP";
@@ -50,43 +138,127 @@ class uPnPHandler {
  private:
     static constexpr unsigned char _TTL = 2; /* defaulting to 2 */
     static constexpr int _LOCALPORT = UPNP_LOCAL_PORT_ANY;
-    static constexpr int _DISCOVER_DELAY_MS = 2000;
-    static inline const char * _LEASE_DURATION = "0";  // infinite lease
+    static constexpr std::chrono::milliseconds _DEFAULT_BUDGET {30000};
+    static inline const char * _DEFAULT_LEASE_DURATION = "0";  // permanent, as mappings are not renewed
+    static inline const char * _FINITE_LEASE_DURATION = "43200";  // 12 hours, for gateways refusing permanent leases
+
+    void _createIGDImplementations();
+    void _deleteIGDImplementations();
+    uPnPForwarderImpl* _implV4 = nullptr;
+    uPnPForwarderImpl* _implV6 = nullptr;
+
+    std::atomic<bool> _optimisticMapping {false};
+
+    // best known strategy for this gateway model
+    GatewayIdentity _gatewayIdentity;
+    GatewayProfile _profile;
 
-    uPnPForwarderImpl* _createAppropriateIGDImplementation();
-    uPnPForwarderImpl* _impl = nullptr;
+    // returns if port mapping is set
+    bool _ensureForwarding(AddressFamily family);
+
+    // retries of gateway operations, within the budget of the ongoing call
+    RetryPolicy _policy;
+    RetryPolicy::Clock::time_point _deadline;
+
+    // an attempt of "attemptTimeout" from now, within the ongoing call budget
+    RetryPolicy::Clock::time_point _attemptDeadline(std::chrono::milliseconds attemptTimeout) const;
 
     #ifdef _WIN32
         WSADATA _wsaData;
         const WORD _requestedVersion = MAKEWORD(2, 2);
     #endif
 
+    std::mutex _mutex;
+
+    WANLinkSampler _wanLink;
+
+    mutable std::mutex _reachMutex;
+    std::string _reflector;
+    ReachabilityResult _lastReachability;
+    std::atomic<bool> _reachChecking {false};
+    std::thread _reachThread;
+    std::mutex _reachStopMutex;
+    std::condition_variable _reachStopCV;
+
+    mutable std::mutex _addressMutex;
+    std::vector<std::string> _stunServers;
+    std::string _stunExternalIP;
+    NATTopology _natTopology = NATTopology::Unknown;
+    std::function<void(const std::string&, ExternalAddressSource)> _externalAddressCallback;
+    bool _externalAddressAnnounced = false;
+    bool _isExternalIPFresh = false;  // _externalIPAddress answered by the gateway, this time
+    void _announceExternalAddress(const std::string& address, ExternalAddressSource source);
+
+    // STUN runs aside, mappings never waiting for it; whichever of both views comes last tells the NAT topology
+    std::thread _stunThread;
+    bool _isStunRunning = false;
+    bool _isUPnPPending = false;
+    bool _isTopologyPending = false;
+    void _classifyNAT();  // _addressMutex held
+
+    std::unique_ptr<SSDPListener> _listener;
+    std::atomic<bool> _gatewayLeft {false};
+    void _onGatewayEvent(GatewayEvent event);
+
+    // gateway work asked by the listener, done aside so that its thread (or the caller's loop) never blocks
+    std::thread _watchThread;
+    std::mutex _watchMutex;
+    std::condition_variable _watchCV;
+    bool _isWatching = false;
+    bool _invalidatePending = false;
+    bool _remapPending = false;
+    void _watchWork();
+    void _invalidateGateway();
+
     UPNPUrls _urls;
     IGDdatas _IGDData;
     bool _IGDFound = false;
-    UPNPDev* _devicesList = nullptr;
-    
-    bool _hasRedirect = false;
+    std::shared_ptr<SOAPScheduler> _scheduler;
+
+    // discovery results, tagged by the interface they were found on
+    struct InterfaceDiscovery {
+        NetworkInterface networkInterface;
+        UPNPDev* devices = nullptr;
+        int error = 0;
+    };
+    std::vector<InterfaceDiscovery> _discoveries;
+    bool _discoveredWithIpV6 = false;
+    void _freeDiscoveries();
+
+    std::vector<std::string> _pinnedInterfaces;
+    std::vector<std::string> _excludedInterfaces;
+    NetworkInterface _gatewayInterface;
+    std::string _gatewayDescriptionURL;
+
+    // up, multicast-capable interfaces having an address of the requested family, once pinned / excluded ones applied
+    std::vector<NetworkInterface> _candidateInterfaces(bool useIpV6) const;
+
+    // also read by the reachability thread, without the lock
+    std::atomic<bool> _hasRedirectV4 {false};
+    std::atomic<bool> _hasRedirectV6 {false};
 
     char _localIPAddress[64] = "unset"; /* my ip address on the LAN */
+    std::string _localIPv4;  // on the gateway interface
+    std::string _localIPv6;  // on the gateway interface
     char _externalIPAddress[40] = "unset"; /* my ip address on the WAN */
 
     const std::string _description;
     const std::string _targetPort;
 
     // returns error code if any
-    int _discoverDevicesIPv4();
-    int _discoverDevicesIPv6();
-    int _discoverDevices(bool useIpV6, const char * protocolDescr);
+    int _discoverDevicesIPv4(std::chrono::milliseconds delay);
+    int _discoverDevicesIPv6(std::chrono::milliseconds delay);
+    int _discoverDevices(bool useIpV6, const char * protocolDescr, std::chrono::milliseconds delay);
 
-    // returns if succeeded
-    bool _getExternalIP();
+    // returns error code if any; gives up waiting for its turn past "deadline"
+    int _getExternalIP(RetryPolicy::Clock::time_point deadline);
 
-    // returns if succeeded
-    bool _getValidIGD();
+    // returns if succeeded; descriptions not fetched within "timeout" are skipped
+    bool _getValidIGD(std::chrono::milliseconds timeout);
 
     // returns if succeeded
     bool _initUPnP();
+    bool _initIGD();
 
     bool _isIGDv2(const char * serviceType);
 };
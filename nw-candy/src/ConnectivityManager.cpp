@@ -18,7 +18,7 @@
 // different license and copyright still refer to this GPL.
 
 #include "ConnectivityManager.h"
-#include <spdlog/spdlog.h>
+#include "Log.h"
 
 #include <stdexcept>
 
@@ -83,7 +83,7 @@ void NetworkCandy::ConnectivityManager::initCOM() {
         if(!SUCCEEDED(result)) throw std::runtime_error("COM could not start");
 
         //
-        spdlog::info("nw-candy : COM initialized...");
+        NWC_LOG_INFO("nw-candy : COM initialized...");
     }
 
     {
@@ -101,7 +101,7 @@ void NetworkCandy::ConnectivityManager::initCOM() {
         }
 
         //
-        spdlog::info("nw-candy : NetworkListManager fetched...");
+        NWC_LOG_INFO("nw-candy : NetworkListManager fetched...");
     }
 
     {
@@ -116,7 +116,7 @@ void NetworkCandy::ConnectivityManager::initCOM() {
         }
 
         //
-        spdlog::info("nw-candy : ConnectionPointContainer fetched...");
+        NWC_LOG_INFO("nw-candy : ConnectionPointContainer fetched...");
     }
 
     {
@@ -132,7 +132,7 @@ void NetworkCandy::ConnectivityManager::initCOM() {
         }
 
         //
-        spdlog::info("nw-candy : ConnectionPoint found...");
+        NWC_LOG_INFO("nw-candy : ConnectionPoint found...");
     }
 
     {
@@ -149,32 +149,35 @@ void NetworkCandy::ConnectivityManager::initCOM() {
         }
 
         //
-        spdlog::info("nw-candy : Sink bound... OK!");
+        NWC_LOG_INFO("nw-candy : Sink bound... OK!");
     }
 }
 
 void NetworkCandy::ConnectivityManager::releaseCOM() {
     //
-    spdlog::info("nw-candy : Releasing COM...");
+    NWC_LOG_INFO("nw-candy : Releasing COM...");
 
     this->Release();
     _cp->Unadvise(_cookie);
     _cp->Release();
     _managerCPC->Release();
     _manager->Release();
+    _manager = nullptr;
+    _hasReportedInitial = false;
     CoUninitialize();
 
     //
-    spdlog::info("nw-candy : Releasing COM OK!");
+    NWC_LOG_INFO("nw-candy : Releasing COM OK!");
 }
 
 void NetworkCandy::ConnectivityManager::listenForConnectivityChanges() {
     MSG msg;
     WINBOOL bRet;
+    _listeningThreadId = GetCurrentThreadId();
     while((bRet = GetMessage(&msg, NULL, 0, 0 )) != 0) {
         //
         if (bRet == -1) {
-            spdlog::info("nw-candy : STOP message received, listening end.");
+            NWC_LOG_INFO("nw-candy : STOP message received, listening end.");
             break;
         }
 
@@ -183,10 +186,49 @@ void NetworkCandy::ConnectivityManager::listenForConnectivityChanges() {
         DispatchMessage(&msg);
 
         //
-        spdlog::info("nw-candy : COM message Dispatched !");
+        NWC_LOG_DEBUG("nw-candy : COM message Dispatched !");
+    }
+}
+
+void NetworkCandy::ConnectivityManager::stopListening() {
+    if (_listeningThreadId) PostThreadMessage(_listeningThreadId, WM_QUIT, 0, 0);
+}
+
+std::vector<intptr_t> NetworkCandy::ConnectivityManager::fds() const {
+    return {};
+}
+
+NetworkCandy::Pollable::Clock::time_point NetworkCandy::ConnectivityManager::nextDeadline() const {
+    if (!_manager) return Clock::time_point::max();
+    if (!_hasReportedInitial) return Clock::now();
+
+    // no handle to wait on from the caller loop, messages are pumped periodically instead
+    return Clock::now() + std::chrono::milliseconds(100);
+}
+
+void NetworkCandy::ConnectivityManager::process(const std::vector<intptr_t>&) {
+    if (!_manager) return;
+
+    // COM only tells about changes
+    if (!_hasReportedInitial) {
+        NLM_CONNECTIVITY connectivity;
+        if (SUCCEEDED(_manager->GetConnectivity(&connectivity))) ConnectivityChanged(connectivity);
+        _hasReportedInitial = true;
+    }
+
+    // whatever is pending, never waiting for more
+    MSG msg;
+    while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+        NWC_LOG_DEBUG("nw-candy : COM message Dispatched !");
     }
 }
 
 void NetworkCandy::ConnectivityManager::_connectivityChanged(bool isConnectedToInternet) {
-    spdlog::info("Connectivity changed : {}", isConnectedToInternet);
+    NWC_LOG_INFO("Connectivity changed : {}", isConnectedToInternet);
+}
+
+NetworkCandy::InterfaceSampler& NetworkCandy::ConnectivityManager::interfaceSampler() {
+    return _sampler;
 }
@@ -0,0 +1,207 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "ConnectivityManager.h"
+#include "Netlink.h"
+#include "Log.h"
+
+#include <net/if.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <set>
+#include <stdexcept>
+
+NetworkCandy::ConnectivityManager::ConnectivityManager() {}
+NetworkCandy::ConnectivityManager::~ConnectivityManager() {}
+
+bool NetworkCandy::ConnectivityManager::isConnectedToInternet() {
+    if(_queryFd < 0) throw std::runtime_error("Could not know if connected to internet");
+    return _hasDefaultRoute();
+}
+
+void NetworkCandy::ConnectivityManager::initCOM() {
+    {
+        // socket for link, address and route notifications
+        _eventsFd = Netlink::open(
+            RTMGRP_LINK |
+            RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+            RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE
+        );
+
+        //
+        if(_eventsFd < 0) throw std::runtime_error("Could not open rtnetlink events socket");
+
+        //
+        NWC_LOG_INFO("nw-candy : rtnetlink events socket opened...");
+    }
+
+    {
+        // socket for dumps, kept apart so answers do not mix with notifications
+        _queryFd = Netlink::open();
+
+        //
+        if(_queryFd < 0) {
+            Netlink::close(_eventsFd);
+            throw std::runtime_error("Could not open rtnetlink query socket");
+        }
+
+        //
+        NWC_LOG_INFO("nw-candy : rtnetlink query socket opened...");
+    }
+
+    {
+        //
+        _stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        //
+        if(_stopFd < 0) {
+            Netlink::close(_queryFd);
+            Netlink::close(_eventsFd);
+            throw std::runtime_error("Could not create stop eventfd");
+        }
+
+        //
+        NWC_LOG_INFO("nw-candy : rtnetlink ready... OK!");
+    }
+}
+
+void NetworkCandy::ConnectivityManager::releaseCOM() {
+    //
+    NWC_LOG_INFO("nw-candy : Releasing rtnetlink...");
+
+    if(_stopFd >= 0) close(_stopFd);
+    Netlink::close(_queryFd);
+    Netlink::close(_eventsFd);
+    _stopFd = _queryFd = _eventsFd = -1;
+
+    //
+    NWC_LOG_INFO("nw-candy : Releasing rtnetlink OK!");
+}
+
+void NetworkCandy::ConnectivityManager::listenForConnectivityChanges() {
+    // initial state
+    _hasProcessed = false;
+    _evaluate();
+
+    pollfd fds[2] = {
+        { _eventsFd, POLLIN, 0 },
+        { _stopFd, POLLIN, 0 }
+    };
+
+    while(true) {
+        //
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            NWC_LOG_WARN("nw-candy : poll() failed, listening end.");
+            break;
+        }
+
+        //
+        if (fds[1].revents & POLLIN) {
+            uint64_t value;
+            if (read(_stopFd, &value, sizeof(value))) {}
+            NWC_LOG_INFO("nw-candy : STOP message received, listening end.");
+            break;
+        }
+
+        //
+        process({ _eventsFd });
+    }
+}
+
+std::vector<intptr_t> NetworkCandy::ConnectivityManager::fds() const {
+    if (_eventsFd < 0) return {};
+    return { _eventsFd };
+}
+
+NetworkCandy::Pollable::Clock::time_point NetworkCandy::ConnectivityManager::nextDeadline() const {
+    // initial state not reported yet, due now
+    return _eventsFd >= 0 && !_hasProcessed ? Clock::now() : Clock::time_point::max();
+}
+
+void NetworkCandy::ConnectivityManager::process(const std::vector<intptr_t>& readyFds) {
+    if (_eventsFd < 0) return;
+
+    // drain; the content does not matter, any change triggers a re-evaluation
+    for (auto fd : readyFds) {
+        if (fd != _eventsFd) continue;
+
+        alignas(nlmsghdr) char buffer[8192];
+        auto received = recv(_eventsFd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        while (received > 0) received = recv(_eventsFd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    }
+
+    //
+    _evaluate();
+}
+
+void NetworkCandy::ConnectivityManager::_evaluate() {
+    auto isConnected = _hasDefaultRoute();
+    if (!_hasProcessed || isConnected != _bInternet) {
+        _bInternet = isConnected;
+        _connectivityChanged(isConnected);
+        _hasProcessed = true;
+    }
+}
+
+void NetworkCandy::ConnectivityManager::stopListening() {
+    uint64_t value = 1;
+    if(_stopFd >= 0 && write(_stopFd, &value, sizeof(value))) {}
+}
+
+bool NetworkCandy::ConnectivityManager::_hasDefaultRoute() {
+    // running interfaces
+    std::set<int> runningLinks;
+    Netlink::dump(_queryFd, RTM_GETLINK, AF_UNSPEC, [&runningLinks](const nlmsghdr* msg) {
+        if (msg->nlmsg_type != RTM_NEWLINK) return;
+        auto info = (const ifinfomsg*)NLMSG_DATA(msg);
+        if ((info->ifi_flags & IFF_RUNNING) && !(info->ifi_flags & IFF_LOOPBACK)) {
+            runningLinks.insert(info->ifi_index);
+        }
+    });
+
+    if (runningLinks.empty()) return false;
+
+    // default routes of the main table going through any of them
+    bool hasDefault = false;
+    Netlink::dump(_queryFd, RTM_GETROUTE, AF_UNSPEC, [&](const nlmsghdr* msg) {
+        if (hasDefault || msg->nlmsg_type != RTM_NEWROUTE) return;
+        auto route = (const rtmsg*)NLMSG_DATA(msg);
+        if (route->rtm_dst_len != 0 || route->rtm_table != RT_TABLE_MAIN) return;
+
+        Netlink::forEachAttribute(msg, sizeof(rtmsg), [&](const rtattr* attr) {
+            if (attr->rta_type != RTA_OIF) return;
+            auto oif = *(const int*)RTA_DATA(attr);
+            if (runningLinks.count(oif)) hasDefault = true;
+        });
+    });
+
+    return hasDefault;
+}
+
+void NetworkCandy::ConnectivityManager::_connectivityChanged(bool isConnectedToInternet) {
+    NWC_LOG_INFO("Connectivity changed : {}", isConnectedToInternet);
+}
+
+NetworkCandy::InterfaceSampler& NetworkCandy::ConnectivityManager::interfaceSampler() {
+    return _sampler;
+}
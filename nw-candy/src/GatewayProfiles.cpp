@@ -0,0 +1,337 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "GatewayProfiles.h"
+#include "GatewayProfilesSeed.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+std::string _trim(const std::string& value) {
+    auto begin = value.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) return std::string();
+    auto end = value.find_last_not_of(" \t\r\n");
+    return value.substr(begin, end - begin + 1);
+}
+
+// key separators are not allowed within parts
+std::string _sanitize(const std::string& value) {
+    auto out = _trim(value);
+    for (auto &c : out) {
+        if (c == '|' || c == '[' || c == ']' || c == '\n' || c == '\r') c = ' ';
+    }
+    return out.empty() ? "*" : out;
+}
+
+// first occurrence of <tag>...</tag>, empty if none
+std::string _xmlValue(const std::string& xml, const std::string& tag) {
+    auto open = "<" + tag + ">";
+    auto begin = xml.find(open);
+    if (begin == std::string::npos) return std::string();
+    begin += open.size();
+    auto end = xml.find("</" + tag + ">", begin);
+    if (end == std::string::npos) return std::string();
+    return _trim(xml.substr(begin, end - begin));
+}
+
+const char * _supportToString(NetworkCandy::Support support) {
+    switch (support) {
+        case NetworkCandy::Support::Works:
+            return "works";
+        case NetworkCandy::Support::Fails:
+            return "fails";
+        default:
+            return "unknown";
+    }
+}
+
+NetworkCandy::Support _supportFromString(const std::string& value) {
+    if (value == "works") return NetworkCandy::Support::Works;
+    if (value == "fails") return NetworkCandy::Support::Fails;
+    return NetworkCandy::Support::Unknown;
+}
+
+// "501, 718"
+std::vector<int> _codesFromString(const std::string& value) {
+    std::vector<int> codes;
+    std::istringstream in(value);
+    std::string code;
+    while (std::getline(in, code, ',')) {
+        code = _trim(code);
+        if (!code.empty()) codes.push_back(std::atoi(code.c_str()));
+    }
+    return codes;
+}
+
+// returns if the key is known
+bool _assign(NetworkCandy::GatewayServiceProfile& service, const std::string& field, const std::string& value) {
+    if (field == "mapping") service.mapping = _supportFromString(value);
+    else if (field == "failedAt") service.failedAt = std::atoll(value.c_str());
+    else if (field == "optimistic") service.optimistic = _supportFromString(value);
+    else if (field == "lease") service.leaseDuration = value;
+    else if (field == "checkMs") service.checkLatencyMs = std::atof(value.c_str());
+    else if (field == "addMs") service.addLatencyMs = std::atof(value.c_str());
+    else if (field == "reachable") service.reachable = _supportFromString(value);
+    else if (field == "hairpin") service.hairpin = _supportFromString(value);
+    else if (field == "reachMs") service.reachLatencyMs = std::atof(value.c_str());
+    else if (field == "addSuccess") service.addSuccessCodes = _codesFromString(value);
+    else return false;
+    return true;
+}
+
+void _serializeService(std::ostringstream& out, const char * family, const NetworkCandy::GatewayServiceProfile& service) {
+    if (service.mapping != NetworkCandy::Support::Unknown) out << family << ".mapping = " << _supportToString(service.mapping) << '\n';
+    if (service.failedAt) out << family << ".failedAt = " << service.failedAt << '\n';
+    if (service.optimistic != NetworkCandy::Support::Unknown) out << family << ".optimistic = " << _supportToString(service.optimistic) << '\n';
+    if (!service.leaseDuration.empty()) out << family << ".lease = " << service.leaseDuration << '\n';
+    if (service.checkLatencyMs > 0) out << family << ".checkMs = " << service.checkLatencyMs << '\n';
+    if (service.addLatencyMs > 0) out << family << ".addMs = " << service.addLatencyMs << '\n';
+    if (service.reachable != NetworkCandy::Support::Unknown) out << family << ".reachable = " << _supportToString(service.reachable) << '\n';
+    if (service.hairpin != NetworkCandy::Support::Unknown) out << family << ".hairpin = " << _supportToString(service.hairpin) << '\n';
+    if (service.reachLatencyMs > 0) out << family << ".reachMs = " << service.reachLatencyMs << '\n';
+    for (std::size_t i = 0; i < service.addSuccessCodes.size(); i++) {
+        out << (i ? ", " : family + std::string(".addSuccess = ")) << service.addSuccessCodes[i];
+    }
+    if (!service.addSuccessCodes.empty()) out << '\n';
+}
+
+// known values of "from" replace those of "into"
+void _overlay(NetworkCandy::GatewayServiceProfile& into, const NetworkCandy::GatewayServiceProfile& from) {
+    if (from.mapping != NetworkCandy::Support::Unknown) {
+        into.mapping = from.mapping;
+        into.failedAt = from.failedAt;
+    }
+    if (from.optimistic != NetworkCandy::Support::Unknown) into.optimistic = from.optimistic;
+    if (!from.leaseDuration.empty()) into.leaseDuration = from.leaseDuration;
+    if (from.checkLatencyMs > 0) into.checkLatencyMs = from.checkLatencyMs;
+    if (from.addLatencyMs > 0) into.addLatencyMs = from.addLatencyMs;
+    if (from.reachable != NetworkCandy::Support::Unknown) into.reachable = from.reachable;
+    if (from.hairpin != NetworkCandy::Support::Unknown) into.hairpin = from.hairpin;
+    if (from.reachLatencyMs > 0) into.reachLatencyMs = from.reachLatencyMs;
+    if (!from.addSuccessCodes.empty()) into.addSuccessCodes = from.addSuccessCodes;
+}
+
+}  // namespace
+
+std::string NetworkCandy::GatewayIdentity::key() const {
+    return _sanitize(manufacturer) + '|' + _sanitize(model) + '|' + _sanitize(firmware);
+}
+
+bool NetworkCandy::GatewayServiceProfile::isKnownToFail(std::chrono::system_clock::time_point now) const {
+    if (mapping != Support::Fails) return false;
+    if (!failedAt) return true;
+
+    auto since = std::chrono::system_clock::time_point(std::chrono::seconds(failedAt));
+    return now - since < GatewayProfiles::FAILURE_EXPIRY;
+}
+
+bool NetworkCandy::GatewayServiceProfile::isAddSuccess(int errorCode) const {
+    return std::find(addSuccessCodes.begin(), addSuccessCodes.end(), errorCode) != addSuccessCodes.end();
+}
+
+bool NetworkCandy::isCapabilityFailure(int errorCode) {
+    return errorCode == 401 || errorCode == 602;
+}
+
+bool NetworkCandy::parseGatewayIdentity(const std::string& rootDescription, GatewayIdentity* out) {
+    out->manufacturer = _xmlValue(rootDescription, "manufacturer");
+    out->model = _xmlValue(rootDescription, "modelName");
+    out->firmware = _xmlValue(rootDescription, "modelNumber");
+
+    return !out->manufacturer.empty() || !out->model.empty();
+}
+
+NetworkCandy::GatewayProfiles::GatewayProfiles() {
+    _parse(GATEWAY_PROFILES_SEED, &_seeds);
+}
+
+NetworkCandy::GatewayProfiles::~GatewayProfiles() {
+    flush();
+}
+
+NetworkCandy::GatewayProfiles& NetworkCandy::GatewayProfiles::shared() {
+    static GatewayProfiles profiles;
+    return profiles;
+}
+
+bool NetworkCandy::GatewayProfiles::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) return false;
+
+    std::stringstream content;
+    content << file.rdbuf();
+
+    NWC_LOG_INFO("UPNP Profile : loading gateway profiles from {}", path);
+    return parse(content.str());
+}
+
+bool NetworkCandy::GatewayProfiles::save(const std::string& path) const {
+    return _write(path, serialize());
+}
+
+bool NetworkCandy::GatewayProfiles::_write(const std::string& path, const std::string& content) {
+    std::ofstream file(path, std::ios::trunc);
+    if (!file) {
+        NWC_LOG_WARN("UPNP Profile : cannot write gateway profiles to {}", path);
+        return false;
+    }
+
+    file << content;
+    return true;
+}
+
+void NetworkCandy::GatewayProfiles::setPersistencePath(const std::string& path) {
+    load(path);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _persistencePath = path;
+}
+
+bool NetworkCandy::GatewayProfiles::flush() {
+    std::lock_guard<std::mutex> flushLock(_flushMutex);
+
+    std::string path, content;
+    uint64_t changes;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_persistencePath.empty() || _changes == _flushedChanges) return false;
+        path = _persistencePath;
+        changes = _changes;
+        content = _serialize();
+    }
+
+    // lookups and updates go on meanwhile
+    if (!_write(path, content)) return false;
+    _flushedChanges = changes;
+    return true;
+}
+
+NetworkCandy::GatewayProfile NetworkCandy::GatewayProfiles::find(const GatewayIdentity& identity) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _find(identity);
+}
+
+NetworkCandy::GatewayProfile NetworkCandy::GatewayProfiles::_find(const GatewayIdentity& identity) const {
+    auto manufacturer = _sanitize(identity.manufacturer);
+    auto model = _sanitize(identity.model);
+    auto firmware = _sanitize(identity.firmware);
+
+    // widest first, so that narrower ones override it
+    const std::string candidates[] = {
+        "*|*|*",
+        manufacturer + "|*|*",
+        manufacturer + '|' + model + "|*",
+        manufacturer + '|' + model + '|' + firmware
+    };
+
+    GatewayProfile merged;
+    for (auto &key : candidates) {
+        for (auto profiles : { &_seeds, &_profiles }) {
+            auto found = profiles->find(key);
+            if (found == profiles->end()) continue;
+            _overlay(merged.ipv4, found->second.ipv4);
+            _overlay(merged.ipv6, found->second.ipv6);
+        }
+    }
+
+    auto learnt = _profiles.find(identity.key());
+    if (learnt != _profiles.end()) merged.sessions = learnt->second.sessions;
+
+    return merged;
+}
+
+void NetworkCandy::GatewayProfiles::update(const GatewayIdentity& identity, const std::function<void(GatewayProfile&)>& updater) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // only what is learnt about this identity, seeds and wider matches stay where they are
+    updater(_profiles[identity.key()]);
+    _changes++;
+}
+
+bool NetworkCandy::GatewayProfiles::parse(const std::string& content) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _parse(content, &_profiles);
+}
+
+bool NetworkCandy::GatewayProfiles::_parse(const std::string& content, std::map<std::string, GatewayProfile>* into) {
+    std::istringstream in(content);
+    std::string line;
+    GatewayProfile* current = nullptr;
+    unsigned int lineNumber = 0;
+
+    while (std::getline(in, line)) {
+        lineNumber++;
+        line = _trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+
+        // section
+        if (line.front() == '[') {
+            if (line.back() != ']') {
+                NWC_LOG_WARN("UPNP Profile : malformed section at line {}", lineNumber);
+                return false;
+            }
+            current = &(*into)[line.substr(1, line.size() - 2)];
+            continue;
+        }
+
+        auto equal = line.find('=');
+        if (!current || equal == std::string::npos) {
+            NWC_LOG_WARN("UPNP Profile : unexpected line {}", lineNumber);
+            return false;
+        }
+
+        auto name = _trim(line.substr(0, equal));
+        auto value = _trim(line.substr(equal + 1));
+
+        auto known = false;
+        if (name == "sessions") {
+            current->sessions = std::atoi(value.c_str());
+            known = true;
+        } else if (name.rfind("ipv4.", 0) == 0) {
+            known = _assign(current->ipv4, name.substr(5), value);
+        } else if (name.rfind("ipv6.", 0) == 0) {
+            known = _assign(current->ipv6, name.substr(5), value);
+        }
+
+        if (!known) NWC_LOG_WARN("UPNP Profile : unknown key \"{}\" at line {}, ignored", name, lineNumber);
+    }
+
+    return true;
+}
+
+std::string NetworkCandy::GatewayProfiles::serialize() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _serialize();
+}
+
+std::string NetworkCandy::GatewayProfiles::_serialize() const {
+    std::ostringstream out;
+    for (auto &pair : _profiles) {
+        out << '[' << pair.first << "]\n";
+        if (pair.second.sessions) out << "sessions = " << pair.second.sessions << '\n';
+        _serializeService(out, "ipv4", pair.second.ipv4);
+        _serializeService(out, "ipv6", pair.second.ipv6);
+        out << '\n';
+    }
+    return out.str();
+}
@@ -18,8 +18,8 @@
 // different license and copyright still refer to this GPL.
 
 #include "uPnPForwarder.h"
-
-#include <spdlog/spdlog.h>
+#include "Trace.h"
+#include "Log.h"
 
 #include <miniupnpc/upnpcommands.h>
 #include <miniupnpc/upnperrors.h>
@@ -29,70 +29,106 @@ IGDv1Forwarder::IGDv1Forwarder(const std::string& port, const std::string& PROTO
 
 IGDv1Forwarder::~IGDv1Forwarder() {}
 
-int IGDv1Forwarder::portforwardExists(bool* isForwarded) {
-    // getter args
-    char intClient[16];
-    char intPort[6];
-    char duration[16];
-
+int IGDv1Forwarder::portforwardExists(bool* isForwarded, const char* localIp) {
     // request
-    auto result = UPNP_GetSpecificPortMappingEntry(
-        _controlURL,
-        _servicetype,
-        _portToForward.c_str(),
-        _protocol.c_str(),
-        "*" /*remoteHost*/,
-        intClient,
-        intPort,
-        NULL /*desc*/,
-        NULL /*enabled*/,
-        duration
-    );
+    NetworkCandy::TraceArguments outputs;
+    auto result = _scheduler->run(NetworkCandy::SOAPPriority::Check, _requestKey("GetSpecificPortMappingEntry"), [this](NetworkCandy::TraceArguments& out) {
+        // getter args
+        char intClient[16];
+        char intPort[6];
+        char duration[16];
+
+        auto start = std::chrono::steady_clock::now();
+        auto result = UPNP_GetSpecificPortMappingEntry(
+            _controlURL,
+            _servicetype,
+            _portToForward.c_str(),
+            _protocol.c_str(),
+            "*" /*remoteHost*/,
+            intClient,
+            intPort,
+            NULL /*desc*/,
+            NULL /*enabled*/,
+            duration
+        );
+        if (result == UPNPCOMMAND_SUCCESS) {
+            out = { {"NewInternalClient", intClient}, {"NewInternalPort", intPort}, {"NewLeaseDuration", duration} };
+        }
+        NetworkCandy::TraceRecorder::recordSOAP(_controlURL, _servicetype, "GetSpecificPortMappingEntry",
+            { {"NewRemoteHost", "*"}, {"NewExternalPort", _portToForward}, {"NewProtocol", _protocol} },
+            result, out, start
+        );
+        return result;
+    }, &outputs, _deadline);
 
     // no redirect acked
     if(result == 714) {
-        spdlog::info("UPNP CheckRedirect : GetSpecificPortMappingEntry() found no existing entry");
+        NWC_LOG_INFO("UPNP CheckRedirect : GetSpecificPortMappingEntry() found no existing entry");
         *isForwarded = false;
         return 0;
     }
 
     // if any code
     if (result != UPNPCOMMAND_SUCCESS) {
-        spdlog::warn("UPNP CheckRedirect : GetSpecificPortMappingEntry() failed with code {} ({})", result, strupnperror(result));
+        NWC_LOG_WARN("UPNP CheckRedirect : GetSpecificPortMappingEntry() failed with code {} ({})", result, strupnperror(result));
         return result;
     }
 
     // else, has redirect
-    spdlog::info("UPNP CheckRedirect : {}[{}] is redirected to internal {} : {} (duration={})",
-        _portToForward, _protocol, intClient, intPort, duration
+    auto internalClient = _outputOf(outputs, "NewInternalClient");
+    auto internalPort = _outputOf(outputs, "NewInternalPort");
+    NWC_LOG_INFO("UPNP CheckRedirect : {}[{}] is redirected to internal {} : {} (duration={})",
+        _portToForward, _protocol, internalClient, internalPort, _outputOf(outputs, "NewLeaseDuration")
     );
+
+    // ... to another host of the LAN, or another port of ours
+    if (localIp && (internalClient != localIp || internalPort != _portToForward)) {
+        NWC_LOG_WARN("UPNP CheckRedirect : {}[{}] is held by {} : {}, not by us", _portToForward, _protocol, internalClient, internalPort);
+        *isForwarded = false;
+        return 718;
+    }
+
     *isForwarded = true;
     return 0;
 }
 
+int IGDv1Forwarder::_addPortMapping(const char* localIp, const char* leaseTime) {
+    auto key = _requestKey("AddPortMapping", std::string(localIp) + '|' + leaseTime);
+    return _scheduler->run(NetworkCandy::SOAPPriority::Mapping, key, [this, localIp, leaseTime](NetworkCandy::TraceArguments&) {
+        auto start = std::chrono::steady_clock::now();
+        auto result = UPNP_AddPortMapping(
+            _controlURL,
+            _servicetype,
+            _portToForward.c_str(),
+            _portToForward.c_str(),
+            localIp,
+            _description,
+            _protocol.c_str(),
+            NULL /*remoteHost*/,
+            leaseTime
+        );
+        NetworkCandy::TraceRecorder::recordSOAP(_controlURL, _servicetype, "AddPortMapping",
+            { {"NewExternalPort", _portToForward}, {"NewProtocol", _protocol}, {"NewInternalPort", _portToForward},
+              {"NewInternalClient", localIp}, {"NewLeaseDuration", leaseTime} },
+            result, {}, start
+        );
+        return result;
+    }, nullptr, _deadline);
+}
+
 int IGDv1Forwarder::portforward(bool* isForwarded, const char* localIp, const char* leaseTime) {
-    auto result = UPNP_AddPortMapping(
-        _controlURL,
-        _servicetype,
-        _portToForward.c_str(),
-        _portToForward.c_str(),
-        localIp,
-        _description,
-        _protocol.c_str(),
-        NULL /*remoteHost*/,
-        leaseTime
-    );
+    auto result = _addPortMapping(localIp, leaseTime);
 
-    // Action failed, most possibly on already existing mapping
-    if (result == 501) {
-        spdlog::warn("UPNP AskRedirect : AddPortMapping() failed on 501 error, but considering that mapping already exist");
+    // most possibly on already existing mapping, for this gateway (501 ActionFailed on many)
+    if (_isAddSuccess(result)) {
+        NWC_LOG_WARN("UPNP AskRedirect : AddPortMapping() failed on {} error, but considering that mapping already exist", result);
         *isForwarded = true;
         return 0;
     }
 
     // check if error
     if (result != UPNPCOMMAND_SUCCESS) {
-        spdlog::warn("UPNP AskRedirect : AddPortMapping({},{}, {}) failed with code {} ({})",
+        NWC_LOG_WARN("UPNP AskRedirect : AddPortMapping({},{}, {}) failed with code {} ({})",
             _portToForward, _portToForward, localIp, result, strupnperror(result)
         );
         return result;
@@ -100,29 +136,64 @@ int IGDv1Forwarder::portforward(bool* isForwarded, const char* localIp, const ch
 
     // success !
     *isForwarded = true;
-    spdlog::info("UPNP AskRedirect : Redirection OK !");
+    NWC_LOG_INFO("UPNP AskRedirect : Redirection OK !");
     return 0;
 }
 
 int IGDv1Forwarder::removePortforward(bool* isForwarded) {
     // request
-    auto result = UPNP_DeletePortMapping(
-        _controlURL,
-        _servicetype,
-        _portToForward.c_str(),
-        _protocol.c_str(),
-        NULL /*remoteHost*/
-    );
+    auto result = _scheduler->run(NetworkCandy::SOAPPriority::Mapping, _requestKey("DeletePortMapping"), [this](NetworkCandy::TraceArguments&) {
+        auto start = std::chrono::steady_clock::now();
+        auto result = UPNP_DeletePortMapping(
+            _controlURL,
+            _servicetype,
+            _portToForward.c_str(),
+            _protocol.c_str(),
+            NULL /*remoteHost*/
+        );
+        NetworkCandy::TraceRecorder::recordSOAP(_controlURL, _servicetype, "DeletePortMapping",
+            { {"NewExternalPort", _portToForward}, {"NewProtocol", _protocol} }, result, {}, start
+        );
+        return result;
+    }, nullptr, _deadline);
 
     // check error
     if (result != UPNPCOMMAND_SUCCESS) {
-        spdlog::warn("UPNP RemoveRedirect : UPNP_DeletePortMapping() failed with code :{}", result);
+        NWC_LOG_WARN("UPNP RemoveRedirect : UPNP_DeletePortMapping() failed with code :{}", result);
         return result;
     }
 
     // success
-    spdlog::info("UPNP RemoveRedirect : UPNP_DeletePortMapping() succeeded !");
+    NWC_LOG_INFO("UPNP RemoveRedirect : UPNP_DeletePortMapping() succeeded !");
     *isForwarded = false;
 
     return 0;
-}
\ No newline at end of file
+}
+
+int IGDv1Forwarder::portforwardOptimistic(bool* isForwarded, bool* isAmbiguous, const char* localIp, const char* leaseTime) {
+    auto result = _addPortMapping(localIp, leaseTime);
+    *isAmbiguous = false;
+
+    // success !
+    if (result == UPNPCOMMAND_SUCCESS) {
+        *isForwarded = true;
+        NWC_LOG_INFO("UPNP AskRedirect : Optimistic redirection OK !");
+        return 0;
+    }
+
+    // 501 (ActionFailed) might just mean that our mapping is already there; 718 (ConflictInMappingEntry)
+    // being another client's, it is a failure
+    if (result == 501) {
+        NWC_LOG_INFO("UPNP AskRedirect : optimistic AddPortMapping() answered {} ({}), cannot tell if mapping exists",
+            result, strupnperror(result)
+        );
+        *isAmbiguous = true;
+        return result;
+    }
+
+    //
+    NWC_LOG_WARN("UPNP AskRedirect : optimistic AddPortMapping({},{}, {}) failed with code {} ({})",
+        _portToForward, _portToForward, localIp, result, strupnperror(result)
+    );
+    return result;
+}
@@ -18,66 +18,102 @@
 // different license and copyright still refer to this GPL.
 
 #include "uPnPForwarder.h"
-
-#include <spdlog/spdlog.h>
+#include "Trace.h"
+#include "Log.h"
 
 #include <miniupnpc/upnpcommands.h>
 #include <miniupnpc/upnperrors.h>
 
+#include <algorithm>
+
 IGDv2Forwarder::IGDv2Forwarder(const std::string& port, const std::string& PROTOCOL, const char * controlURL, const char * servicetype) : 
     uPnPForwarderImpl(port, PROTOCOL, controlURL, servicetype) { }
 
 IGDv2Forwarder::~IGDv2Forwarder() {}
 
-int IGDv2Forwarder::portforwardExists(bool* isForwarded) {
-    int firewallEnabled = 0, pinholingAllowed = 0;
-    auto result = UPNP_GetFirewallStatus(_controlURL, _servicetype, &firewallEnabled, &pinholingAllowed);
+// firewall wide, whoever the client
+int IGDv2Forwarder::portforwardExists(bool* isForwarded, const char*) {
+    NetworkCandy::TraceArguments outputs;
+    auto result = _scheduler->run(NetworkCandy::SOAPPriority::Check, _requestKey("GetFirewallStatus"), [this](NetworkCandy::TraceArguments& out) {
+        int firewallEnabled = 0, pinholingAllowed = 0;
+        auto start = std::chrono::steady_clock::now();
+        auto result = UPNP_GetFirewallStatus(_controlURL, _servicetype, &firewallEnabled, &pinholingAllowed);
+        out = { {"FirewallEnabled", std::to_string(firewallEnabled)}, {"InboundPinholeAllowed", std::to_string(pinholingAllowed)} };
+        NetworkCandy::TraceRecorder::recordSOAP(_controlURL, _servicetype, "GetFirewallStatus", {}, result, out, start);
+        return result;
+    }, &outputs, _deadline);
+    auto firewallEnabled = _outputOf(outputs, "FirewallEnabled") == "1";
+    auto pinholingAllowed = _outputOf(outputs, "InboundPinholeAllowed") == "1";
 
     if (result != UPNPCOMMAND_SUCCESS) {
-        spdlog::warn("UPNP CheckRedirect : GetFirewallStatus() failed with code {} ({})", result, strupnperror(result));
+        NWC_LOG_WARN("UPNP CheckRedirect : GetFirewallStatus() failed with code {} ({})", result, strupnperror(result));
         return result;
     }
 
     // if firewall is not enabled, no need to pinhole !
     if(!firewallEnabled) {
-        spdlog::info("UPNP CheckRedirect : Firewall is disabled, no need to pinhole !");
+        NWC_LOG_INFO("UPNP CheckRedirect : Firewall is disabled, no need to pinhole !");
         *isForwarded = true;
         return 0;
     } else if(!pinholingAllowed) {
-        spdlog::warn("UPNP CheckRedirect : Firewall is active, and pinholing is not allowed !");
+        NWC_LOG_WARN("UPNP CheckRedirect : Firewall is active, and pinholing is not allowed !");
         return -123;
     }
 
-    spdlog::info("UPNP CheckRedirect : Firewall active and allowing pinholing. Continuing...");
+    NWC_LOG_INFO("UPNP CheckRedirect : Firewall active and allowing pinholing. Continuing...");
     
     // always go for pinholing
     *isForwarded = false;
     return 0;
 }
 
+int IGDv2Forwarder::_addPinhole(const char* localIp, const char* leaseTime) {
+    // never joined : each forwarder owns its pinhole, so that tearing one down leaves the others in place
+    NetworkCandy::TraceArguments outputs;
+    auto result = _scheduler->run(NetworkCandy::SOAPPriority::Mapping, std::string(), [this, localIp, leaseTime](NetworkCandy::TraceArguments& out) {
+        char uniqueId[sizeof(_wp_id)] = "\0";
+        auto start = std::chrono::steady_clock::now();
+        auto result = UPNP_AddPinhole(
+            _controlURL,
+            _servicetype,
+            "*",
+            _portToForward.c_str(),
+            localIp,
+            _portToForward.c_str(),
+            _protocol.c_str(), // TODO forcing wildcard ?!
+            leaseTime,
+            uniqueId
+        );
+        if (result == UPNPCOMMAND_SUCCESS) out = { {"UniqueID", uniqueId} };
+        NetworkCandy::TraceRecorder::recordSOAP(_controlURL, _servicetype, "AddPinhole",
+            { {"RemotePort", _portToForward}, {"InternalClient", localIp}, {"InternalPort", _portToForward},
+              {"Protocol", _protocol}, {"LeaseTime", leaseTime} },
+            result, out, start
+        );
+        return result;
+    }, &outputs, _deadline);
+
+    if (result == UPNPCOMMAND_SUCCESS) {
+        auto uniqueId = _outputOf(outputs, "UniqueID");
+        uniqueId.copy(_wp_id, sizeof(_wp_id) - 1);
+        _wp_id[std::min(uniqueId.size(), sizeof(_wp_id) - 1)] = '\0';
+    }
+    return result;
+}
+
 int IGDv2Forwarder::portforward(bool* isForwarded, const char* localIp, const char* leaseTime) {    
-    auto result = UPNP_AddPinhole(
-        _controlURL, 
-        _servicetype, 
-        "*",
-        _portToForward.c_str(),
-        localIp,
-        _portToForward.c_str(),
-        _protocol.c_str(), // TODO forcing wildcard ?!
-        leaseTime,
-        _wp_id
-    );
+    auto result = _addPinhole(localIp, leaseTime);
 
-    // if firewall is disabled, portforwarding is not
-    if (result == 702) {
-        spdlog::info("UPNP AskRedirect : UPNP_AddPinhole() failed on 702 error : since firewall is not active, no problem !");
+    // if firewall is disabled, portforwarding is not (702 FirewallDisabled, for most)
+    if (_isAddSuccess(result)) {
+        NWC_LOG_INFO("UPNP AskRedirect : UPNP_AddPinhole() failed on {} error : since firewall is not active, no problem !", result);
         *isForwarded = true;
         return 0;
     }
 
     // check if error
     else if (result != UPNPCOMMAND_SUCCESS) {
-        spdlog::warn("UPNP AskRedirect : UPNP_AddPinhole({}, {}) failed with code {} ({})",
+        NWC_LOG_WARN("UPNP AskRedirect : UPNP_AddPinhole({}, {}) failed with code {} ({})",
             _portToForward, localIp, result, strupnperror(result)
         );
         return result;
@@ -85,33 +121,63 @@ int IGDv2Forwarder::portforward(bool* isForwarded, const char* localIp, const ch
 
     // success !
     *isForwarded = true;
-    spdlog::info("UPNP AskRedirect : Redirection OK !");
+    NWC_LOG_INFO("UPNP AskRedirect : Redirection OK !");
     return 0;
 }
 
 int IGDv2Forwarder::removePortforward(bool* isForwarded) {
     //
     if(_wp_id[0] == '\0') {
-        spdlog::warn("UPNP RemoveRedirect : UPNP_DeletePinhole() cannot be called since no pinhole ID is registered !");
+        NWC_LOG_WARN("UPNP RemoveRedirect : UPNP_DeletePinhole() cannot be called since no pinhole ID is registered !");
         return -999;
     } 
 
     //
-    auto result = UPNP_DeletePinhole(
-        _controlURL,
-        _servicetype,
-        _wp_id
-    );
+    auto result = _scheduler->run(NetworkCandy::SOAPPriority::Mapping, _requestKey("DeletePinhole", _wp_id), [this](NetworkCandy::TraceArguments&) {
+        auto start = std::chrono::steady_clock::now();
+        auto result = UPNP_DeletePinhole(
+            _controlURL,
+            _servicetype,
+            _wp_id
+        );
+        NetworkCandy::TraceRecorder::recordSOAP(_controlURL, _servicetype, "DeletePinhole", { {"UniqueID", _wp_id} }, result, {}, start);
+        return result;
+    }, nullptr, _deadline);
 
     // check error
     if (result != UPNPCOMMAND_SUCCESS) {
-        spdlog::warn("UPNP RemoveRedirect : UPNP_DeletePinhole() failed with code :{}", result);
+        NWC_LOG_WARN("UPNP RemoveRedirect : UPNP_DeletePinhole() failed with code :{}", result);
         return result;
     }
 
     // success
-    spdlog::info("UPNP RemoveRedirect : UPNP_DeletePinhole() succeeded !");
+    NWC_LOG_INFO("UPNP RemoveRedirect : UPNP_DeletePinhole() succeeded !");
     *isForwarded = false;
 
     return 0;
-}
\ No newline at end of file
+}
+
+int IGDv2Forwarder::portforwardOptimistic(bool* isForwarded, bool* isAmbiguous, const char* localIp, const char* leaseTime) {
+    auto result = _addPinhole(localIp, leaseTime);
+    *isAmbiguous = false;
+
+    // success, or firewall not active (702, for most) : either way, reachable
+    if (result == UPNPCOMMAND_SUCCESS || _isAddSuccess(result)) {
+        *isForwarded = true;
+        NWC_LOG_INFO("UPNP AskRedirect : Optimistic pinhole OK ! (code {})", result);
+        return 0;
+    }
+
+    // generic failure, FirewallStatus will tell more
+    if (result == 501) {
+        NWC_LOG_INFO("UPNP AskRedirect : optimistic UPNP_AddPinhole() answered 501, cannot tell if pinholing is needed");
+        *isAmbiguous = true;
+        return result;
+    }
+
+    //
+    NWC_LOG_WARN("UPNP AskRedirect : optimistic UPNP_AddPinhole({}, {}) failed with code {} ({})",
+        _portToForward, localIp, result, strupnperror(result)
+    );
+    return result;
+}
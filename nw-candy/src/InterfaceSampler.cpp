@@ -0,0 +1,415 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "InterfaceSampler.h"
+#include "Log.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <windows.h>
+    #include <iphlpapi.h>
+#elif defined(__linux__)
+    #include <linux/if_link.h>
+    #include "Netlink.h"
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+NetworkCandy::InterfaceSampler::InterfaceSampler() {}
+
+NetworkCandy::InterfaceSampler::~InterfaceSampler() {
+    stop();
+    _closePlatformHandle();
+}
+
+void NetworkCandy::InterfaceSampler::start(std::chrono::milliseconds interval) {
+    if (_running.exchange(true)) return;
+
+    NWC_LOG_INFO("nw-candy : Starting interface sampling every {}ms...", interval.count());
+
+    _thread = std::thread([this, interval]() {
+        std::unique_lock<std::mutex> lock(_stopMutex);
+        while (_running) {
+            lock.unlock();
+            sampleOnce();
+            lock.lock();
+            _stopCV.wait_for(lock, interval, [this]() { return !_running; });
+        }
+    });
+}
+
+void NetworkCandy::InterfaceSampler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(_stopMutex);
+        if (!_running.exchange(false)) return;
+    }
+    _stopCV.notify_all();
+    if (_thread.joinable()) _thread.join();
+
+    NWC_LOG_INFO("nw-candy : Interface sampling stopped.");
+}
+
+bool NetworkCandy::InterfaceSampler::isRunning() const {
+    return _running;
+}
+
+bool NetworkCandy::InterfaceSampler::sampleOnce() {
+    // prevents concurrent sampleOnce() from the thread and from callers
+    std::lock_guard<std::mutex> lock(_samplingMutex);
+
+    std::vector<InterfaceReading> raw;
+    if (!_readCounters(&raw)) {
+        NWC_LOG_WARN("nw-candy : Cannot read interfaces counters");
+        return false;
+    }
+
+    auto nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+
+    _ingestReadings(raw, nowMs);
+    return true;
+}
+
+void NetworkCandy::InterfaceSampler::ingest(const std::vector<InterfaceReading>& readings, int64_t nowMs) {
+    std::lock_guard<std::mutex> lock(_samplingMutex);
+    _ingestReadings(readings, nowMs);
+}
+
+void NetworkCandy::InterfaceSampler::_ingestReadings(const std::vector<InterfaceReading>& readings, int64_t nowMs) {
+    // gone (docker / veth churn...), freed first so that their replacements in the same readings find room
+    for (std::size_t i = 0; i < _slots.size(); i++) {
+        auto &slot = _slots[i];
+        if (!slot.used.load(std::memory_order_relaxed)) continue;
+        auto isPresent = std::any_of(readings.begin(), readings.end(), [&slot](const InterfaceReading& reading) {
+            return reading.ifIndex == slot.ifIndex;
+        });
+        if (!isPresent) _release(slot, i);
+    }
+
+    for (auto &reading : readings) {
+        auto slot = _slotFor(reading.ifIndex, reading.name);
+        if (!slot) continue;
+        _ingest(*slot, slot - _slots.data(), reading.counters, nowMs);
+    }
+}
+
+bool NetworkCandy::InterfaceSampler::latest(const std::string& ifName, InterfaceQuality* out) const {
+    auto slot = _findSlot(ifName);
+    if (!slot) return false;
+    return slot->series.latest(out);
+}
+
+const NetworkCandy::InterfaceSampler::Series* NetworkCandy::InterfaceSampler::history(const std::string& ifName) const {
+    auto slot = _findSlot(ifName);
+    if (!slot) return nullptr;
+    return &slot->series;
+}
+
+std::vector<std::string> NetworkCandy::InterfaceSampler::interfaces() const {
+    std::vector<std::string> out;
+    for (auto &slot : _slots) {
+        char name[sizeof(slot.name)];
+        if (_readName(slot, name, sizeof(name))) out.emplace_back(name);
+    }
+    return out;
+}
+
+int NetworkCandy::InterfaceSampler::subscribe(QualityMetric metric, double threshold, ThresholdCallback callback) {
+    std::lock_guard<std::mutex> lock(_subscriptionsMutex);
+    auto id = _nextSubscriptionId++;
+    _subscriptions.push_back({ id, metric, threshold, std::move(callback) });
+    return id;
+}
+
+void NetworkCandy::InterfaceSampler::unsubscribe(int subscriptionId) {
+    std::lock_guard<std::mutex> lock(_subscriptionsMutex);
+    _subscriptions.erase(
+        std::remove_if(_subscriptions.begin(), _subscriptions.end(), [subscriptionId](const Subscription& s) {
+            return s.id == subscriptionId;
+        }),
+        _subscriptions.end()
+    );
+}
+
+// slots are released once their interface is gone, and claimed again by the next new one
+NetworkCandy::InterfaceSampler::Slot* NetworkCandy::InterfaceSampler::_slotFor(unsigned int ifIndex, const std::string& name) {
+    Slot* unused = nullptr;
+    for (auto &slot : _slots) {
+        if (!slot.used.load(std::memory_order_relaxed)) {
+            if (!unused) unused = &slot;
+            continue;
+        }
+
+        if (slot.ifIndex != ifIndex) continue;
+
+        // renamed, same interface
+        if (name != slot.name) _claim(slot, ifIndex, name);
+        return &slot;
+    }
+
+    if (!unused) {
+        if (!_isFullWarned) NWC_LOG_WARN("nw-candy : Cannot sample more than {} interfaces, ignoring {} (#{})", MAX_INTERFACES, name, ifIndex);
+        _isFullWarned = true;
+        return nullptr;
+    }
+
+    _claim(*unused, ifIndex, name);
+    NWC_LOG_DEBUG("nw-candy : Sampling interface {} (#{})", unused->name, ifIndex);
+    return unused;
+}
+
+void NetworkCandy::InterfaceSampler::_claim(Slot& slot, unsigned int ifIndex, const std::string& name) {
+    auto seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    std::memset(slot.name, 0, sizeof(slot.name));
+    std::strncpy(slot.name, name.c_str(), sizeof(slot.name) - 1);
+    slot.ifIndex = ifIndex;
+    slot.claimOrder.store(++_claims, std::memory_order_relaxed);
+    slot.used.store(true, std::memory_order_relaxed);
+
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+void NetworkCandy::InterfaceSampler::_release(Slot& slot, std::size_t slotIndex) {
+    NWC_LOG_DEBUG("nw-candy : Interface {} (#{}) gone, no longer sampled", slot.name, slot.ifIndex);
+
+    auto seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.used.store(false, std::memory_order_relaxed);
+    slot.hasPrevious = false;
+    slot.series.clear();
+
+    slot.seq.store(seq + 2, std::memory_order_release);
+    _isFullWarned = false;
+
+    // next interface in this slot starts under every threshold
+    std::lock_guard<std::mutex> lock(_subscriptionsMutex);
+    for (auto &sub : _subscriptions) sub.isAbove[slotIndex] = false;
+}
+
+const NetworkCandy::InterfaceSampler::Slot* NetworkCandy::InterfaceSampler::_findSlot(const std::string& ifName) const {
+    // an interface recreated under the same name may briefly have two slots, the newest one being current
+    const Slot* found = nullptr;
+    uint64_t foundOrder = 0;
+    for (auto &slot : _slots) {
+        char name[sizeof(slot.name)];
+        auto order = slot.claimOrder.load(std::memory_order_relaxed);
+        if (!_readName(slot, name, sizeof(name)) || ifName != name || order < foundOrder) continue;
+        found = &slot;
+        foundOrder = order;
+    }
+    return found;
+}
+
+bool NetworkCandy::InterfaceSampler::_readName(const Slot& slot, char* out, std::size_t size) {
+    for (;;) {
+        auto before = slot.seq.load(std::memory_order_acquire);
+        if (before & 1) continue;
+        if (!slot.used.load(std::memory_order_relaxed)) return false;
+
+        std::memcpy(out, slot.name, std::min(size, sizeof(slot.name)));
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (slot.seq.load(std::memory_order_relaxed) == before) {
+            out[size - 1] = '\0';
+            return true;
+        }
+    }
+}
+
+void NetworkCandy::InterfaceSampler::_ingest(Slot& slot, std::size_t slotIndex, const InterfaceCounters& counters, int64_t nowMs) {
+    auto previous = slot.previous;
+    auto hadPrevious = slot.hasPrevious;
+    auto previousMs = slot.previousMs;
+
+    slot.previous = counters;
+    slot.previousMs = nowMs;
+    slot.hasPrevious = true;
+
+    if (!hadPrevious || nowMs <= previousMs) return;
+
+    // counters went backwards (interface reset, driver reload...), restart from there
+    if (counters.rxBytes < previous.rxBytes || counters.txBytes < previous.txBytes) return;
+
+    auto seconds = (nowMs - previousMs) / 1000.0;
+    auto rate = [seconds](uint64_t now, uint64_t before) {
+        return now >= before ? (now - before) / seconds : 0.0;
+    };
+
+    InterfaceQuality quality;
+    quality.timestampMs = nowMs;
+    quality.rxBytesPerSec = rate(counters.rxBytes, previous.rxBytes);
+    quality.txBytesPerSec = rate(counters.txBytes, previous.txBytes);
+    quality.errorsPerSec = rate(counters.rxErrors + counters.txErrors, previous.rxErrors + previous.txErrors);
+    quality.dropsPerSec = rate(counters.rxDropped + counters.txDropped, previous.rxDropped + previous.txDropped);
+
+    slot.series.push(quality);
+
+    _notifySubscribers(slotIndex, slot.name, quality);
+}
+
+void NetworkCandy::InterfaceSampler::_notifySubscribers(std::size_t slotIndex, const char* ifName, const InterfaceQuality& quality) {
+    struct Crossing {
+        ThresholdCallback callback;
+        QualityMetric metric;
+        double value;
+        bool isAbove;
+    };
+    std::vector<Crossing> crossings;
+
+    {
+        std::lock_guard<std::mutex> lock(_subscriptionsMutex);
+        for (auto &sub : _subscriptions) {
+            auto value = _metricValue(quality, sub.metric);
+            auto isAbove = value > sub.threshold;
+
+            // only fire on crossings
+            if (isAbove == sub.isAbove[slotIndex]) continue;
+            sub.isAbove[slotIndex] = isAbove;
+
+            crossings.push_back({ sub.callback, sub.metric, value, isAbove });
+        }
+    }
+
+    // unlocked, callbacks may unsubscribe
+    std::string name = ifName;
+    for (auto &crossing : crossings) crossing.callback(name, crossing.metric, crossing.value, crossing.isAbove);
+}
+
+double NetworkCandy::InterfaceSampler::_metricValue(const InterfaceQuality& quality, QualityMetric metric) {
+    switch (metric) {
+        case QualityMetric::RxThroughput:
+            return quality.rxBytesPerSec;
+        case QualityMetric::TxThroughput:
+            return quality.txBytesPerSec;
+        case QualityMetric::ErrorRate:
+            return quality.errorsPerSec;
+        case QualityMetric::DropRate:
+            return quality.dropsPerSec;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+
+bool NetworkCandy::InterfaceSampler::_readCounters(std::vector<InterfaceReading>* out) {
+    if (_netlinkFd < 0) {
+        _netlinkFd = Netlink::open();
+        if (_netlinkFd < 0) return false;
+    }
+
+    auto ok = Netlink::dump(_netlinkFd, RTM_GETLINK, AF_UNSPEC, [out](const nlmsghdr* msg) {
+        if (msg->nlmsg_type != RTM_NEWLINK) return;
+        auto info = (const ifinfomsg*)NLMSG_DATA(msg);
+
+        InterfaceReading sample;
+        sample.ifIndex = info->ifi_index;
+        bool hasStats = false;
+
+        Netlink::forEachAttribute(msg, sizeof(ifinfomsg), [&](const rtattr* attr) {
+            switch (attr->rta_type) {
+                case IFLA_IFNAME:
+                    sample.name = (const char*)RTA_DATA(attr);
+                    break;
+                case IFLA_STATS64: {
+                    rtnl_link_stats64 stats;
+                    std::memcpy(&stats, RTA_DATA(attr), std::min<std::size_t>(sizeof(stats), RTA_PAYLOAD(attr)));
+                    sample.counters.rxBytes = stats.rx_bytes;
+                    sample.counters.txBytes = stats.tx_bytes;
+                    sample.counters.rxPackets = stats.rx_packets;
+                    sample.counters.txPackets = stats.tx_packets;
+                    sample.counters.rxErrors = stats.rx_errors;
+                    sample.counters.txErrors = stats.tx_errors;
+                    sample.counters.rxDropped = stats.rx_dropped;
+                    sample.counters.txDropped = stats.tx_dropped;
+                    hasStats = true;
+                }
+                break;
+            }
+        });
+
+        if (hasStats && !sample.name.empty()) out->push_back(std::move(sample));
+    });
+
+    // socket may be in a bad state, reopen next time
+    if (!ok) _closePlatformHandle();
+
+    return ok;
+}
+
+void NetworkCandy::InterfaceSampler::_closePlatformHandle() {
+    Netlink::close(_netlinkFd);
+    _netlinkFd = -1;
+}
+
+#elif defined(_WIN32)
+
+bool NetworkCandy::InterfaceSampler::_readCounters(std::vector<InterfaceReading>* out) {
+    MIB_IF_TABLE2* table = nullptr;
+    if (GetIfTable2(&table) != NO_ERROR) return false;
+
+    for (ULONG i = 0; i < table->NumEntries; i++) {
+        auto &row = table->Table[i];
+
+        // skip filter / miniport layers, keep actual adapters
+        if (!row.InterfaceAndOperStatusFlags.HardwareInterface && row.Type != IF_TYPE_SOFTWARE_LOOPBACK) continue;
+
+        InterfaceReading sample;
+        sample.ifIndex = row.InterfaceIndex;
+
+        char name[64];
+        auto written = WideCharToMultiByte(CP_UTF8, 0, row.Alias, -1, name, sizeof(name), NULL, NULL);
+        if (!written) continue;
+        sample.name = name;
+
+        sample.counters.rxBytes = row.InOctets;
+        sample.counters.txBytes = row.OutOctets;
+        sample.counters.rxPackets = row.InUcastPkts + row.InNUcastPkts;
+        sample.counters.txPackets = row.OutUcastPkts + row.OutNUcastPkts;
+        sample.counters.rxErrors = row.InErrors;
+        sample.counters.txErrors = row.OutErrors;
+        sample.counters.rxDropped = row.InDiscards;
+        sample.counters.txDropped = row.OutDiscards;
+
+        out->push_back(std::move(sample));
+    }
+
+    FreeMibTable(table);
+    return true;
+}
+
+void NetworkCandy::InterfaceSampler::_closePlatformHandle() {}
+
+#else
+
+bool NetworkCandy::InterfaceSampler::_readCounters(std::vector<InterfaceReading>* out) {
+    // no backend
+    out->clear();
+    return false;
+}
+
+void NetworkCandy::InterfaceSampler::_closePlatformHandle() {}
+
+#endif
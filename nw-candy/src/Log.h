@@ -0,0 +1,46 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include "Logging.h"
+
+// levels below this one compile away, arguments included; set by NW_CANDY_LOG_LEVEL.
+// Disabled calls stay type-checked behind "if (false)", so that variables only logged do not warn.
+#ifndef NWC_LOG_ACTIVE_LEVEL
+    #define NWC_LOG_ACTIVE_LEVEL SPDLOG_LEVEL_INFO
+#endif
+
+#if NWC_LOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+    #define NWC_LOG_DEBUG(...) NetworkCandy::logger().debug(__VA_ARGS__)
+#else
+    #define NWC_LOG_DEBUG(...) do { if (false) NetworkCandy::logger().debug(__VA_ARGS__); } while (0)
+#endif
+
+#if NWC_LOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_INFO
+    #define NWC_LOG_INFO(...) NetworkCandy::logger().info(__VA_ARGS__)
+#else
+    #define NWC_LOG_INFO(...) do { if (false) NetworkCandy::logger().info(__VA_ARGS__); } while (0)
+#endif
+
+#if NWC_LOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_WARN
+    #define NWC_LOG_WARN(...) NetworkCandy::logger().warn(__VA_ARGS__)
+#else
+    #define NWC_LOG_WARN(...) do { if (false) NetworkCandy::logger().warn(__VA_ARGS__); } while (0)
+#endif
@@ -0,0 +1,65 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "Logging.h"
+
+#include <spdlog/async.h>
+
+#include <atomic>
+#include <mutex>
+
+namespace {
+
+// bounded; when flooded, the oldest lines are dropped rather than blocking network threads
+constexpr std::size_t _QUEUE_SIZE = 8192;
+constexpr auto _OVERFLOW_POLICY = spdlog::async_overflow_policy::overrun_oldest;
+
+std::mutex _mutex;
+std::shared_ptr<spdlog::logger> _owned;
+std::atomic<spdlog::logger*> _current {nullptr};
+
+std::shared_ptr<spdlog::logger> _makeDefaultLogger() {
+    // own worker, not to interfere with the application's spdlog thread pool; outlives the logger
+    static auto pool = std::make_shared<spdlog::details::thread_pool>(_QUEUE_SIZE, 1);
+
+    auto &sinks = spdlog::default_logger()->sinks();
+    auto logger = std::make_shared<spdlog::async_logger>("nw-candy", sinks.begin(), sinks.end(), pool, _OVERFLOW_POLICY);
+    logger->set_level(spdlog::default_logger()->level());
+    return logger;
+}
+
+}  // namespace
+
+spdlog::logger& NetworkCandy::logger() {
+    auto current = _current.load(std::memory_order_acquire);
+    if (current) return *current;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_owned) {
+        _owned = _makeDefaultLogger();
+        _current.store(_owned.get(), std::memory_order_release);
+    }
+    return *_owned;
+}
+
+void NetworkCandy::setLogger(std::shared_ptr<spdlog::logger> logger) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _owned = std::move(logger);
+    _current.store(_owned.get(), std::memory_order_release);
+}
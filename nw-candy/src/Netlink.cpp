@@ -0,0 +1,125 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "Netlink.h"
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+
+namespace {
+    std::atomic<uint32_t> _sequence {1};
+}
+
+int NetworkCandy::Netlink::open(uint32_t groups) {
+    auto fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) return -1;
+
+    sockaddr_nl addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void NetworkCandy::Netlink::close(int fd) {
+    if (fd >= 0) ::close(fd);
+}
+
+bool NetworkCandy::Netlink::dump(int fd, uint16_t type, unsigned char family, const std::function<void(const nlmsghdr*)>& handler) {
+    // ifinfomsg and rtmsg both start with their family byte
+    struct {
+        nlmsghdr header;
+        union {
+            ifinfomsg link;
+            rtmsg route;
+        } payload;
+    } request;
+    std::memset(&request, 0, sizeof(request));
+
+    auto payloadSize = type == RTM_GETLINK ? sizeof(ifinfomsg) : sizeof(rtmsg);
+    auto seq = _sequence++;
+
+    request.header.nlmsg_len = NLMSG_LENGTH(payloadSize);
+    request.header.nlmsg_type = type;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = seq;
+    request.payload.link.ifi_family = family;
+
+    if (send(fd, &request, request.header.nlmsg_len, 0) < 0) return false;
+
+    // read until NLMSG_DONE
+    alignas(nlmsghdr) char buffer[32768];
+    for (;;) {
+        auto received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) return false;
+
+        auto len = static_cast<unsigned int>(received);
+        for (auto msg = (const nlmsghdr*)buffer; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+            // ignore stray messages
+            if (msg->nlmsg_seq != seq) continue;
+
+            if (msg->nlmsg_type == NLMSG_DONE) return true;
+            if (msg->nlmsg_type == NLMSG_ERROR) return false;
+
+            handler(msg);
+        }
+    }
+}
+
+bool NetworkCandy::Netlink::request(int fd, nlmsghdr* msg) {
+    auto seq = _sequence++;
+    msg->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    msg->nlmsg_seq = seq;
+
+    if (send(fd, msg, msg->nlmsg_len, 0) < 0) return false;
+
+    // read until our acknowledgement
+    alignas(nlmsghdr) char buffer[8192];
+    for (;;) {
+        auto received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) return false;
+
+        auto len = static_cast<unsigned int>(received);
+        for (auto answer = (const nlmsghdr*)buffer; NLMSG_OK(answer, len); answer = NLMSG_NEXT(answer, len)) {
+            if (answer->nlmsg_seq != seq || answer->nlmsg_type != NLMSG_ERROR) continue;
+            return ((const nlmsgerr*)NLMSG_DATA(answer))->error == 0;
+        }
+    }
+}
+
+void NetworkCandy::Netlink::forEachAttribute(const nlmsghdr* msg, std::size_t headerSize, const std::function<void(const rtattr*)>& handler) {
+    auto attr = (const rtattr*)((const char*)NLMSG_DATA(msg) + NLMSG_ALIGN(headerSize));
+    int len = msg->nlmsg_len - NLMSG_LENGTH(headerSize);
+    for (; RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+        handler(attr);
+    }
+}
+
+#endif
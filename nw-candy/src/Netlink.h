@@ -0,0 +1,49 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <cstdint>
+#include <functional>
+
+// thin helpers around NETLINK_ROUTE sockets, private to nw-candy
+namespace NetworkCandy::Netlink {
+
+// returns the socket descriptor, or -1 on error; "groups" are RTMGRP_* multicast groups to subscribe to
+int open(uint32_t groups = 0);
+void close(int fd);
+
+// sends a dump request (RTM_GETLINK, RTM_GETROUTE...) and feeds each answer to "handler"; returns if succeeded
+bool dump(int fd, uint16_t type, unsigned char family, const std::function<void(const nlmsghdr*)>& handler);
+
+// sends a change request (RTM_NEWLINK, RTM_NEWROUTE...) and waits for its acknowledgement; returns if succeeded
+bool request(int fd, nlmsghdr* msg);
+
+// iterates over the attributes following a fixed-size header of "headerSize" bytes
+void forEachAttribute(const nlmsghdr* msg, std::size_t headerSize, const std::function<void(const rtattr*)>& handler);
+
+}  // namespace NetworkCandy::Netlink
+
+#endif
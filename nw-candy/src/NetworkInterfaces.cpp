@@ -0,0 +1,148 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "NetworkInterfaces.h"
+#include "Log.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #include <windows.h>
+    #include <iphlpapi.h>
+#else
+    #include <arpa/inet.h>
+    #include <ifaddrs.h>
+    #include <net/if.h>
+    #include <netinet/in.h>
+#endif
+
+#include <algorithm>
+
+namespace {
+
+// link-local addresses need a scope ID to be usable, prefer anything else
+bool _isLinkLocal(const sockaddr* addr) {
+    if (addr->sa_family != AF_INET6) return false;
+    auto &a = ((const sockaddr_in6*)addr)->sin6_addr;
+    return a.s6_addr[0] == 0xfe && (a.s6_addr[1] & 0xc0) == 0x80;
+}
+
+void _assignAddress(NetworkCandy::NetworkInterface& iface, const sockaddr* addr) {
+    char buffer[INET6_ADDRSTRLEN] = "\0";
+
+    if (addr->sa_family == AF_INET && iface.ipv4.empty()) {
+        inet_ntop(AF_INET, &((const sockaddr_in*)addr)->sin_addr, buffer, sizeof(buffer));
+        iface.ipv4 = buffer;
+    } else if (addr->sa_family == AF_INET6) {
+        // keep the first global address, link-local only as a fallback
+        auto hasGlobal = !iface.ipv6.empty() && iface.ipv6.rfind("fe80", 0) != 0;
+        if (hasGlobal || (!iface.ipv6.empty() && _isLinkLocal(addr))) return;
+
+        inet_ntop(AF_INET6, &((const sockaddr_in6*)addr)->sin6_addr, buffer, sizeof(buffer));
+        iface.ipv6 = buffer;
+    }
+}
+
+}  // namespace
+
+#ifdef _WIN32
+
+std::vector<NetworkCandy::NetworkInterface> NetworkCandy::listMulticastInterfaces() {
+    std::vector<NetworkInterface> out;
+
+    // recommended starting size, grown if needed
+    ULONG size = 15000;
+    std::vector<char> buffer;
+    ULONG result;
+    do {
+        buffer.resize(size);
+        result = GetAdaptersAddresses(AF_UNSPEC, GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_DNS_SERVER, NULL, (IP_ADAPTER_ADDRESSES*)buffer.data(), &size);
+    } while (result == ERROR_BUFFER_OVERFLOW);
+
+    if (result != NO_ERROR) {
+        NWC_LOG_WARN("nw-candy : GetAdaptersAddresses() failed with code {}", result);
+        return out;
+    }
+
+    for (auto adapter = (IP_ADAPTER_ADDRESSES*)buffer.data(); adapter; adapter = adapter->Next) {
+        if (adapter->OperStatus != IfOperStatusUp) continue;
+        if (adapter->IfType == IF_TYPE_SOFTWARE_LOOPBACK) continue;
+        if (adapter->Flags & IP_ADAPTER_NO_MULTICAST) continue;
+
+        NetworkInterface iface;
+        iface.index = adapter->IfIndex ? adapter->IfIndex : adapter->Ipv6IfIndex;
+
+        char name[256];
+        if (!WideCharToMultiByte(CP_UTF8, 0, adapter->FriendlyName, -1, name, sizeof(name), NULL, NULL)) continue;
+        iface.name = name;
+
+        for (auto unicast = adapter->FirstUnicastAddress; unicast; unicast = unicast->Next) {
+            _assignAddress(iface, unicast->Address.lpSockaddr);
+        }
+
+        if (iface.ipv4.empty() && iface.ipv6.empty()) continue;
+        out.push_back(std::move(iface));
+    }
+
+    return out;
+}
+
+#else
+
+std::vector<NetworkCandy::NetworkInterface> NetworkCandy::listMulticastInterfaces() {
+    std::vector<NetworkInterface> out;
+
+    ifaddrs* addresses = nullptr;
+    if (getifaddrs(&addresses) != 0) {
+        NWC_LOG_WARN("nw-candy : getifaddrs() failed");
+        return out;
+    }
+
+    // one entry per address, merge them by interface name
+    for (auto entry = addresses; entry; entry = entry->ifa_next) {
+        if (!entry->ifa_addr) continue;
+        if (!(entry->ifa_flags & IFF_UP) || !(entry->ifa_flags & IFF_MULTICAST)) continue;
+        if (entry->ifa_flags & IFF_LOOPBACK) continue;
+
+        auto found = std::find_if(out.begin(), out.end(), [entry](const NetworkInterface& i) {
+            return i.name == entry->ifa_name;
+        });
+
+        if (found == out.end()) {
+            NetworkInterface iface;
+            iface.name = entry->ifa_name;
+            iface.index = if_nametoindex(entry->ifa_name);
+            out.push_back(std::move(iface));
+            found = out.end() - 1;
+        }
+
+        _assignAddress(*found, entry->ifa_addr);
+    }
+
+    freeifaddrs(addresses);
+
+    // drop interfaces without any IP (ifa_addr of AF_PACKET family)
+    out.erase(std::remove_if(out.begin(), out.end(), [](const NetworkInterface& i) {
+        return i.ipv4.empty() && i.ipv6.empty();
+    }), out.end());
+
+    return out;
+}
+
+#endif
@@ -0,0 +1,222 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "Reachability.h"
+#include "Sockets.h"
+#include "Log.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using NetworkCandy::Sockets::socket_t;
+namespace Sockets = NetworkCandy::Sockets;
+
+int _remainingMs(Clock::time_point deadline) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+    return remaining > 0 ? static_cast<int>(remaining) : 0;
+}
+
+bool _toAddress(const std::string& ip, unsigned short port, sockaddr_in* out) {
+    std::memset(out, 0, sizeof(*out));
+    out->sin_family = AF_INET;
+    out->sin_port = htons(port);
+    return inet_pton(AF_INET, ip.c_str(), &out->sin_addr) == 1;
+}
+
+// returns the listening socket, INVALID if the port is taken or on error
+socket_t _listen(const std::string& ip, unsigned short port) {
+    sockaddr_in address;
+    if (!_toAddress(ip, port, &address)) return Sockets::INVALID;
+
+    auto socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket == Sockets::INVALID) return Sockets::INVALID;
+
+    // whoever already holds the port must not see our connections, nor we theirs
+    #ifdef _WIN32
+        int exclusive = 1;
+        setsockopt(socket, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char*)&exclusive, sizeof(exclusive));
+    #endif
+
+    if (bind(socket, (sockaddr*)&address, sizeof(address)) != 0 || listen(socket, 4) != 0) {
+        Sockets::close(socket);
+        return Sockets::INVALID;
+    }
+
+    return socket;
+}
+
+// returns the connected socket, INVALID on failure or timeout
+socket_t _connect(const std::string& ip, unsigned short port, Clock::time_point deadline) {
+    sockaddr_in address;
+    if (!_toAddress(ip, port, &address)) return Sockets::INVALID;
+
+    auto socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket == Sockets::INVALID) return Sockets::INVALID;
+    Sockets::setNonBlocking(socket);
+
+    // in progress, most of the time; a refused connection wakes the wait as well (POLLERR, except set on Windows),
+    // SO_ERROR telling which it was
+    connect(socket, (sockaddr*)&address, sizeof(address));
+    if (Sockets::waitWritable(socket, _remainingMs(deadline)) <= 0) {
+        Sockets::close(socket);
+        return Sockets::INVALID;
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0 || error != 0) {
+        Sockets::close(socket);
+        return Sockets::INVALID;
+    }
+
+    return socket;
+}
+
+bool _sendAll(socket_t socket, const std::string& data, Clock::time_point deadline) {
+    std::size_t sent = 0;
+    while (sent < data.size()) {
+        if (Sockets::waitWritable(socket, _remainingMs(deadline)) <= 0) return false;
+        auto r = send(socket, data.data() + sent, (int)(data.size() - sent), 0);
+        if (r <= 0) return false;
+        sent += r;
+    }
+    return true;
+}
+
+// reads up to a newline, which is not kept
+bool _readLine(socket_t socket, std::string* out, Clock::time_point deadline) {
+    out->clear();
+    char c;
+    while (out->size() < 128) {
+        if (Sockets::waitReadable(socket, _remainingMs(deadline)) <= 0) return false;
+        if (recv(socket, &c, 1, 0) != 1) return false;
+        if (c == '\n') return true;
+        *out += c;
+    }
+    return false;
+}
+
+// returns if the nonce came through a connection to the listener
+bool _expectNonce(socket_t listener, const std::string& nonce, Clock::time_point deadline) {
+    while (_remainingMs(deadline) > 0) {
+        if (Sockets::waitReadable(listener, _remainingMs(deadline)) <= 0) return false;
+
+        auto client = accept(listener, nullptr, nullptr);
+        if (client == Sockets::INVALID) continue;
+
+        std::string line;
+        auto isOurs = _readLine(client, &line, deadline) && line == nonce;
+
+        // reset rather than closed, no TIME_WAIT then keeping the port from being listened to again by the next check
+        linger reset {};
+        reset.l_onoff = 1;
+        reset.l_linger = 0;
+        setsockopt(client, SOL_SOCKET, SO_LINGER, (const char*)&reset, sizeof(reset));
+        Sockets::close(client);
+        if (isOurs) return true;
+    }
+    return false;
+}
+
+std::string _makeNonce() {
+    static thread_local std::mt19937_64 random(std::random_device{}());
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(random()));
+    return buffer;
+}
+
+double _elapsedMs(Clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+}  // namespace
+
+NetworkCandy::ReachabilityProbe::ReachabilityProbe(const std::string& localIP, unsigned short port) :
+    _localIP(localIP), _port(port) {}
+
+void NetworkCandy::ReachabilityProbe::setReflector(const std::string& hostAndPort) {
+    _reflector = hostAndPort;
+}
+
+NetworkCandy::ReachabilityResult NetworkCandy::ReachabilityProbe::run(const std::string& externalIP, unsigned short externalPort, std::chrono::milliseconds timeout) {
+    ReachabilityResult result;
+    result.path = _reflector.empty() ? ReachabilityPath::Hairpin : ReachabilityPath::Reflector;
+    result.timestampMs = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+
+    if (!Sockets::init()) return result;
+
+    auto deadline = Clock::now() + timeout;
+    auto nonce = _makeNonce();
+
+    // our own listener, unless the application already listens there
+    auto listener = _listen(_localIP, _port);
+    if (listener == Sockets::INVALID) {
+        NWC_LOG_INFO("UPNP Reach : {}:{} already in use, checking connection only", _localIP, _port);
+    }
+
+    auto start = Clock::now();
+
+    if (result.path == ReachabilityPath::Hairpin) {
+        auto connection = _connect(externalIP, externalPort, deadline);
+        if (connection != Sockets::INVALID) {
+            result.latencyMs = _elapsedMs(start);
+            result.isReachable = true;
+
+            if (listener != Sockets::INVALID) {
+                result.isVerified = _sendAll(connection, nonce + '\n', deadline) && _expectNonce(listener, nonce, deadline);
+                result.isReachable = result.isVerified;
+            }
+            Sockets::close(connection);
+        }
+    } else {
+        auto colon = _reflector.rfind(':');
+        auto host = _reflector.substr(0, colon);
+        auto port = static_cast<unsigned short>(std::atoi(_reflector.substr(colon + 1).c_str()));
+
+        auto reflector = colon == std::string::npos ? Sockets::INVALID : _connect(host, port, deadline);
+        auto request = "NWC-PROBE " + externalIP + ' ' + std::to_string(externalPort) + ' ' + nonce + '\n';
+        if (reflector != Sockets::INVALID && _sendAll(reflector, request, deadline)) {
+            start = Clock::now();
+            if (listener != Sockets::INVALID) {
+                result.isVerified = _expectNonce(listener, nonce, deadline);
+                result.latencyMs = _elapsedMs(start);
+            }
+
+            std::string answer;
+            auto reflectorOK = _readLine(reflector, &answer, deadline) && answer == "OK";
+            if (listener == Sockets::INVALID) result.latencyMs = _elapsedMs(start);
+            result.isReachable = listener != Sockets::INVALID ? result.isVerified : reflectorOK;
+        } else {
+            NWC_LOG_WARN("UPNP Reach : cannot reach reflector {}", _reflector);
+        }
+        Sockets::close(reflector);
+    }
+
+    Sockets::close(listener);
+
+    NWC_LOG_INFO("UPNP Reach : {}:{} {} through {} ({:.1f}ms)", externalIP, externalPort,
+        result.isReachable ? "reachable" : "unreachable",
+        result.path == ReachabilityPath::Hairpin ? "hairpin" : "reflector", result.latencyMs);
+
+    return result;
+}
@@ -0,0 +1,160 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "RetryPolicy.h"
+#include "SOAPScheduler.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+void NetworkCandy::RttEstimator::sample(std::chrono::milliseconds rtt) {
+    auto ms = static_cast<double>(rtt.count());
+    if (!_hasSamples) {
+        _srttMs = ms;
+        _rttvarMs = ms / 2;
+        _hasSamples = true;
+        return;
+    }
+
+    _rttvarMs = 0.75 * _rttvarMs + 0.25 * std::abs(_srttMs - ms);
+    _srttMs = 0.875 * _srttMs + 0.125 * ms;
+}
+
+void NetworkCandy::RttEstimator::reset() {
+    *this = RttEstimator();
+}
+
+bool NetworkCandy::RttEstimator::hasSamples() const {
+    return _hasSamples;
+}
+
+std::chrono::milliseconds NetworkCandy::RttEstimator::smoothed() const {
+    return std::chrono::milliseconds(static_cast<int64_t>(_srttMs));
+}
+
+std::chrono::milliseconds NetworkCandy::RttEstimator::timeout() const {
+    return std::chrono::milliseconds(static_cast<int64_t>(std::ceil(_srttMs + 4 * _rttvarMs)));
+}
+
+NetworkCandy::RetryPolicy::RetryPolicy(const RetryOptions& options) : _options(options), _random(std::random_device()()) {}
+
+void NetworkCandy::RetryPolicy::setOptions(const RetryOptions& options) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _options = options;
+}
+
+NetworkCandy::RetryOptions NetworkCandy::RetryPolicy::options() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _options;
+}
+
+bool NetworkCandy::RetryPolicy::isRetryable(int errorCode) {
+    switch (errorCode) {
+        case -1:  // UPNPCOMMAND_UNKNOWN_ERROR, answer missing what was asked
+        case -3:  // UPNPCOMMAND_HTTP_ERROR, no answer / connection dropped
+        case -4:  // UPNPCOMMAND_INVALID_RESPONSE, truncated answer
+        case -101:  // UPNPDISCOVER_SOCKET_ERROR
+        case SOAPScheduler::QUEUE_FULL:
+        case SOAPScheduler::QUEUE_TIMEOUT:
+        case 501:  // ActionFailed
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::chrono::milliseconds NetworkCandy::RetryPolicy::attemptTimeout(GatewayOperation operation, unsigned int attemptIndex) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto &rtt = _rtt[static_cast<int>(operation)];
+    auto timeout = rtt.hasSamples() ? rtt.timeout() : _options.initialAttemptTimeout;
+    timeout *= 1 << std::min(attemptIndex, 8u);
+
+    return std::clamp(timeout, _options.minAttemptTimeout, _options.maxAttemptTimeout);
+}
+
+void NetworkCandy::RetryPolicy::reset() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &rtt : _rtt) rtt.reset();
+}
+
+// between half and all of the exponential delay, so that clients do not retry in lockstep
+std::chrono::milliseconds NetworkCandy::RetryPolicy::_backoff(unsigned int retryIndex) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto delayMs = _options.initialBackoff.count() * std::pow(_options.backoffMultiplier, retryIndex);
+    delayMs = std::min(delayMs, static_cast<double>(_options.maxBackoff.count()));
+
+    std::uniform_real_distribution<double> jitter(0.5, 1.0);
+    return std::chrono::milliseconds(static_cast<int64_t>(delayMs * jitter(_random)));
+}
+
+int NetworkCandy::RetryPolicy::run(GatewayOperation operation, Clock::time_point deadline, const Attempt& attempt) {
+    auto maxAttempts = std::max(1u, options().maxAttempts);
+    auto errorCode = 0;
+    std::chrono::milliseconds elapsed {0};
+
+    for (unsigned int index = 0; index < maxAttempts; index++) {
+        auto timeout = attemptTimeout(operation, index);
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+
+        // never start what cannot end before the deadline, but always try once, briefly if the budget is spent
+        if (index > 0) {
+            auto backoff = _backoff(index - 1);
+            if (backoff + _expectedDuration(operation, timeout, elapsed) > remaining) {
+                NWC_LOG_INFO("UPNP Retry : no budget left for attempt {} ({}ms remaining), giving up on code {}",
+                    index + 1, remaining.count(), errorCode);
+                return errorCode;
+            }
+            std::this_thread::sleep_for(backoff);
+            remaining -= backoff;
+        }
+        timeout = std::min(timeout, remaining.count() > 0 ? remaining : options().minAttemptTimeout);
+
+        //
+        auto start = Clock::now();
+        errorCode = attempt(timeout);
+        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+
+        // the gateway answered, which tells how fast it is; transport failures do not,
+        // and discovery always lasts as long as it was asked to
+        if (errorCode >= 0 && operation != GatewayOperation::Discovery) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _rtt[static_cast<int>(operation)].sample(elapsed);
+        }
+
+        if (errorCode == 0) return 0;
+        if (!isRetryable(errorCode)) return errorCode;
+
+        NWC_LOG_INFO("UPNP Retry : attempt {}/{} failed with code {} after {}ms", index + 1, maxAttempts, errorCode, elapsed.count());
+    }
+
+    return errorCode;
+}
+
+// what an attempt is likely to take : as usual for this gateway if known, else as long as the previous one
+std::chrono::milliseconds NetworkCandy::RetryPolicy::_expectedDuration(GatewayOperation operation, std::chrono::milliseconds timeout,
+                                                                       std::chrono::milliseconds previous) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &rtt = _rtt[static_cast<int>(operation)];
+    auto expected = rtt.hasSamples() ? rtt.timeout() : std::max(previous, _options.minAttemptTimeout);
+    return std::min(timeout, expected);
+}
@@ -0,0 +1,193 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "SOAPScheduler.h"
+#include "Log.h"
+
+#include <algorithm>
+
+std::shared_ptr<NetworkCandy::SOAPScheduler> NetworkCandy::SOAPScheduler::forGateway(const std::string& controlURL) {
+    // "http://host:port/path"
+    auto begin = controlURL.find("://");
+    begin = begin == std::string::npos ? 0 : begin + 3;
+    auto host = controlURL.substr(begin, controlURL.find('/', begin) - begin);
+
+    std::lock_guard<std::mutex> lock(_registryMutex);
+    auto &known = _registry[host];
+    auto scheduler = known.lock();
+    if (!scheduler) {
+        scheduler = std::make_shared<SOAPScheduler>(_defaultOptions);
+        known = scheduler;
+    }
+
+    // forget gateways gone for good
+    for (auto i = _registry.begin(); i != _registry.end();) {
+        i = i->second.expired() ? _registry.erase(i) : std::next(i);
+    }
+
+    return scheduler;
+}
+
+void NetworkCandy::SOAPScheduler::setDefaultOptions(const SOAPSchedulerOptions& options) {
+    std::lock_guard<std::mutex> lock(_registryMutex);
+    _defaultOptions = options;
+}
+
+NetworkCandy::SOAPScheduler::SOAPScheduler(const SOAPSchedulerOptions& options) :
+    _options(options), _tokens(options.burst), _refilledAt(Clock::now()) {}
+
+void NetworkCandy::SOAPScheduler::setOptions(const SOAPSchedulerOptions& options) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _options = options;
+    _tokens = std::min(_tokens, _options.burst);
+    _cv.notify_all();
+}
+
+NetworkCandy::SOAPSchedulerOptions NetworkCandy::SOAPScheduler::options() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _options;
+}
+
+int NetworkCandy::SOAPScheduler::run(SOAPPriority priority, const std::string& key, const Call& call, TraceArguments* outputs, Clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // same request already waiting, its answer will do; requests already sent are not joined, they may predate a change
+    if (!key.empty()) {
+        auto same = std::find_if(_queue.begin(), _queue.end(), [&key](const std::shared_ptr<_Request>& queued) {
+            return queued->key == key;
+        });
+        if (same != _queue.end()) {
+            auto request = *same;
+
+            // urgency of the most urgent one
+            request->priority = std::min(request->priority, priority);
+            _stats.coalesced++;
+
+            auto isDone = [&request]() { return request->isDone; };
+            if (deadline == Clock::time_point::max()) {
+                _cv.wait(lock, isDone);
+            } else if (!_cv.wait_until(lock, deadline, isDone)) {
+                _stats.timedOut++;
+                NWC_LOG_WARN("UPNP SOAP : {} still waiting past the caller's deadline, giving up", key);
+                return QUEUE_TIMEOUT;
+            }
+            if (outputs) *outputs = request->outputs;
+            return request->result;
+        }
+    }
+
+    if (_queue.size() >= _options.maxQueue) {
+        _stats.rejected++;
+        NWC_LOG_WARN("UPNP SOAP : queue full ({} waiting), refusing {}", _queue.size(), key);
+        return QUEUE_FULL;
+    }
+
+    auto request = std::make_shared<_Request>();
+    request->priority = priority;
+    request->sequence = _sequence++;
+    request->key = key;
+    request->enqueuedAt = Clock::now();
+    _queue.push_back(request);
+    _stats.maxQueueDepth = std::max(_stats.maxQueueDepth, _queue.size());
+
+    // our turn : first in line, a token available and room in flight
+    while (true) {
+        auto now = Clock::now();
+        _refill(now);
+
+        auto isNext = _next() == request;
+        if (isNext && _tokens >= 1 && _stats.inFlight < _options.maxInFlight) break;
+
+        auto giveUpAt = std::min(deadline, request->enqueuedAt + _options.maxWait);
+        if (now >= giveUpAt) {
+            _dequeue(request);
+            _stats.timedOut++;
+            request->result = QUEUE_TIMEOUT;
+            request->isDone = true;
+            _cv.notify_all();
+            NWC_LOG_WARN("UPNP SOAP : {} waited {}ms, giving up", key,
+                std::chrono::duration_cast<std::chrono::milliseconds>(now - request->enqueuedAt).count());
+            return QUEUE_TIMEOUT;
+        }
+
+        // next token, unless something else is to happen first
+        auto wakeAt = giveUpAt;
+        if (isNext && _tokens < 1 && _options.requestsPerSecond > 0) {
+            auto missing = std::chrono::duration<double>((1 - _tokens) / _options.requestsPerSecond);
+            wakeAt = std::min(wakeAt, now + std::chrono::duration_cast<Clock::duration>(missing));
+        }
+        _cv.wait_until(lock, wakeAt);
+    }
+
+    _dequeue(request);
+    _tokens -= 1;
+    _stats.inFlight++;
+
+    auto waitMs = std::chrono::duration<double, std::milli>(Clock::now() - request->enqueuedAt).count();
+    _totalWaitMs += waitMs;
+    _stats.maxWaitMs = std::max(_stats.maxWaitMs, waitMs);
+
+    // sent by us, joined requests waiting for the outputs
+    lock.unlock();
+    TraceArguments answer;
+    auto result = call(answer);
+    lock.lock();
+
+    _stats.inFlight--;
+    _stats.executed++;
+    request->result = result;
+    request->outputs = answer;
+    request->isDone = true;
+    _cv.notify_all();
+
+    if (outputs) *outputs = std::move(answer);
+    return result;
+}
+
+NetworkCandy::SOAPSchedulerStats NetworkCandy::SOAPScheduler::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto stats = _stats;
+    stats.queueDepth = _queue.size();
+    stats.meanWaitMs = _stats.executed ? _totalWaitMs / _stats.executed : 0;
+    return stats;
+}
+
+void NetworkCandy::SOAPScheduler::_refill(Clock::time_point now) {
+    auto elapsed = std::chrono::duration<double>(now - _refilledAt).count();
+    _tokens = std::min(_options.burst, _tokens + elapsed * _options.requestsPerSecond);
+    _refilledAt = now;
+}
+
+std::shared_ptr<NetworkCandy::SOAPScheduler::_Request> NetworkCandy::SOAPScheduler::_next() const {
+    std::shared_ptr<_Request> next;
+    for (auto &queued : _queue) {
+        if (!next || queued->priority < next->priority ||
+            (queued->priority == next->priority && queued->sequence < next->sequence)) {
+            next = queued;
+        }
+    }
+    return next;
+}
+
+void NetworkCandy::SOAPScheduler::_dequeue(const std::shared_ptr<_Request>& request) {
+    _queue.erase(std::remove(_queue.begin(), _queue.end(), request), _queue.end());
+
+    // whoever is next now may go
+    _cv.notify_all();
+}
@@ -0,0 +1,111 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "SSDP.h"
+
+#include <cctype>
+
+namespace {
+
+bool _iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (std::size_t i = 0; i < a.size(); i++) {
+        if (std::tolower((unsigned char)a[i]) != std::tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+std::string_view _trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t' || value.back() == '\r')) value.remove_suffix(1);
+    return value;
+}
+
+bool _startsWith(std::string_view value, std::string_view prefix) {
+    return value.size() >= prefix.size() && _iequals(value.substr(0, prefix.size()), prefix);
+}
+
+}  // namespace
+
+std::string_view NetworkCandy::SSDPMessage::uuid() const {
+    auto end = usn.find("::");
+    return end == std::string_view::npos ? usn : usn.substr(0, end);
+}
+
+bool NetworkCandy::parseSSDPMessage(const char * data, std::size_t length, SSDPMessage* out) {
+    std::string_view message(data, length);
+    *out = SSDPMessage();
+
+    // start line
+    auto lineEnd = message.find('\n');
+    if (lineEnd == std::string_view::npos) return false;
+    auto startLine = _trim(message.substr(0, lineEnd));
+
+    if (_startsWith(startLine, "NOTIFY ")) {
+        out->type = SSDPMessageType::Notify;
+    } else if (_startsWith(startLine, "HTTP/1.1 200") || _startsWith(startLine, "HTTP/1.0 200")) {
+        out->type = SSDPMessageType::SearchResponse;
+    } else if (_startsWith(startLine, "M-SEARCH ")) {
+        out->type = SSDPMessageType::Search;
+    } else {
+        return false;
+    }
+
+    // headers, up to the empty line
+    auto pos = lineEnd + 1;
+    while (pos < message.size()) {
+        lineEnd = message.find('\n', pos);
+        if (lineEnd == std::string_view::npos) lineEnd = message.size();
+        auto line = _trim(message.substr(pos, lineEnd - pos));
+        pos = lineEnd + 1;
+
+        if (line.empty()) break;
+
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) continue;
+
+        auto name = _trim(line.substr(0, colon));
+        auto value = _trim(line.substr(colon + 1));
+
+        if (_iequals(name, "NT")) out->nt = value;
+        else if (_iequals(name, "NTS")) out->nts = value;
+        else if (_iequals(name, "ST")) out->st = value;
+        else if (_iequals(name, "USN")) out->usn = value;
+        else if (_iequals(name, "LOCATION")) out->location = value;
+        else if (_iequals(name, "SERVER")) out->server = value;
+        else if (_iequals(name, "CACHE-CONTROL")) out->cacheControl = value;
+        else if (_iequals(name, "BOOTID.UPNP.ORG")) out->bootId = value;
+        else if (_iequals(name, "NEXTBOOTID.UPNP.ORG")) out->nextBootId = value;
+        else if (_iequals(name, "CONFIGID.UPNP.ORG")) out->configId = value;
+    }
+
+    return true;
+}
+
+bool NetworkCandy::isIGDSearchTarget(std::string_view target) {
+    return target.find(":device:InternetGatewayDevice:") != std::string_view::npos ||
+           target.find(":service:WANIPConnection:") != std::string_view::npos ||
+           target.find(":service:WANPPPConnection:") != std::string_view::npos ||
+           target.find(":device:WANConnectionDevice:") != std::string_view::npos ||
+           target.find(":device:WANDevice:") != std::string_view::npos;
+}
+
+bool NetworkCandy::isRootDeviceTarget(std::string_view target) {
+    return target == "upnp:rootdevice";
+}
@@ -0,0 +1,178 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "SSDPDeviceTable.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace {
+
+// FNV-1a
+uint64_t _hash(std::string_view value) {
+    uint64_t hash = 14695981039346656037ull;
+    for (auto c : value) {
+        hash ^= (unsigned char)c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+}  // namespace
+
+NetworkCandy::SSDPDeviceTable::SSDPDeviceTable(std::size_t maxDevices, std::size_t maxBytes, Filter filter) :
+    _maxDevices(std::min<std::size_t>(maxDevices, std::numeric_limits<uint32_t>::max() / 2)),
+    _maxBytes(maxBytes),
+    _filter(filter) {}
+
+NetworkCandy::SSDPDeviceTable::Insertion NetworkCandy::SSDPDeviceTable::insert(const SSDPMessage& message, uint32_t tag) {
+    if (message.type == SSDPMessageType::Notify && message.nts != "ssdp:alive") return Insertion::Filtered;
+    if (message.type != SSDPMessageType::Notify && message.type != SSDPMessageType::SearchResponse) return Insertion::Filtered;
+    return insert(message.usn, message.target(), message.location, message.server, tag);
+}
+
+NetworkCandy::SSDPDeviceTable::Insertion NetworkCandy::SSDPDeviceTable::insert(std::string_view usn, std::string_view st, std::string_view location, std::string_view server, uint32_t tag) {
+    // early filtering, before anything is stored
+    if (usn.empty() || location.empty() || !_filter(st)) return Insertion::Filtered;
+
+    // bounded, whatever the flood
+    constexpr std::size_t maxLength = std::numeric_limits<uint16_t>::max();
+    if (usn.size() > maxLength || st.size() > maxLength || location.size() > maxLength || server.size() > maxLength) return Insertion::Filtered;
+
+    if (_slots.empty()) _grow();
+    auto mask = _slots.size() - 1;
+    auto hash = _hash(usn);
+    auto slot = hash & mask;
+    while (_slots[slot]) {
+        if (_usnOf(_records[_slots[slot] - 1]) == usn) return Insertion::Duplicate;
+        slot = (slot + 1) & mask;
+    }
+
+    auto length = usn.size() + st.size() + location.size() + server.size();
+    if (_records.size() >= _maxDevices || _bytes + length > _maxBytes) return Insertion::Full;
+
+    _Record record;
+    record.usnLength = (uint16_t)usn.size();
+    record.stLength = (uint16_t)st.size();
+    record.locationLength = (uint16_t)location.size();
+    record.serverLength = (uint16_t)server.size();
+    record.tag = tag;
+    record.seenAt = std::chrono::steady_clock::now();
+
+    auto at = _allocate(length, &record.chunk, &record.offset);
+    for (auto part : { usn, st, location, server }) {
+        std::memcpy(at, part.data(), part.size());
+        at += part.size();
+    }
+
+    // keeping slots at most half full, the free one found may move
+    if ((_records.size() + 1) * 2 > _slots.size()) {
+        _grow();
+        mask = _slots.size() - 1;
+        slot = hash & mask;
+        while (_slots[slot]) slot = (slot + 1) & mask;
+    }
+
+    _records.push_back(record);
+    _slots[slot] = (uint32_t)_records.size();
+
+    return Insertion::Added;
+}
+
+std::size_t NetworkCandy::SSDPDeviceTable::size() const {
+    return _records.size();
+}
+
+bool NetworkCandy::SSDPDeviceTable::empty() const {
+    return _records.empty();
+}
+
+NetworkCandy::SSDPDeviceTable::Entry NetworkCandy::SSDPDeviceTable::operator[](std::size_t index) const {
+    auto &record = _records[index];
+    auto at = _dataOf(record);
+
+    Entry entry;
+    entry.usn = std::string_view(at, record.usnLength);
+    at += record.usnLength;
+    entry.st = std::string_view(at, record.stLength);
+    at += record.stLength;
+    entry.location = std::string_view(at, record.locationLength);
+    at += record.locationLength;
+    entry.server = std::string_view(at, record.serverLength);
+    entry.seenAt = record.seenAt;
+    entry.tag = record.tag;
+    return entry;
+}
+
+std::size_t NetworkCandy::SSDPDeviceTable::bytes() const {
+    return _bytes;
+}
+
+std::size_t NetworkCandy::SSDPDeviceTable::reservedBytes() const {
+    auto reserved = _records.capacity() * sizeof(_Record) + _slots.capacity() * sizeof(uint32_t) + _chunks.capacity() * sizeof(_Chunk);
+    for (auto &chunk : _chunks) reserved += chunk.capacity;
+    return reserved;
+}
+
+void NetworkCandy::SSDPDeviceTable::clear() {
+    for (auto &chunk : _chunks) chunk.used = 0;
+    _currentChunk = 0;
+    _bytes = 0;
+    _records.clear();
+    std::fill(_slots.begin(), _slots.end(), 0);
+}
+
+const char * NetworkCandy::SSDPDeviceTable::_dataOf(const _Record& record) const {
+    return _chunks[record.chunk].data.get() + record.offset;
+}
+
+std::string_view NetworkCandy::SSDPDeviceTable::_usnOf(const _Record& record) const {
+    return std::string_view(_dataOf(record), record.usnLength);
+}
+
+char* NetworkCandy::SSDPDeviceTable::_allocate(std::size_t length, uint32_t* chunk, uint32_t* offset) {
+    // chunks kept from before clear() first, filled in order
+    while (_currentChunk < _chunks.size() && _chunks[_currentChunk].capacity - _chunks[_currentChunk].used < length) {
+        _currentChunk++;
+    }
+
+    if (_currentChunk == _chunks.size()) {
+        auto capacity = std::max(_CHUNK_SIZE, length);
+        _chunks.push_back({ std::unique_ptr<char[]>(new char[capacity]), capacity, 0 });
+    }
+
+    auto &current = _chunks[_currentChunk];
+    *chunk = (uint32_t)_currentChunk;
+    *offset = (uint32_t)current.used;
+    current.used += length;
+    _bytes += length;
+    return current.data.get() + *offset;
+}
+
+void NetworkCandy::SSDPDeviceTable::_grow() {
+    std::vector<uint32_t> slots(std::max<std::size_t>(16, _slots.size() * 2), 0);
+    auto mask = slots.size() - 1;
+    for (std::size_t i = 0; i < _records.size(); i++) {
+        auto slot = _hash(_usnOf(_records[i])) & mask;
+        while (slots[slot]) slot = (slot + 1) & mask;
+        slots[slot] = (uint32_t)(i + 1);
+    }
+    _slots = std::move(slots);
+}
@@ -0,0 +1,224 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "SSDPListener.h"
+#include "Sockets.h"
+#include "Log.h"
+
+#include <cstring>
+
+NetworkCandy::SSDPListener::SSDPListener(EventCallback callback) : _callback(std::move(callback)) {}
+
+NetworkCandy::SSDPListener::~SSDPListener() {
+    stop();
+}
+
+bool NetworkCandy::SSDPListener::start(const std::string& interfaceIPv4, bool ownThread) {
+    if (_running) return true;
+    if (!Sockets::init()) return false;
+
+    auto sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == Sockets::INVALID) {
+        NWC_LOG_WARN("SSDP Listen : cannot create socket");
+        return false;
+    }
+
+    // other SSDP stacks of the host most probably listen too
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    #ifdef SO_REUSEPORT
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&yes, sizeof(yes));
+    #endif
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(SSDP_PORT);
+
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        NWC_LOG_WARN("SSDP Listen : cannot bind on port {}", SSDP_PORT);
+        Sockets::close(sock);
+        return false;
+    }
+
+    ip_mreq membership;
+    inet_pton(AF_INET, SSDP_MULTICAST_ADDRESS, &membership.imr_multiaddr);
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (!interfaceIPv4.empty()) inet_pton(AF_INET, interfaceIPv4.c_str(), &membership.imr_interface);
+
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) != 0) {
+        NWC_LOG_WARN("SSDP Listen : cannot join multicast group {}", SSDP_MULTICAST_ADDRESS);
+        Sockets::close(sock);
+        return false;
+    }
+
+    Sockets::setNonBlocking(sock);
+
+    _socket = Sockets::toHandle(sock);
+    _running = true;
+    if (ownThread) _thread = std::thread(&SSDPListener::_listen, this);
+
+    NWC_LOG_INFO("SSDP Listen : listening for gateways announcements on {}...", interfaceIPv4.empty() ? "default interface" : interfaceIPv4);
+    return true;
+}
+
+void NetworkCandy::SSDPListener::stop() {
+    if (!_running.exchange(false)) return;
+    if (_thread.joinable()) _thread.join();
+
+    Sockets::close(Sockets::fromHandle(_socket));
+    _socket = -1;
+
+    NWC_LOG_INFO("SSDP Listen : stopped.");
+}
+
+bool NetworkCandy::SSDPListener::isRunning() const {
+    return _running;
+}
+
+void NetworkCandy::SSDPListener::watchLocation(const std::string& location) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _watchedLocation = location;
+    _watchedUUID.clear();
+}
+
+std::vector<NetworkCandy::GatewayPresence> NetworkCandy::SSDPListener::gateways() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<GatewayPresence> out;
+    for (auto &pair : _gateways) out.push_back(pair.second);
+    return out;
+}
+
+void NetworkCandy::SSDPListener::_listen() {
+    auto sock = Sockets::fromHandle(_socket);
+
+    while (_running) {
+        // wake up regularly to check if stopped
+        if (Sockets::waitReadable(sock, 250) <= 0) continue;
+        _receive();
+    }
+}
+
+void NetworkCandy::SSDPListener::_receive() {
+    auto sock = Sockets::fromHandle(_socket);
+    char buffer[2048];
+
+    while (true) {
+        auto received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) break;
+        ingest(buffer, received);
+    }
+}
+
+std::vector<intptr_t> NetworkCandy::SSDPListener::fds() const {
+    if (!_running || _thread.joinable()) return {};
+    return { _socket };
+}
+
+void NetworkCandy::SSDPListener::process(const std::vector<intptr_t>& readyFds) {
+    if (!_running || _thread.joinable()) return;
+    for (auto fd : readyFds) {
+        if (fd == _socket) _receive();
+    }
+}
+
+void NetworkCandy::SSDPListener::ingest(const char * data, std::size_t length) {
+    SSDPMessage message;
+    if (!parseSSDPMessage(data, length, &message)) return;
+    if (message.type != SSDPMessageType::Notify) return;
+
+    GatewayPresence gateway;
+    GatewayEvent event;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_update(message, &gateway, &event)) return;
+    }
+
+    // outside of the lock, callbacks may query gateways()
+    if (_callback) _callback(event, gateway);
+}
+
+bool NetworkCandy::SSDPListener::_update(const SSDPMessage& message, GatewayPresence* gateway, GatewayEvent* event) {
+    std::string uuid(message.uuid());
+    if (uuid.empty()) return false;
+
+    // learn which uuid the watched location belongs to
+    if (!_watchedLocation.empty() && _watchedUUID.empty() && message.location == _watchedLocation) {
+        _watchedUUID = uuid;
+    }
+
+    // filter out
+    if (!_watchedLocation.empty()) {
+        if (uuid != _watchedUUID) return false;
+    } else if (!isIGDSearchTarget(message.nt) && _gateways.find(uuid) == _gateways.end()) {
+        return false;
+    }
+
+    auto &known = _gateways[uuid];
+    auto isNew = known.uuid.empty();  // byebye of a never seen device is ignored below
+    known.uuid = uuid;
+    known.lastSeen = std::chrono::steady_clock::now();
+
+    // going away
+    if (message.nts == "ssdp:byebye") {
+        if (!known.isAlive) return false;
+        known.isAlive = false;
+        *event = GatewayEvent::Left;
+        *gateway = known;
+        NWC_LOG_INFO("SSDP Listen : gateway {} left", uuid);
+        return true;
+    }
+
+    // boot ID about to change, no need to react
+    if (message.nts == "ssdp:update") {
+        if (!message.nextBootId.empty()) known.bootId = message.nextBootId;
+        return false;
+    }
+
+    if (message.nts != "ssdp:alive") return false;
+
+    auto wasAlive = known.isAlive;
+    auto bootChanged = !message.bootId.empty() && !known.bootId.empty() && message.bootId != known.bootId;
+    auto configChanged = !message.configId.empty() && !known.configId.empty() && message.configId != known.configId;
+    auto locationChanged = message.bootId.empty() && !known.location.empty() && !message.location.empty() && message.location != known.location;
+
+    known.isAlive = true;
+    if (!message.bootId.empty()) known.bootId = message.bootId;
+    if (!message.configId.empty()) known.configId = message.configId;
+    if (!message.location.empty()) known.location = message.location;
+
+    *gateway = known;
+
+    if (bootChanged || locationChanged) {
+        *event = GatewayEvent::Rebooted;
+        NWC_LOG_INFO("SSDP Listen : gateway {} rebooted (BOOTID {})", uuid, known.bootId);
+    } else if (configChanged) {
+        *event = GatewayEvent::ConfigChanged;
+        NWC_LOG_INFO("SSDP Listen : gateway {} configuration changed (CONFIGID {})", uuid, known.configId);
+    } else if (isNew || !wasAlive) {
+        *event = GatewayEvent::Appeared;
+        NWC_LOG_INFO("SSDP Listen : gateway {} is alive at {}", uuid, known.location);
+    } else {
+        // periodic re-announcement, nothing changed
+        return false;
+    }
+
+    return true;
+}
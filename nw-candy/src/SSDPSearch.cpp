@@ -0,0 +1,225 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "SSDPSearch.h"
+#include "Sockets.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// as upnpDiscover() does, IGDv2 devices answering IGDv1 searches too; some gateways only answer for their
+// WAN connection service, or as root devices
+constexpr const char * _SEARCH_TARGETS[] = {
+    "urn:schemas-upnp-org:device:InternetGatewayDevice:1",
+    "urn:schemas-upnp-org:service:WANIPConnection:1",
+    "urn:schemas-upnp-org:service:WANPPPConnection:1",
+    "upnp:rootdevice"
+};
+
+int _remainingMs(std::chrono::steady_clock::time_point deadline) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    return remaining > 0 ? static_cast<int>(remaining) : 0;
+}
+
+}  // namespace
+
+NetworkCandy::SSDPSearch::SSDPSearch() {}
+
+NetworkCandy::SSDPSearch::~SSDPSearch() {
+    stop();
+}
+
+bool NetworkCandy::SSDPSearch::start(const std::string& interfaceIPv4, std::chrono::milliseconds wait, const std::string& destination, unsigned short port) {
+    stop();
+    if (!Sockets::init()) return false;
+
+    auto sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == Sockets::INVALID) {
+        NWC_LOG_WARN("SSDP Search : cannot create socket");
+        return false;
+    }
+
+    // answers come back to the port we send from
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (!interfaceIPv4.empty()) inet_pton(AF_INET, interfaceIPv4.c_str(), &addr.sin_addr);
+
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        NWC_LOG_WARN("SSDP Search : cannot bind on {}", interfaceIPv4);
+        Sockets::close(sock);
+        return false;
+    }
+
+    // multicast out of the requested interface, same TTL as miniupnpc
+    if (!interfaceIPv4.empty()) {
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&addr.sin_addr, sizeof(addr.sin_addr));
+    }
+    unsigned char ttl = 2;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+
+    Sockets::setNonBlocking(sock);
+    _socket = Sockets::toHandle(sock);
+
+    // MX in seconds, devices spreading their answers over it
+    auto mx = std::max<long long>(1, std::chrono::duration_cast<std::chrono::seconds>(wait).count());
+    _requests.clear();
+    for (auto target : _SEARCH_TARGETS) {
+        _requests.push_back(std::string("M-SEARCH * HTTP/1.1\r\n") +
+            "HOST: " + SSDP_MULTICAST_ADDRESS + ":" + std::to_string(SSDP_PORT) + "\r\n"
+            "ST: " + target + "\r\n"
+            "MAN: \"ssdp:discover\"\r\n"
+            "MX: " + std::to_string(mx) + "\r\n"
+            "\r\n");
+    }
+    _destination = destination;
+    _port = port;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _table.clear();
+        _rootDevices.clear();
+    }
+
+    auto now = Clock::now();
+    _resendAt = now + wait / 3;
+    _endsAt = now + wait;
+    _hasResent = false;
+
+    if (!_send()) {
+        _close();
+        return false;
+    }
+
+    NWC_LOG_DEBUG("SSDP Search : searching for IGDs on {} for {}ms...", interfaceIPv4.empty() ? "default interface" : interfaceIPv4, wait.count());
+    return true;
+}
+
+void NetworkCandy::SSDPSearch::stop() {
+    _close();
+}
+
+bool NetworkCandy::SSDPSearch::isDone() const {
+    return _socket == -1;
+}
+
+void NetworkCandy::SSDPSearch::wait() {
+    while (!isDone()) {
+        auto deadline = nextDeadline();
+        auto sock = Sockets::fromHandle(_socket);
+        if (Sockets::waitReadable(sock, _remainingMs(deadline)) > 0) {
+            process({ _socket });
+        } else {
+            process({});
+        }
+    }
+}
+
+std::vector<NetworkCandy::SSDPDevice> NetworkCandy::SSDPSearch::devices() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<SSDPDevice> devices;
+    auto &table = _found();
+    for (std::size_t i = 0; i < table.size(); i++) {
+        auto entry = table[i];
+        devices.push_back({ std::string(entry.usn), std::string(entry.st), std::string(entry.location), std::string(entry.server), entry.seenAt });
+    }
+    return devices;
+}
+
+const NetworkCandy::SSDPDeviceTable& NetworkCandy::SSDPSearch::table() const {
+    return _found();
+}
+
+const NetworkCandy::SSDPDeviceTable& NetworkCandy::SSDPSearch::_found() const {
+    return _table.empty() ? _rootDevices : _table;
+}
+
+void NetworkCandy::SSDPSearch::ingest(const char * data, std::size_t length) {
+    SSDPMessage message;
+    if (!parseSSDPMessage(data, length, &message)) return;
+    if (message.type != SSDPMessageType::SearchResponse) return;
+
+    // media servers, printers... and the answer to our second search never take room
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &table = isRootDeviceTarget(message.st) ? _rootDevices : _table;
+    if (table.insert(message) == SSDPDeviceTable::Insertion::Added) {
+        NWC_LOG_DEBUG("SSDP Search : found {} at {}", message.st, message.location);
+    }
+}
+
+std::vector<intptr_t> NetworkCandy::SSDPSearch::fds() const {
+    if (isDone()) return {};
+    return { _socket };
+}
+
+NetworkCandy::Pollable::Clock::time_point NetworkCandy::SSDPSearch::nextDeadline() const {
+    if (isDone()) return Clock::time_point::max();
+    return _hasResent ? _endsAt : _resendAt;
+}
+
+void NetworkCandy::SSDPSearch::process(const std::vector<intptr_t>& readyFds) {
+    if (isDone()) return;
+
+    if (std::find(readyFds.begin(), readyFds.end(), _socket) != readyFds.end()) _receive();
+
+    auto now = Clock::now();
+    if (!_hasResent && now >= _resendAt) {
+        _hasResent = true;
+        _send();
+    }
+    if (now >= _endsAt) _close();
+}
+
+bool NetworkCandy::SSDPSearch::_send() {
+    sockaddr_in to;
+    std::memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(_port);
+    if (inet_pton(AF_INET, _destination.c_str(), &to.sin_addr) != 1) return false;
+
+    for (auto &request : _requests) {
+        auto sent = sendto(Sockets::fromHandle(_socket), request.data(), (int)request.size(), 0, (sockaddr*)&to, sizeof(to));
+        if (sent != (decltype(sent))request.size()) {
+            NWC_LOG_WARN("SSDP Search : cannot send M-SEARCH to {}:{}", _destination, _port);
+            return false;
+        }
+    }
+    return true;
+}
+
+void NetworkCandy::SSDPSearch::_receive() {
+    auto sock = Sockets::fromHandle(_socket);
+    char buffer[2048];
+
+    while (true) {
+        auto received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) break;
+        ingest(buffer, received);
+    }
+}
+
+void NetworkCandy::SSDPSearch::_close() {
+    if (_socket == -1) return;
+    Sockets::close(Sockets::fromHandle(_socket));
+    _socket = -1;
+}
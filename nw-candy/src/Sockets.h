@@ -0,0 +1,119 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #include <windows.h>
+#else
+    #include <arpa/inet.h>
+    #include <fcntl.h>
+    #include <netinet/in.h>
+    #include <poll.h>
+    #include <sys/select.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstdint>
+
+// BSD / Winsock differences, private to nw-candy
+namespace NetworkCandy::Sockets {
+
+#ifdef _WIN32
+    using socket_t = SOCKET;
+    inline const socket_t INVALID = INVALID_SOCKET;
+#else
+    using socket_t = int;
+    inline constexpr socket_t INVALID = -1;
+#endif
+
+// public headers store sockets as intptr_t, INVALID being -1 on both platforms
+inline socket_t fromHandle(intptr_t handle) { return (socket_t)handle; }
+inline intptr_t toHandle(socket_t socket) { return (intptr_t)socket; }
+
+// WSAStartup, once per process; returns if succeeded
+inline bool init() {
+    #ifdef _WIN32
+        static const bool started = []() {
+            WSADATA data;
+            return WSAStartup(MAKEWORD(2, 2), &data) == NO_ERROR;
+        }();
+        return started;
+    #else
+        return true;
+    #endif
+}
+
+inline void close(socket_t socket) {
+    if (socket == INVALID) return;
+    #ifdef _WIN32
+        closesocket(socket);
+    #else
+        ::close(socket);
+    #endif
+}
+
+inline bool setNonBlocking(socket_t socket) {
+    #ifdef _WIN32
+        u_long mode = 1;
+        return ioctlsocket(socket, FIONBIO, &mode) == 0;
+    #else
+        auto flags = fcntl(socket, F_GETFL, 0);
+        return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+    #endif
+}
+
+// fd_set is a bitmap indexed by descriptor on POSIX, undefined past FD_SETSIZE : poll() there. Winsock
+// fd_set being a list of handles, select() has no such limit, and unlike WSAPoll() it reports failed connects
+#ifdef _WIN32
+    inline int _wait(socket_t socket, bool forWriting, int timeoutMs) {
+        fd_set set, failed;
+        FD_ZERO(&set);
+        FD_ZERO(&failed);
+        FD_SET(socket, &set);
+        FD_SET(socket, &failed);
+        timeval timeout { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+        return select(0, forWriting ? NULL : &set, forWriting ? &set : NULL, forWriting ? &failed : NULL, &timeout);
+    }
+#else
+    inline int _wait(socket_t socket, bool forWriting, int timeoutMs) {
+        pollfd fd { socket, (short)(forWriting ? POLLOUT : POLLIN), 0 };
+        int r;
+        do {
+            r = ::poll(&fd, 1, timeoutMs);
+        } while (r < 0 && errno == EINTR);
+        return r;
+    }
+#endif
+
+// returns > 0 if readable (or failed), 0 on timeout, < 0 on error
+inline int waitReadable(socket_t socket, int timeoutMs) {
+    return _wait(socket, false, timeoutMs);
+}
+
+// returns > 0 if writable (or failed, SO_ERROR telling), 0 on timeout, < 0 on error
+inline int waitWritable(socket_t socket, int timeoutMs) {
+    return _wait(socket, true, timeoutMs);
+}
+
+}  // namespace NetworkCandy::Sockets
@@ -0,0 +1,276 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "Stun.h"
+#include "Sockets.h"
+#include "Log.h"
+
+#ifndef _WIN32
+    #include <netdb.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+namespace {
+
+constexpr uint16_t _BINDING_REQUEST = 0x0001;
+constexpr uint16_t _BINDING_SUCCESS = 0x0101;
+constexpr uint32_t _MAGIC_COOKIE = 0x2112A442;
+constexpr uint16_t _MAPPED_ADDRESS = 0x0001;
+constexpr uint16_t _XOR_MAPPED_ADDRESS = 0x0020;
+
+uint16_t _read16(const uint8_t* at) { return (uint16_t)((at[0] << 8) | at[1]); }
+uint32_t _read32(const uint8_t* at) { return ((uint32_t)_read16(at) << 16) | _read16(at + 2); }
+
+// returns if "data" is a Binding success for "transactionId", with a mapped address
+bool _parseBindingSuccess(const uint8_t* data, std::size_t length, const uint8_t* transactionId, std::string* address, unsigned short* port) {
+    if (length < 20 || _read16(data) != _BINDING_SUCCESS || _read32(data + 4) != _MAGIC_COOKIE) return false;
+    if (std::memcmp(data + 8, transactionId, 12) != 0) return false;
+
+    auto messageLength = std::min<std::size_t>(_read16(data + 2), length - 20);
+    auto at = data + 20;
+    auto end = at + messageLength;
+
+    // XOR-MAPPED-ADDRESS preferred, MAPPED-ADDRESS from RFC 3489 servers otherwise
+    bool found = false;
+    while (at + 4 <= end) {
+        auto type = _read16(at);
+        auto valueLength = _read16(at + 2);
+        auto value = at + 4;
+        if (value + valueLength > end) break;
+
+        auto isXor = type == _XOR_MAPPED_ADDRESS;
+        if ((isXor || (type == _MAPPED_ADDRESS && !found)) && valueLength >= 8 && value[1] == 0x01) {
+            auto mappedPort = _read16(value + 2);
+            auto mappedAddress = _read32(value + 4);
+            if (isXor) {
+                mappedPort ^= (uint16_t)(_MAGIC_COOKIE >> 16);
+                mappedAddress ^= _MAGIC_COOKIE;
+            }
+
+            in_addr inAddress;
+            inAddress.s_addr = htonl(mappedAddress);
+            char text[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &inAddress, text, sizeof(text));
+            *address = text;
+            *port = mappedPort;
+            found = true;
+            if (isXor) break;
+        }
+
+        // attributes are padded to 4 bytes
+        at = value + ((valueLength + 3) & ~3);
+    }
+
+    return found;
+}
+
+bool _isInRange(const std::string& ip, const char * network, int prefix) {
+    in_addr address, range;
+    if (inet_pton(AF_INET, ip.c_str(), &address) != 1 || inet_pton(AF_INET, network, &range) != 1) return false;
+    auto mask = prefix ? htonl(~0u << (32 - prefix)) : 0;
+    return (address.s_addr & mask) == (range.s_addr & mask);
+}
+
+}  // namespace
+
+NetworkCandy::NATTopology NetworkCandy::classifyNAT(const std::string& localIP, const std::string& gatewayExternalIP, const std::string& stunIP) {
+    // the IGD WAN side in the shared address space, whatever STUN says
+    if (_isInRange(gatewayExternalIP, "100.64.0.0", 10)) return NATTopology::CarrierGrade;
+
+    // ... or in a private one
+    if (_isInRange(gatewayExternalIP, "10.0.0.0", 8) || _isInRange(gatewayExternalIP, "172.16.0.0", 12) ||
+        _isInRange(gatewayExternalIP, "192.168.0.0", 16)) return NATTopology::Double;
+
+    if (stunIP.empty()) return NATTopology::Unknown;
+    if (stunIP == localIP) return NATTopology::None;
+
+    // not connected yet, some IGDs answer 0.0.0.0
+    if (gatewayExternalIP.empty() || gatewayExternalIP == "0.0.0.0") return NATTopology::Unknown;
+
+    // the IGD not being the edge
+    return stunIP == gatewayExternalIP ? NATTopology::Single : NATTopology::Double;
+}
+
+NetworkCandy::StunClient::StunClient() {}
+
+NetworkCandy::StunClient::~StunClient() {
+    stop();
+}
+
+bool NetworkCandy::StunClient::start(const std::vector<std::string>& servers, std::chrono::milliseconds timeout, std::chrono::milliseconds initialRto) {
+    stop();
+    _result = StunResult();
+    _servers.clear();
+    if (!Sockets::init()) return false;
+
+    static thread_local std::mt19937 random(std::random_device{}());
+
+    for (auto &name : servers) {
+        // "host[:port]"
+        auto colon = name.rfind(':');
+        auto host = colon == std::string::npos ? name : name.substr(0, colon);
+        auto port = colon == std::string::npos ? DEFAULT_PORT : (unsigned short)std::atoi(name.substr(colon + 1).c_str());
+
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo* resolved = nullptr;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &resolved) != 0 || !resolved) {
+            NWC_LOG_WARN("STUN : cannot resolve {}", host);
+            continue;
+        }
+
+        _Server server;
+        server.name = name;
+        server.address = ((sockaddr_in*)resolved->ai_addr)->sin_addr.s_addr;
+        server.port = port;
+        for (auto &byte : server.transactionId) byte = (uint8_t)random();
+        freeaddrinfo(resolved);
+
+        _servers.push_back(server);
+    }
+    if (_servers.empty()) return false;
+
+    auto sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == Sockets::INVALID) {
+        NWC_LOG_WARN("STUN : cannot create socket");
+        return false;
+    }
+    Sockets::setNonBlocking(sock);
+    _socket = Sockets::toHandle(sock);
+
+    _startedAt = Clock::now();
+    _endsAt = _startedAt + timeout;
+    _rto = initialRto;
+    _send();
+
+    NWC_LOG_DEBUG("STUN : Binding requests sent to {} server(s)", _servers.size());
+    return true;
+}
+
+void NetworkCandy::StunClient::stop() {
+    _close();
+}
+
+bool NetworkCandy::StunClient::isDone() const {
+    return _socket == -1;
+}
+
+NetworkCandy::StunResult NetworkCandy::StunClient::wait() {
+    while (!isDone()) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(nextDeadline() - Clock::now()).count();
+        auto sock = Sockets::fromHandle(_socket);
+        if (Sockets::waitReadable(sock, remaining > 0 ? (int)remaining : 0) > 0) {
+            process({ _socket });
+        } else {
+            process({});
+        }
+    }
+    return _result;
+}
+
+NetworkCandy::StunResult NetworkCandy::StunClient::result() const {
+    return _result;
+}
+
+std::vector<intptr_t> NetworkCandy::StunClient::fds() const {
+    if (isDone()) return {};
+    return { _socket };
+}
+
+NetworkCandy::Pollable::Clock::time_point NetworkCandy::StunClient::nextDeadline() const {
+    if (isDone()) return Clock::time_point::max();
+    return std::min(_retransmitAt, _endsAt);
+}
+
+void NetworkCandy::StunClient::process(const std::vector<intptr_t>& readyFds) {
+    if (isDone()) return;
+
+    if (std::find(readyFds.begin(), readyFds.end(), _socket) != readyFds.end()) _receive();
+    if (isDone()) return;
+
+    auto now = Clock::now();
+    if (now >= _endsAt) {
+        NWC_LOG_INFO("STUN : no answer from {} server(s) in time", _servers.size());
+        _close();
+    } else if (now >= _retransmitAt) {
+        _send();
+    }
+}
+
+void NetworkCandy::StunClient::_send() {
+    // 20 bytes header, no attributes
+    uint8_t request[20] = {
+        (uint8_t)(_BINDING_REQUEST >> 8), (uint8_t)_BINDING_REQUEST, 0, 0,
+        (uint8_t)(_MAGIC_COOKIE >> 24), (uint8_t)(_MAGIC_COOKIE >> 16), (uint8_t)(_MAGIC_COOKIE >> 8), (uint8_t)_MAGIC_COOKIE
+    };
+
+    auto sock = Sockets::fromHandle(_socket);
+    for (auto &server : _servers) {
+        std::memcpy(request + 8, server.transactionId, 12);
+
+        sockaddr_in to;
+        std::memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = server.address;
+        to.sin_port = htons(server.port);
+        sendto(sock, (const char*)request, sizeof(request), 0, (sockaddr*)&to, sizeof(to));
+    }
+
+    // same transactions, backing off
+    _retransmitAt = Clock::now() + _rto;
+    _rto *= 2;
+}
+
+void NetworkCandy::StunClient::_receive() {
+    auto sock = Sockets::fromHandle(_socket);
+    uint8_t buffer[1024];
+
+    while (true) {
+        sockaddr_in from;
+        socklen_t fromLength = sizeof(from);
+        auto received = recvfrom(sock, (char*)buffer, sizeof(buffer), 0, (sockaddr*)&from, &fromLength);
+        if (received <= 0) return;
+
+        // from one of ours, answering its own transaction
+        for (auto &server : _servers) {
+            if (from.sin_addr.s_addr != server.address || ntohs(from.sin_port) != server.port) continue;
+            if (!_parseBindingSuccess(buffer, received, server.transactionId, &_result.address, &_result.port)) continue;
+
+            _result.succeeded = true;
+            _result.server = server.name;
+            _result.rttMs = std::chrono::duration<double, std::milli>(Clock::now() - _startedAt).count();
+            NWC_LOG_INFO("STUN : {} sees us as {}:{} ({:.1f}ms)", server.name, _result.address, _result.port, _result.rttMs);
+
+            _close();
+            return;
+        }
+    }
+}
+
+void NetworkCandy::StunClient::_close() {
+    if (_socket == -1) return;
+    Sockets::close(Sockets::fromHandle(_socket));
+    _socket = -1;
+}
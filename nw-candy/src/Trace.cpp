@@ -0,0 +1,253 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "Trace.h"
+#include "Log.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+// File format, one event per line, fields separated by tabs :
+//   S <atMs> <durationMs> <location> <st> <usn>
+//   D <atMs> <durationMs> <url> <xml>
+//   A <atMs> <durationMs> <controlURL> <serviceType> <action> <resultCode> <in> <out>
+// arguments being "name=value;name=value", and %, tab, newlines, ; and = percent-encoded everywhere.
+
+namespace {
+
+std::string _escape(const std::string& value) {
+    static const char * hex = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(value.size());
+    for (auto c : value) {
+        if (c == '%' || c == '\t' || c == '\n' || c == '\r' || c == ';' || c == '=') {
+            out += '%';
+            out += hex[(c >> 4) & 0xF];
+            out += hex[c & 0xF];
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string _unescape(const std::string& value) {
+    std::string out;
+    out.reserve(value.size());
+    for (std::size_t i = 0; i < value.size(); i++) {
+        if (value[i] == '%' && i + 2 < value.size()) {
+            out += (char)std::strtol(value.substr(i + 1, 2).c_str(), nullptr, 16);
+            i += 2;
+        } else {
+            out += value[i];
+        }
+    }
+    return out;
+}
+
+std::vector<std::string> _split(const std::string& value, char separator) {
+    std::vector<std::string> out;
+    std::size_t start = 0;
+    for (;;) {
+        auto end = value.find(separator, start);
+        out.push_back(value.substr(start, end - start));
+        if (end == std::string::npos) break;
+        start = end + 1;
+    }
+    return out;
+}
+
+std::string _serializeArguments(const NetworkCandy::TraceArguments& arguments) {
+    std::string out;
+    for (auto &pair : arguments) {
+        if (!out.empty()) out += ';';
+        out += _escape(pair.first) + '=' + _escape(pair.second);
+    }
+    return out;
+}
+
+NetworkCandy::TraceArguments _parseArguments(const std::string& value) {
+    NetworkCandy::TraceArguments out;
+    if (value.empty()) return out;
+    for (auto &pair : _split(value, ';')) {
+        auto equal = pair.find('=');
+        if (equal == std::string::npos) continue;
+        out.emplace_back(_unescape(pair.substr(0, equal)), _unescape(pair.substr(equal + 1)));
+    }
+    return out;
+}
+
+}  // namespace
+
+bool NetworkCandy::Trace::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) return false;
+
+    std::stringstream content;
+    content << file.rdbuf();
+    return parse(content.str());
+}
+
+bool NetworkCandy::Trace::save(const std::string& path) const {
+    std::ofstream file(path, std::ios::trunc);
+    if (!file) return false;
+    file << serialize();
+    return true;
+}
+
+bool NetworkCandy::Trace::parse(const std::string& content) {
+    events.clear();
+
+    std::istringstream in(content);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+
+        auto fields = _split(line, '\t');
+        if (fields.size() < 3) return false;
+
+        TraceEvent event;
+        event.atMs = std::atoll(fields[1].c_str());
+        event.durationMs = std::atoll(fields[2].c_str());
+
+        if (fields[0] == "S" && fields.size() == 6) {
+            event.kind = TraceEvent::Kind::SSDPResponse;
+            event.url = _unescape(fields[3]);
+            event.action = _unescape(fields[4]);
+            event.service = _unescape(fields[5]);
+        } else if (fields[0] == "D" && fields.size() == 5) {
+            event.kind = TraceEvent::Kind::Description;
+            event.url = _unescape(fields[3]);
+            event.body = _unescape(fields[4]);
+        } else if (fields[0] == "A" && fields.size() == 9) {
+            event.kind = TraceEvent::Kind::SOAP;
+            event.url = _unescape(fields[3]);
+            event.service = _unescape(fields[4]);
+            event.action = _unescape(fields[5]);
+            event.resultCode = std::atoi(fields[6].c_str());
+            event.arguments = _parseArguments(fields[7]);
+            event.outputs = _parseArguments(fields[8]);
+        } else {
+            NWC_LOG_WARN("Trace : malformed line \"{}\"", line.substr(0, 32));
+            return false;
+        }
+
+        events.push_back(std::move(event));
+    }
+
+    return true;
+}
+
+std::string NetworkCandy::Trace::serialize() const {
+    std::ostringstream out;
+    for (auto &event : events) {
+        switch (event.kind) {
+            case TraceEvent::Kind::SSDPResponse:
+                out << "S\t" << event.atMs << '\t' << event.durationMs << '\t'
+                    << _escape(event.url) << '\t' << _escape(event.action) << '\t' << _escape(event.service);
+                break;
+            case TraceEvent::Kind::Description:
+                out << "D\t" << event.atMs << '\t' << event.durationMs << '\t'
+                    << _escape(event.url) << '\t' << _escape(event.body);
+                break;
+            case TraceEvent::Kind::SOAP:
+                out << "A\t" << event.atMs << '\t' << event.durationMs << '\t'
+                    << _escape(event.url) << '\t' << _escape(event.service) << '\t' << _escape(event.action) << '\t'
+                    << event.resultCode << '\t' << _serializeArguments(event.arguments) << '\t' << _serializeArguments(event.outputs);
+                break;
+        }
+        out << '\n';
+    }
+    return out.str();
+}
+
+void NetworkCandy::TraceRecorder::start(const std::string& path) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _path = path;
+    _trace.events.clear();
+    _startedAt = std::chrono::steady_clock::now();
+    _recording = true;
+
+    NWC_LOG_INFO("Trace : recording gateway exchanges to {}", path);
+}
+
+void NetworkCandy::TraceRecorder::stop() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_recording) return;
+    _recording = false;
+
+    if (!_trace.save(_path)) {
+        NWC_LOG_WARN("Trace : cannot write {}", _path);
+        return;
+    }
+
+    NWC_LOG_INFO("Trace : {} events written to {}", _trace.events.size(), _path);
+}
+
+bool NetworkCandy::TraceRecorder::isRecording() {
+    return _recording;
+}
+
+void NetworkCandy::TraceRecorder::recordSSDPResponse(std::string_view location, std::string_view st, std::string_view usn,
+                                                     std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point receivedAt) {
+    if (!_recording) return;
+
+    TraceEvent event;
+    event.kind = TraceEvent::Kind::SSDPResponse;
+    event.url = location;
+    event.action = st;
+    event.service = usn;
+    _record(std::move(event), since, receivedAt);
+}
+
+void NetworkCandy::TraceRecorder::recordDescription(const char * url, const std::string& xml, std::chrono::steady_clock::time_point since) {
+    if (!_recording) return;
+
+    TraceEvent event;
+    event.kind = TraceEvent::Kind::Description;
+    event.url = url ? url : "";
+    event.body = xml;
+    _record(std::move(event), since);
+}
+
+void NetworkCandy::TraceRecorder::recordSOAP(const char * controlURL, const char * serviceType, const char * action, TraceArguments arguments,
+                                             int resultCode, TraceArguments outputs, std::chrono::steady_clock::time_point since) {
+    if (!_recording) return;
+
+    TraceEvent event;
+    event.kind = TraceEvent::Kind::SOAP;
+    event.url = controlURL ? controlURL : "";
+    event.service = serviceType ? serviceType : "";
+    event.action = action;
+    event.arguments = std::move(arguments);
+    event.resultCode = resultCode;
+    event.outputs = std::move(outputs);
+    _record(std::move(event), since);
+}
+
+void NetworkCandy::TraceRecorder::_record(TraceEvent event, std::chrono::steady_clock::time_point since,
+                                          std::chrono::steady_clock::time_point until) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_recording) return;
+
+    event.atMs = std::chrono::duration_cast<std::chrono::milliseconds>(since - _startedAt).count();
+    event.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(until - since).count();
+    _trace.events.push_back(std::move(event));
+}
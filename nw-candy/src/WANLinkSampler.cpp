@@ -0,0 +1,227 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "WANLinkSampler.h"
+#include "Log.h"
+
+#include <miniupnpc/upnpcommands.h>
+
+#include <cstdlib>
+
+NetworkCandy::WANLinkSampler::WANLinkSampler() {}
+
+NetworkCandy::WANLinkSampler::~WANLinkSampler() {
+    stop();
+}
+
+void NetworkCandy::WANLinkSampler::setService(const std::string& controlURL, const std::string& serviceType) {
+    std::lock_guard<std::mutex> lock(_samplingMutex);
+    if (controlURL == _controlURL && serviceType == _serviceType) return;
+
+    _controlURL = controlURL;
+    _serviceType = serviceType;
+    _scheduler = controlURL.empty() ? nullptr : SOAPScheduler::forGateway(controlURL);
+
+    // counters of another gateway, or of the same one rebooted
+    _hasPrevious = false;
+}
+
+void NetworkCandy::WANLinkSampler::setConnectionService(const std::string& controlURL, const std::string& serviceType) {
+    std::lock_guard<std::mutex> lock(_samplingMutex);
+    _connectionURL = controlURL;
+    _connectionType = serviceType;
+}
+
+void NetworkCandy::WANLinkSampler::resetCounters() {
+    // not waiting for an ongoing sample, called from the SSDP listener
+    _isResetPending = true;
+}
+
+void NetworkCandy::WANLinkSampler::start(std::chrono::milliseconds interval) {
+    if (_running.exchange(true)) return;
+
+    NWC_LOG_INFO("UPNP WAN : Starting WAN link sampling every {}ms...", interval.count());
+
+    _thread = std::thread([this, interval]() {
+        std::unique_lock<std::mutex> lock(_stopMutex);
+        while (_running) {
+            lock.unlock();
+            sampleOnce();
+            lock.lock();
+            _stopCV.wait_for(lock, interval, [this]() { return !_running; });
+        }
+    });
+}
+
+void NetworkCandy::WANLinkSampler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(_stopMutex);
+        if (!_running.exchange(false)) return;
+    }
+    _stopCV.notify_all();
+    if (_thread.joinable()) _thread.join();
+
+    NWC_LOG_INFO("UPNP WAN : WAN link sampling stopped.");
+}
+
+bool NetworkCandy::WANLinkSampler::isRunning() const {
+    return _running;
+}
+
+bool NetworkCandy::WANLinkSampler::sampleOnce() {
+    // prevents concurrent sampleOnce() from the thread and from callers
+    std::lock_guard<std::mutex> lock(_samplingMutex);
+    if (_controlURL.empty()) return false;
+
+    Counters counters;
+    if (!_readCounters(&counters)) {
+        NWC_LOG_WARN("UPNP WAN : Cannot read WAN counters from {}", _controlURL);
+        return false;
+    }
+
+    unsigned int downstream = 0, upstream = 0;
+    TraceArguments rates;
+    _scheduler->run(SOAPPriority::Poll, _requestKey("GetCommonLinkProperties"), [this](TraceArguments& out) {
+        unsigned int down = 0, up = 0;
+        auto result = UPNP_GetLinkLayerMaxBitRates(_controlURL.c_str(), _serviceType.c_str(), &down, &up);
+        out = { {"NewLayer1DownstreamMaxBitRate", std::to_string(down)}, {"NewLayer1UpstreamMaxBitRate", std::to_string(up)} };
+        return result;
+    }, &rates);
+    if (rates.size() == 2) {
+        downstream = static_cast<unsigned int>(std::strtoul(rates[0].second.c_str(), nullptr, 10));
+        upstream = static_cast<unsigned int>(std::strtoul(rates[1].second.c_str(), nullptr, 10));
+    }
+
+    auto nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+
+    auto previous = _previous;
+    auto hadPrevious = _hasPrevious;
+    auto previousMs = _previousMs;
+
+    _previous = counters;
+    _previousMs = nowMs;
+    _hasPrevious = true;
+
+    // rebooted since, whatever the counters look like
+    if (_isResetPending.exchange(false)) hadPrevious = false;
+    if (!hadPrevious || nowMs <= previousMs) return true;
+
+    // went backwards : wrapped around, or started over along with the WAN connection
+    auto isBackwards = counters.bytesReceived < previous.bytesReceived || counters.bytesSent < previous.bytesSent ||
+                       counters.packetsReceived < previous.packetsReceived || counters.packetsSent < previous.packetsSent;
+    if (isBackwards && _hasRestarted(nowMs - previousMs)) {
+        NWC_LOG_INFO("UPNP WAN : WAN connection restarted, counters started over");
+        return true;
+    }
+
+    // modulo 2^32, so that wrapping counters still give the right delta;
+    // more than half the range within an interval means the counters were reset instead (gateway reboot)
+    auto delta = [](uint32_t now, uint32_t before) { return static_cast<uint32_t>(now - before); };
+    auto bytesIn = delta(counters.bytesReceived, previous.bytesReceived);
+    auto bytesOut = delta(counters.bytesSent, previous.bytesSent);
+    if (bytesIn > UINT32_MAX / 2 || bytesOut > UINT32_MAX / 2) return true;
+
+    auto seconds = (nowMs - previousMs) / 1000.0;
+
+    WANLinkQuality quality;
+    quality.timestampMs = nowMs;
+    quality.rxBytesPerSec = bytesIn / seconds;
+    quality.txBytesPerSec = bytesOut / seconds;
+    quality.rxPacketsPerSec = delta(counters.packetsReceived, previous.packetsReceived) / seconds;
+    quality.txPacketsPerSec = delta(counters.packetsSent, previous.packetsSent) / seconds;
+    quality.downstreamMaxBitRate = downstream;
+    quality.upstreamMaxBitRate = upstream;
+    if (downstream) quality.downstreamUsage = quality.rxBytesPerSec * 8 / downstream;
+    if (upstream) quality.upstreamUsage = quality.txBytesPerSec * 8 / upstream;
+
+    // faster than the link allows, counters were reset in between
+    if (quality.downstreamUsage > 2 || quality.upstreamUsage > 2) return true;
+
+    _series.push(quality);
+    return true;
+}
+
+bool NetworkCandy::WANLinkSampler::latest(WANLinkQuality* out) const {
+    return _series.latest(out);
+}
+
+const NetworkCandy::WANLinkSampler::Series& NetworkCandy::WANLinkSampler::history() const {
+    return _series;
+}
+
+bool NetworkCandy::WANLinkSampler::_readCounters(Counters* out) const {
+    auto url = _controlURL.c_str();
+    auto type = _serviceType.c_str();
+
+    // miniupnpc reports failures within the value itself
+    auto failed = [](UNSIGNED_INTEGER value) {
+        return value == static_cast<UNSIGNED_INTEGER>(UPNPCOMMAND_HTTP_ERROR);
+    };
+
+    // each through the gateway scheduler, samplers of several handlers sharing answers
+    auto query = [this, url, type](const char * action, UNSIGNED_INTEGER (*command)(const char *, const char *)) {
+        TraceArguments value;
+        auto result = _scheduler->run(SOAPPriority::Poll, _requestKey(action), [url, type, command](TraceArguments& out) {
+            auto counter = command(url, type);
+            out = { {"Value", std::to_string(counter)} };
+            return counter == static_cast<UNSIGNED_INTEGER>(UPNPCOMMAND_HTTP_ERROR) ? UPNPCOMMAND_HTTP_ERROR : UPNPCOMMAND_SUCCESS;
+        }, &value);
+        if (result != UPNPCOMMAND_SUCCESS || value.empty()) return static_cast<UNSIGNED_INTEGER>(UPNPCOMMAND_HTTP_ERROR);
+        return static_cast<UNSIGNED_INTEGER>(std::strtoull(value.front().second.c_str(), nullptr, 10));
+    };
+
+    auto bytesReceived = query("GetTotalBytesReceived", UPNP_GetTotalBytesReceived);
+    auto bytesSent = query("GetTotalBytesSent", UPNP_GetTotalBytesSent);
+    auto packetsReceived = query("GetTotalPacketsReceived", UPNP_GetTotalPacketsReceived);
+    auto packetsSent = query("GetTotalPacketsSent", UPNP_GetTotalPacketsSent);
+    if (failed(bytesReceived) || failed(bytesSent) || failed(packetsReceived) || failed(packetsSent)) return false;
+
+    // 32 bits on the wire (ui4), whatever miniupnpc was built with
+    out->bytesReceived = static_cast<uint32_t>(bytesReceived);
+    out->bytesSent = static_cast<uint32_t>(bytesSent);
+    out->packetsReceived = static_cast<uint32_t>(packetsReceived);
+    out->packetsSent = static_cast<uint32_t>(packetsSent);
+    return true;
+}
+
+bool NetworkCandy::WANLinkSampler::_hasRestarted(int64_t withinMs) const {
+    if (_connectionURL.empty()) return false;
+
+    TraceArguments status;
+    auto url = _connectionURL;
+    auto type = _connectionType;
+    auto result = _scheduler->run(SOAPPriority::Poll, url + '|' + type + "#GetStatusInfo", [url, type](TraceArguments& out) {
+        char connectionStatus[64] = "";
+        char lastError[64] = "";
+        unsigned int uptime = 0;
+        auto result = UPNP_GetStatusInfo(url.c_str(), type.c_str(), connectionStatus, &uptime, lastError);
+        out = { {"NewConnectionStatus", connectionStatus}, {"NewUptime", std::to_string(uptime)} };
+        return result;
+    }, &status);
+    if (result != UPNPCOMMAND_SUCCESS || status.size() != 2) return false;
+
+    auto uptimeMs = static_cast<int64_t>(std::strtoull(status[1].second.c_str(), nullptr, 10)) * 1000;
+    return status[0].second != "Connected" || uptimeMs < withinMs;
+}
+
+std::string NetworkCandy::WANLinkSampler::_requestKey(const char * action) const {
+    return _controlURL + '|' + _serviceType + '#' + action;
+}
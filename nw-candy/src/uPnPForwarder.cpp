@@ -18,12 +18,41 @@
 // different license and copyright still refer to this GPL.
 
 #include "uPnPForwarder.h"
+#include "Log.h"
 
-#include <spdlog/spdlog.h>
+#include <algorithm>
 
 uPnPForwarderImpl::uPnPForwarderImpl(const std::string& port, const std::string& PROTOCOL, const char * controlURL, const char * servicetype) : 
-    _portToForward(port), _protocol(PROTOCOL), _controlURL(controlURL), _servicetype(servicetype) { 
-    spdlog::info("UPNP run : using parameters for forwarder : {}, {}, {}, {}", _portToForward, _protocol, _controlURL, _servicetype);
+    _portToForward(port), _protocol(PROTOCOL), _controlURL(controlURL), _servicetype(servicetype),
+    _scheduler(NetworkCandy::SOAPScheduler::forGateway(controlURL)) { 
+    NWC_LOG_DEBUG("UPNP run : using parameters for forwarder : {}, {}, {}, {}", _portToForward, _protocol, _controlURL, _servicetype);
 }
 
 uPnPForwarderImpl::~uPnPForwarderImpl() {}
+
+std::string uPnPForwarderImpl::serviceKey() const {
+    return std::string(_controlURL) + '|' + _servicetype;
+}
+
+void uPnPForwarderImpl::setAddSuccessCodes(const std::vector<int>& codes) {
+    _addSuccessCodes = codes;
+}
+
+void uPnPForwarderImpl::setDeadline(NetworkCandy::SOAPScheduler::Clock::time_point deadline) {
+    _deadline = deadline;
+}
+
+bool uPnPForwarderImpl::_isAddSuccess(int result) const {
+    return std::find(_addSuccessCodes.begin(), _addSuccessCodes.end(), result) != _addSuccessCodes.end();
+}
+
+std::string uPnPForwarderImpl::_requestKey(const char * action, const std::string& arguments) const {
+    return serviceKey() + '#' + action + '|' + _portToForward + '|' + _protocol + '|' + arguments;
+}
+
+std::string uPnPForwarderImpl::_outputOf(const NetworkCandy::TraceArguments& outputs, const char * name) {
+    for (auto &output : outputs) {
+        if (output.first == name) return output.second;
+    }
+    return std::string();
+}
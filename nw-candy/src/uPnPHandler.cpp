@@ -18,96 +18,560 @@
 // different license and copyright still refer to this GPL.
 
 #include "uPnPHandler.h"
+#include "SSDPDeviceTable.h"
+#include "SSDPSearch.h"
+#include "Trace.h"
+#include "Log.h"
 
-#include <spdlog/spdlog.h>
-
+#include <miniupnpc/miniwget.h>
 #include <miniupnpc/upnpcommands.h>
 #include <miniupnpc/upnperrors.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <thread>
+
+namespace {
+
+// miniupnpc device list out of the IGD candidates only, allocated the way freeUPNPDevlist() expects; tags are scope ids
+UPNPDev* _toDeviceList(const NetworkCandy::SSDPDeviceTable& table) {
+    UPNPDev* head = nullptr;
+    for (auto i = table.size(); i-- > 0;) {
+        auto entry = table[i];
+        auto length = entry.location.size() + entry.st.size() + entry.usn.size() + 3;
+        auto device = (UPNPDev*)std::malloc(sizeof(UPNPDev) + length);
+        if (!device) break;
+
+        device->descURL = device->buffer;
+        device->st = device->descURL + entry.location.size() + 1;
+        device->usn = device->st + entry.st.size() + 1;
+        std::memcpy(device->descURL, entry.location.data(), entry.location.size());
+        device->descURL[entry.location.size()] = '\0';
+        std::memcpy(device->st, entry.st.data(), entry.st.size());
+        device->st[entry.st.size()] = '\0';
+        std::memcpy(device->usn, entry.usn.data(), entry.usn.size());
+        device->usn[entry.usn.size()] = '\0';
+        device->scope_id = entry.tag;
+
+        device->pNext = head;
+        head = device;
+    }
+    return head;
+}
+
+// as received; upnpDiscover() only handing its results once done waiting, IPv6 ones all get that time
+void _traceResponses(const NetworkCandy::SSDPDeviceTable& table, std::chrono::steady_clock::time_point since) {
+    if (!NetworkCandy::TraceRecorder::isRecording()) return;
+    for (std::size_t i = 0; i < table.size(); i++) {
+        auto entry = table[i];
+        NetworkCandy::TraceRecorder::recordSSDPResponse(entry.location, entry.st, entry.usn, since, entry.seenAt);
+    }
+}
+
+// miniwget_getaddr() has no timeout of its own : the fetch runs aside, and is left behind once "timeout" is spent
+char* _fetchDescription(const char * descURL, int* size, char* lanAddress, int lanAddressLength, unsigned int scopeId,
+                        int* status, std::chrono::milliseconds timeout) {
+    struct Fetch {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool isDone = false;
+        bool isAbandoned = false;
+        char* xml = nullptr;
+        int size = 0;
+        int status = 0;
+        std::vector<char> lanAddress;
+    };
+    auto fetch = std::make_shared<Fetch>();
+    fetch->lanAddress.assign(lanAddress, lanAddress + lanAddressLength);
+
+    std::thread([fetch, url = std::string(descURL), scopeId]() {
+        int size = 0, status = 0;
+        auto lanAddress = fetch->lanAddress;
+        auto xml = (char*)miniwget_getaddr(url.c_str(), &size, lanAddress.data(), (int)lanAddress.size(), scopeId, &status);
+
+        std::lock_guard<std::mutex> lock(fetch->mutex);
+        if (fetch->isAbandoned) {
+            std::free(xml);
+            return;
+        }
+        fetch->xml = xml;
+        fetch->size = size;
+        fetch->status = status;
+        fetch->lanAddress = lanAddress;
+        fetch->isDone = true;
+        fetch->cv.notify_all();
+    }).detach();
+
+    std::unique_lock<std::mutex> lock(fetch->mutex);
+    if (!fetch->cv.wait_for(lock, timeout, [&fetch]() { return fetch->isDone; })) {
+        fetch->isAbandoned = true;
+        NWC_LOG_DEBUG("UPNP Inst : root description {} not fetched within {}ms", descURL, timeout.count());
+        return nullptr;
+    }
+
+    *size = fetch->size;
+    *status = fetch->status;
+    std::memcpy(lanAddress, fetch->lanAddress.data(), lanAddressLength);
+    return fetch->xml;
+}
+
+// UPNP_GetValidIGD() rating of a single device : 1 connected IGD, 2 IGD not connected, 3 other UPnP device,
+// 0 if unreachable or too slow to describe itself; "checkConnection" off, any description is taken as
+// UPNP_GetIGDFromUrl() does. The root description is kept, so that the gateway is identified and traced without
+// being downloaded twice
+int _rateDevice(const char * descURL, unsigned int scopeId, bool checkConnection, UPNPUrls* urls, IGDdatas* data,
+                char* lanAddress, int lanAddressLength, std::string* description, std::chrono::milliseconds timeout) {
+    int size = 0;
+    int status = 0;
+    auto xml = _fetchDescription(descURL, &size, lanAddress, lanAddressLength, scopeId, &status, timeout);
+    if (!xml) {
+        NWC_LOG_DEBUG("UPNP Inst : cannot fetch root description {} (HTTP {})", descURL, status);
+        return 0;
+    }
+    description->assign(xml, size);
+    std::free(xml);
+
+    std::memset(data, 0, sizeof(IGDdatas));
+    std::memset(urls, 0, sizeof(UPNPUrls));
+    parserootdesc(description->data(), size, data);
+    GetUPNPUrls(urls, data, descURL, scopeId);
+    if (!checkConnection) return 1;
+
+    static const char _CIF[] = "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:";
+    if (std::strncmp(data->CIF.servicetype, _CIF, sizeof(_CIF) - 1) != 0) return 3;
+    if (UPNPIGD_IsConnected(urls, data)) return 1;
+
+    // WANIPConnection next to WANPPPConnection, the other one may be the connected one
+    if (data->second.servicetype[0] != '\0') {
+        std::swap(data->first, data->second);
+        FreeUPNPUrls(urls);
+        GetUPNPUrls(urls, data, descURL, scopeId);
+        if (UPNPIGD_IsConnected(urls, data)) return 1;
+
+        std::swap(data->first, data->second);
+        FreeUPNPUrls(urls);
+        GetUPNPUrls(urls, data, descURL, scopeId);
+    }
+
+    return 2;
+}
+
+}  // namespace
+
 NetworkCandy::uPnPHandler::uPnPHandler(const std::string &portToMap, const std::string &serviceDescription) :
     _targetPort(portToMap), _description(serviceDescription) {}
 
-// returns if port mapping is set
+// returns if port mapping is set, on any family
 bool NetworkCandy::uPnPHandler::ensurePortMapping() {
+    return ensurePortMapping(_DEFAULT_BUDGET);
+}
+
+bool NetworkCandy::uPnPHandler::ensurePortMapping(std::chrono::milliseconds budget) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _deadline = RetryPolicy::Clock::now() + budget;
+
     //
-    spdlog::info("UPNP run : Starting uPnP port mapping on port {} for [{}] ...", _targetPort, _description);
+    NWC_LOG_INFO("UPNP run : Starting uPnP port mapping on port {} for [{}] ...", _targetPort, _description);
 
     //
     try {
         //
-        _hasRedirect = false;
+        _hasRedirectV4 = false;
+        _hasRedirectV6 = false;
 
         // init uPnP...
         auto initOK = this->_initUPnP();
         if (!initOK) return false;
 
-        // use appropriate implementation
-        if(!_impl) 
-            _impl = _createAppropriateIGDImplementation();
-        
-        // check if has redirection already done
-        auto errCode = _impl->portforwardExists(&_hasRedirect);
-        if (_hasRedirect) {
-            return true;
-        } else if (errCode && !_hasRedirect) {
-            spdlog::info("UPNP run : cannot ensure that port mapping exist, continuing...");
-        }
+        // use appropriate implementations
+        if(!_implV4 && !_implV6)
+            _createIGDImplementations();
+
+        // both families at once
+        auto v4 = std::async(std::launch::async, [this]() {
+            return _ensureForwarding(AddressFamily::IPv4);
+        });
+        auto v6 = std::async(std::launch::async, [this]() {
+            return _ensureForwarding(AddressFamily::IPv6);
+        });
+        _hasRedirectV4 = v4.get();
+        _hasRedirectV6 = v6.get();
 
-        // no redirection set, try to ask for one
-        _impl->portforward(&_hasRedirect, _localIPAddress);
-        return _hasRedirect;
+        //
+        NWC_LOG_INFO("UPNP run : port mapping status : IPv4 {}, IPv6 {}",
+            _hasRedirectV4 ? "OK" : "KO", _hasRedirectV6 ? "OK" : "KO"
+        );
 
     } catch(...) {
         // log on exception
-        spdlog::warn("UPNP run : exception caught while processing");
+        NWC_LOG_WARN("UPNP run : exception caught while processing");
+    }
+
+    // what was learnt on the way, written once the gateway was dealt with
+    _profile = GatewayProfiles::shared().find(_gatewayIdentity);
+    GatewayProfiles::shared().flush();
+
+    return _hasRedirectV4 || _hasRedirectV6;
+}
+
+bool NetworkCandy::uPnPHandler::hasPortMapping(AddressFamily family) const {
+    return family == AddressFamily::IPv4 ? _hasRedirectV4 : _hasRedirectV6;
+}
+
+// returns if port mapping is set
+bool NetworkCandy::uPnPHandler::_ensureForwarding(AddressFamily family) {
+    auto isV4 = family == AddressFamily::IPv4;
+    auto impl = isV4 ? _implV4 : _implV6;
+    auto &localIp = isV4 ? _localIPv4 : _localIPv6;
+    auto familyDescr = isV4 ? "IPv4" : "IPv6";
+    auto &known = isV4 ? _profile.ipv4 : _profile.ipv6;
+
+    if(!impl) return false;
+
+    //
+    if(localIp.empty()) {
+        NWC_LOG_INFO("UPNP run : no local {} address on the gateway interface, skipping.", familyDescr);
+        return false;
+    }
+
+    // what we learn along the way, applied over the stored profile once done, as reachability
+    // checks and the other family update it meanwhile
+    std::vector<double> addLatencies, checkLatencies;
+    auto optimisticSupport = Support::Unknown;
+    std::string acceptedLease;
+    auto elapsedMs = [](std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    };
+    auto average = [](double current, double sample) {
+        return current > 0 ? current * 0.8 + sample * 0.2 : sample;
+    };
+
+    // lease known to work with this gateway
+    auto lease = known.leaseDuration.empty() ? std::string(_DEFAULT_LEASE_DURATION) : known.leaseDuration;
+
+    // adds, retrying once with another lease if the gateway asks for it
+    auto add = [&](bool optimistic, bool* hasRedirect, bool* isAmbiguous) {
+        auto errCode = 0;
+        for (auto attempt = 0; attempt < 2; attempt++) {
+            _policy.run(GatewayOperation::Add, _deadline, [&](std::chrono::milliseconds timeout) {
+                impl->setDeadline(_attemptDeadline(timeout));
+                auto start = std::chrono::steady_clock::now();
+                errCode = optimistic
+                    ? impl->portforwardOptimistic(hasRedirect, isAmbiguous, localIp.c_str(), lease.c_str())
+                    : impl->portforward(hasRedirect, localIp.c_str(), lease.c_str());
+                addLatencies.push_back(elapsedMs(start));
+
+                // an ambiguous answer is still an answer, checking tells more than asking again
+                return optimistic && *isAmbiguous ? 0 : errCode;
+            });
+
+            // 725 (OnlyPermanentLeasesSupported), or IGDv2 refusing permanent leases (402, InvalidArgs)
+            if(errCode == 725 && lease != "0") {
+                lease = "0";
+            } else if(errCode == 402 && lease == "0") {
+                lease = _FINITE_LEASE_DURATION;
+            } else {
+                break;
+            }
+            NWC_LOG_INFO("UPNP run : {} gateway refused lease, retrying with {}", familyDescr, lease);
+        }
+        if(*hasRedirect) acceptedLease = lease;
+        return errCode;
+    };
+
+    auto hasRedirect = false;
+    auto lastError = 0;
+    auto useOptimistic = known.optimistic == Support::Works ||
+                         (_optimisticMapping && known.optimistic != Support::Fails);
+
+    // single round-trip, when this gateway answers unambiguously
+    if(useOptimistic) {
+        bool isAmbiguous = false;
+        lastError = add(true, &hasRedirect, &isAmbiguous);
+        if (hasRedirect) {
+            optimisticSupport = Support::Works;
+        } else if (!isAmbiguous) {
+            NWC_LOG_WARN("UPNP run : optimistic {} mapping failed with code {}", familyDescr, lastError);
+        } else {
+            // check which way it went, and do not bother being optimistic with this gateway anymore
+            optimisticSupport = Support::Fails;
+            auto start = std::chrono::steady_clock::now();
+            lastError = _policy.run(GatewayOperation::Check, _deadline, [&](std::chrono::milliseconds timeout) {
+                impl->setDeadline(_attemptDeadline(timeout));
+                return impl->portforwardExists(&hasRedirect, localIp.c_str());
+            });
+            checkLatencies.push_back(elapsedMs(start));
+        }
+    } else {
+        // check if has redirection already done
+        auto start = std::chrono::steady_clock::now();
+        lastError = _policy.run(GatewayOperation::Check, _deadline, [&](std::chrono::milliseconds timeout) {
+            impl->setDeadline(_attemptDeadline(timeout));
+            return impl->portforwardExists(&hasRedirect, localIp.c_str());
+        });
+        checkLatencies.push_back(elapsedMs(start));
+
+        if (!hasRedirect) {
+            if (lastError) {
+                NWC_LOG_INFO("UPNP run : cannot ensure that {} port mapping exist, continuing...", familyDescr);
+            }
+
+            // no redirection set, try to ask for one
+            bool isAmbiguous = false;
+            lastError = add(false, &hasRedirect, &isAmbiguous);
+        }
     }
-    
-    return _hasRedirect;
+
+    // remember for next sessions; only the service lacking the action says something about the model,
+    // conflicts, authorization and transient rejects being about this network or this moment
+    auto isCapabilityMissing = !hasRedirect && isCapabilityFailure(lastError);
+    GatewayProfiles::shared().update(_gatewayIdentity, [&](GatewayProfile& profile) {
+        auto &learnt = isV4 ? profile.ipv4 : profile.ipv6;
+        for (auto ms : addLatencies) learnt.addLatencyMs = average(learnt.addLatencyMs, ms);
+        for (auto ms : checkLatencies) learnt.checkLatencyMs = average(learnt.checkLatencyMs, ms);
+        if (optimisticSupport != Support::Unknown) learnt.optimistic = optimisticSupport;
+        if (!acceptedLease.empty()) learnt.leaseDuration = acceptedLease;
+
+        if (hasRedirect) {
+            learnt.mapping = Support::Works;
+            learnt.failedAt = 0;
+        } else if (isCapabilityMissing) {
+            learnt.mapping = Support::Fails;
+            learnt.failedAt = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+    });
+
+    return hasRedirect;
 }
 
-uPnPForwarderImpl* NetworkCandy::uPnPHandler::_createAppropriateIGDImplementation() {
+void NetworkCandy::uPnPHandler::setOptimisticMapping(bool enabled) {
+    _optimisticMapping = enabled;
+}
+
+void NetworkCandy::uPnPHandler::_createIGDImplementations() {
     // checks
     bool isIGDv2 = _isIGDv2(_IGDData.first.servicetype);
     auto &FC_st = _IGDData.IPv6FC.servicetype;
     bool hasFirewallControl = FC_st[0] != '\0';
-    
-    // assume hole punching is available ?
-    if(hasFirewallControl) {
-        spdlog::info("UPNP run : FirewallControl service existing, trying IGDv2 implementation.");
-        return new IGDv2Forwarder(
+    bool hasWANConnection = _IGDData.first.servicetype[0] != '\0';
+
+    // IPv6 pinhole, if hole punching is available and did not fail on this model lately
+    if(hasFirewallControl && _profile.ipv6.isKnownToFail()) {
+        NWC_LOG_INFO("UPNP run : FirewallControl pinholing known to fail on this gateway, skipping IPv6.");
+    } else if(hasFirewallControl) {
+        NWC_LOG_INFO("UPNP run : FirewallControl service existing, using IGDv2 implementation for IPv6.");
+        _implV6 = new IGDv2Forwarder(
             _targetPort,
             PROTOCOL,
             _urls.controlURL_6FC,
             FC_st
         );
+        _implV6->setAddSuccessCodes(_profile.ipv6.addSuccessCodes);
+    } else if(isIGDv2) {
+        NWC_LOG_WARN("UPNP run : Detecting IGDv2 but no FirewallControl, something is fishy with device uPnP implementation !");
     }
 
-    //
-    if(!hasFirewallControl && isIGDv2) {
-        spdlog::warn("UPNP run : Detecting IGDv2 but no FirewallControl, something is fishy with device uPnP implementation !");
+    // IPv4 NAT mapping, alongside
+    if(hasWANConnection && _profile.ipv4.isKnownToFail()) {
+        NWC_LOG_INFO("UPNP run : port mapping known to fail on this gateway, skipping IPv4.");
+    } else if(hasWANConnection) {
+        NWC_LOG_INFO("UPNP run : WAN connection service existing, using IGDv1 implementation for IPv4.");
+        _implV4 = new IGDv1Forwarder(
+            _targetPort,
+            PROTOCOL,
+            _urls.controlURL,
+            _IGDData.first.servicetype,
+            _description.c_str()
+        );
+        _implV4->setAddSuccessCodes(_profile.ipv4.addSuccessCodes);
     }
+}
 
-    // anyways, use default impl
-    spdlog::info("UPNP run : no FirewallControl service found, trying to use IGDv1 implementation.");
-    return new IGDv1Forwarder(
-        _targetPort,
-        PROTOCOL,
-        _urls.controlURL,
-        _IGDData.first.servicetype,
-        _description.c_str()
-    );
+void NetworkCandy::uPnPHandler::_deleteIGDImplementations() {
+    if(_implV4) delete _implV4;
+    if(_implV6) delete _implV6;
+    _implV4 = nullptr;
+    _implV6 = nullptr;
 }
 
 void NetworkCandy::uPnPHandler::mayDeletePortMapping() {
-    if (_hasRedirect && _impl) {
-        this->_impl->removePortforward(&_hasRedirect);
-    }  
+    mayDeletePortMapping(_DEFAULT_BUDGET);
+}
+
+void NetworkCandy::uPnPHandler::mayDeletePortMapping(std::chrono::milliseconds budget) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _deadline = RetryPolicy::Clock::now() + budget;
+
+    auto remove = [this](uPnPForwarderImpl* impl, std::atomic<bool>* hasRedirect) {
+        if (!*hasRedirect || !impl) return;
+        auto isStillSet = true;
+        _policy.run(GatewayOperation::Delete, _deadline, [this, impl, &isStillSet](std::chrono::milliseconds timeout) {
+            impl->setDeadline(_attemptDeadline(timeout));
+            return impl->removePortforward(&isStillSet);
+        });
+        *hasRedirect = isStillSet;
+    };
+
+    // both families torn down together
+    auto v4 = std::async(std::launch::async, [&]() { remove(_implV4, &_hasRedirectV4); });
+    auto v6 = std::async(std::launch::async, [&]() { remove(_implV6, &_hasRedirectV6); });
+    v4.get();
+    v6.get();
+}
+
+void NetworkCandy::uPnPHandler::setRetryOptions(const RetryOptions& options) {
+    _policy.setOptions(options);
+}
+
+NetworkCandy::RetryPolicy::Clock::time_point NetworkCandy::uPnPHandler::_attemptDeadline(std::chrono::milliseconds attemptTimeout) const {
+    return std::min(_deadline, RetryPolicy::Clock::now() + attemptTimeout);
+}
+
+void NetworkCandy::uPnPHandler::invalidateGateway() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _invalidateGateway();
+}
+
+void NetworkCandy::uPnPHandler::_invalidateGateway() {
+    if(!_IGDFound) return;
+
+    NWC_LOG_INFO("UPNP Inst : Forgetting IGD {}", _urls.controlURL);
+
+    // forwarders point to the URLs about to be freed
+    _deleteIGDImplementations();
+    _policy.reset();
+    _wanLink.setService(std::string(), std::string());
+    _wanLink.setConnectionService(std::string(), std::string());
+    _scheduler.reset();
+    FreeUPNPUrls(&_urls);
+    _freeDiscoveries();
+    _IGDFound = false;
+
+    // may be another network, seen from another address
+    std::lock_guard<std::mutex> lock(_addressMutex);
+    std::strcpy(_externalIPAddress, "unset");
+    _isExternalIPFresh = false;
+    _stunExternalIP.clear();
+    _natTopology = NATTopology::Unknown;
+}
+
+bool NetworkCandy::uPnPHandler::watchGateway() {
+    if(_listener) return true;
+
+    std::string location;
+    std::string interfaceIP;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(!_IGDFound) {
+            NWC_LOG_WARN("UPNP Watch : no IGD known yet, call ensurePortMapping() first");
+            return false;
+        }
+        location = _urls.rootdescURL;
+        interfaceIP = _gatewayInterface.ipv4;
+    }
+
+    _listener = std::make_unique<SSDPListener>([this](GatewayEvent event, const GatewayPresence&) {
+        _onGatewayEvent(event);
+    });
+    _listener->watchLocation(location);
+
+    if(!_listener->start(interfaceIP)) {
+        _listener.reset();
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_watchMutex);
+        _isWatching = true;
+        _invalidatePending = false;
+        _remapPending = false;
+    }
+    _watchThread = std::thread(&uPnPHandler::_watchWork, this);
+
+    return true;
+}
+
+void NetworkCandy::uPnPHandler::stopWatchingGateway() {
+    if(_listener) _listener->stop();
+    _listener.reset();
+
+    // an ongoing remap is let to finish
+    {
+        std::lock_guard<std::mutex> lock(_watchMutex);
+        _isWatching = false;
+    }
+    _watchCV.notify_all();
+    if(_watchThread.joinable()) _watchThread.join();
+}
+
+// runs on the listener thread, or in the caller's loop; only flags what is to be done
+void NetworkCandy::uPnPHandler::_onGatewayEvent(GatewayEvent event) {
+    switch (event) {
+        case GatewayEvent::Left:
+            _gatewayLeft = true;
+            {
+                std::lock_guard<std::mutex> lock(_watchMutex);
+                _invalidatePending = true;
+            }
+            _watchCV.notify_all();
+            return;
+
+        case GatewayEvent::Appeared:
+            // first announcement of the gateway we already use
+            if(!_gatewayLeft) return;
+            NWC_LOG_INFO("UPNP Watch : gateway is back, remapping...");
+            break;
+
+        case GatewayEvent::Rebooted:
+            NWC_LOG_INFO("UPNP Watch : gateway rebooted, remapping...");
+            _wanLink.resetCounters();
+            break;
+
+        case GatewayEvent::ConfigChanged:
+            NWC_LOG_INFO("UPNP Watch : gateway configuration changed, remapping...");
+            break;
+    }
+
+    _gatewayLeft = false;
+    {
+        std::lock_guard<std::mutex> lock(_watchMutex);
+        _remapPending = true;
+    }
+    _watchCV.notify_all();
+}
+
+// events arriving meanwhile are merged into the next round
+void NetworkCandy::uPnPHandler::_watchWork() {
+    std::unique_lock<std::mutex> lock(_watchMutex);
+    while (true) {
+        _watchCV.wait(lock, [this]() { return !_isWatching || _invalidatePending || _remapPending; });
+        if (!_isWatching) return;
+
+        auto remap = _remapPending;
+        _invalidatePending = false;
+        _remapPending = false;
+        lock.unlock();
+
+        invalidateGateway();
+        if (remap) ensurePortMapping();
+
+        lock.lock();
+    }
 }
 
 NetworkCandy::uPnPHandler::~uPnPHandler() {
+    // listener may remap concurrently
+    stopWatchingGateway();
+    stopReachabilityChecks();
+    if (_stunThread.joinable()) _stunThread.join();
+
     /*free*/
     if(_IGDFound) FreeUPNPUrls(&_urls);
-    if(_devicesList) freeUPNPDevlist(_devicesList);
+    _freeDiscoveries();
 
     /*End websock*/
     #ifdef _WIN32
@@ -115,83 +579,314 @@ NetworkCandy::uPnPHandler::~uPnPHandler() {
     #endif
 
     //
-    if(_impl) delete _impl;
+    _deleteIGDImplementations();
 }
 
 const std::string NetworkCandy::uPnPHandler::externalIP() const {
-    return _externalIPAddress;
+    std::lock_guard<std::mutex> lock(_addressMutex);
+    if (std::strcmp(_externalIPAddress, "unset") != 0) return _externalIPAddress;
+    return _stunExternalIP.empty() ? _externalIPAddress : _stunExternalIP;
 }
 
 const std::string NetworkCandy::uPnPHandler::localIP() const {
     return _localIPAddress;
 }
 
+const std::string NetworkCandy::uPnPHandler::localIP(AddressFamily family) const {
+    return family == AddressFamily::IPv4 ? _localIPv4 : _localIPv6;
+}
+
+void NetworkCandy::uPnPHandler::pinInterfaces(const std::vector<std::string>& ifNames) {
+    _pinnedInterfaces = ifNames;
+}
+
+void NetworkCandy::uPnPHandler::excludeInterfaces(const std::vector<std::string>& ifNames) {
+    _excludedInterfaces = ifNames;
+}
+
+const std::string NetworkCandy::uPnPHandler::gatewayInterface() const {
+    return _gatewayInterface.name;
+}
+
+NetworkCandy::WANLinkSampler& NetworkCandy::uPnPHandler::wanLinkSampler() {
+    return _wanLink;
+}
+
+std::shared_ptr<NetworkCandy::SOAPScheduler> NetworkCandy::uPnPHandler::soapScheduler() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _scheduler;
+}
+
+void NetworkCandy::uPnPHandler::setGatewayDescriptionURL(const std::string& rootDescURL) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _invalidateGateway();
+    _gatewayDescriptionURL = rootDescURL;
+}
+
+void NetworkCandy::uPnPHandler::setStunServers(const std::vector<std::string>& servers) {
+    std::lock_guard<std::mutex> lock(_addressMutex);
+    _stunServers = servers;
+}
+
+void NetworkCandy::uPnPHandler::setExternalAddressCallback(const std::function<void(const std::string&, ExternalAddressSource)>& callback) {
+    std::lock_guard<std::mutex> lock(_addressMutex);
+    _externalAddressCallback = callback;
+}
+
+NetworkCandy::NATTopology NetworkCandy::uPnPHandler::natTopology() const {
+    std::lock_guard<std::mutex> lock(_addressMutex);
+    return _natTopology;
+}
+
+void NetworkCandy::uPnPHandler::_announceExternalAddress(const std::string& address, ExternalAddressSource source) {
+    std::function<void(const std::string&, ExternalAddressSource)> callback;
+    {
+        std::lock_guard<std::mutex> lock(_addressMutex);
+        if (_externalAddressAnnounced) return;
+        _externalAddressAnnounced = true;
+        if (source == ExternalAddressSource::Stun) _stunExternalIP = address;
+        callback = _externalAddressCallback;
+    }
+
+    NWC_LOG_INFO("UPNP Inst : external address {} first known from {}", address, source == ExternalAddressSource::Stun ? "STUN" : "UPnP");
+    if (callback) callback(address, source);
+}
+
+NetworkCandy::ReachabilityResult NetworkCandy::uPnPHandler::checkReachability(std::chrono::milliseconds timeout) {
+    std::string externalIP, localIP, reflector;
+    GatewayIdentity identity;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_hasRedirectV4) {
+            NWC_LOG_INFO("UPNP Reach : no IPv4 mapping to check.");
+            return {};
+        }
+        externalIP = this->externalIP();
+        localIP = _localIPv4;
+        identity = _gatewayIdentity;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_reachMutex);
+        reflector = _reflector;
+    }
+
+    // probing takes a while, do not hold the gateway meanwhile
+    auto port = static_cast<unsigned short>(std::atoi(_targetPort.c_str()));
+    ReachabilityProbe probe(localIP, port);
+    probe.setReflector(reflector);
+    auto result = probe.run(externalIP, port, timeout);
+
+    // a failed hairpin may only mean the gateway does not loop back, it says nothing about outside connections
+    GatewayProfiles::shared().update(identity, [&result](GatewayProfile& profile) {
+        auto &learnt = profile.ipv4;
+        if (result.path == ReachabilityPath::Hairpin) {
+            learnt.hairpin = result.isReachable ? Support::Works : Support::Fails;
+        } else if (!result.isReachable) {
+            learnt.reachable = Support::Fails;
+        }
+        if (result.isReachable) {
+            learnt.reachable = Support::Works;
+            learnt.reachLatencyMs = learnt.reachLatencyMs > 0
+                ? learnt.reachLatencyMs * 0.8 + result.latencyMs * 0.2
+                : result.latencyMs;
+        }
+    });
+    GatewayProfiles::shared().flush();
+
+    std::lock_guard<std::mutex> lock(_reachMutex);
+    _lastReachability = result;
+    return result;
+}
+
+NetworkCandy::ReachabilityResult NetworkCandy::uPnPHandler::lastReachability() const {
+    std::lock_guard<std::mutex> lock(_reachMutex);
+    return _lastReachability;
+}
+
+void NetworkCandy::uPnPHandler::setReflector(const std::string& hostAndPort) {
+    std::lock_guard<std::mutex> lock(_reachMutex);
+    _reflector = hostAndPort;
+}
+
+void NetworkCandy::uPnPHandler::scheduleReachabilityChecks(std::chrono::milliseconds interval) {
+    if (_reachChecking.exchange(true)) return;
+
+    NWC_LOG_INFO("UPNP Reach : checking reachability every {}ms...", interval.count());
+
+    _reachThread = std::thread([this, interval]() {
+        std::unique_lock<std::mutex> lock(_reachStopMutex);
+        while (_reachChecking) {
+            lock.unlock();
+            if (hasPortMapping(AddressFamily::IPv4)) checkReachability();
+            lock.lock();
+            _reachStopCV.wait_for(lock, interval, [this]() { return !_reachChecking; });
+        }
+    });
+}
+
+void NetworkCandy::uPnPHandler::stopReachabilityChecks() {
+    {
+        std::lock_guard<std::mutex> lock(_reachStopMutex);
+        if (!_reachChecking.exchange(false)) return;
+    }
+    _reachStopCV.notify_all();
+    if (_reachThread.joinable()) _reachThread.join();
+}
+
 const std::string& NetworkCandy::uPnPHandler::portToMap() const {
     return _targetPort;
 }
 
-int NetworkCandy::uPnPHandler::_discoverDevicesIPv4() {
-    return _discoverDevices(false, "with IPv4");
+int NetworkCandy::uPnPHandler::_discoverDevicesIPv4(std::chrono::milliseconds delay) {
+    return _discoverDevices(false, "with IPv4", delay);
 }
 
-int NetworkCandy::uPnPHandler::_discoverDevicesIPv6() {
-    return _discoverDevices(true, "with IPv6");
+int NetworkCandy::uPnPHandler::_discoverDevicesIPv6(std::chrono::milliseconds delay) {
+    return _discoverDevices(true, "with IPv6", delay);
 }
 
 bool NetworkCandy::uPnPHandler::_isIGDv2(const char * serviceType) {
     return strcmp(serviceType, "urn:schemas-upnp-org:device:InternetGatewayDevice:2") == 0;
 }
 
+std::vector<NetworkCandy::NetworkInterface> NetworkCandy::uPnPHandler::_candidateInterfaces(bool useIpV6) const {
+    auto interfaces = listMulticastInterfaces();
+
+    auto isListed = [](const std::vector<std::string>& list, const std::string& name) {
+        return std::find(list.begin(), list.end(), name) != list.end();
+    };
+
+    interfaces.erase(std::remove_if(interfaces.begin(), interfaces.end(), [&](const NetworkInterface& iface) {
+        if (useIpV6 ? iface.ipv6.empty() : iface.ipv4.empty()) return true;
+        if (!_pinnedInterfaces.empty() && !isListed(_pinnedInterfaces, iface.name)) return true;
+        return isListed(_excludedInterfaces, iface.name);
+    }), interfaces.end());
+
+    return interfaces;
+}
+
+void NetworkCandy::uPnPHandler::_freeDiscoveries() {
+    for (auto &discovery : _discoveries) {
+        if(discovery.devices) freeUPNPDevlist(discovery.devices);
+    }
+    _discoveries.clear();
+}
+
 // returns error code if any
-int NetworkCandy::uPnPHandler::_discoverDevices(bool useIpV6, const char * protocolDescr) {
+int NetworkCandy::uPnPHandler::_discoverDevices(bool useIpV6, const char * protocolDescr, std::chrono::milliseconds delay) {
     // not used
-    char* _multicastif = nullptr;
     char* _minissdpdpath = nullptr;
 
-    // discover
-    spdlog::info("UPNP Inst : starting discovery {}...", protocolDescr);
-    int error;
-    _devicesList = upnpDiscover(
-        _DISCOVER_DELAY_MS,
-        _multicastif,
-        _minissdpdpath,
-        _LOCALPORT,
-        useIpV6,
-        _TTL,
-        &error
-    );
-
-    // if error
-    if(error) {
-        spdlog::warn("UPNP Inst : upnpDiscover() {} error code= {}", protocolDescr, error);
-        return error;
-    }
-
-    // if not devices found, most probably a timeout
-    if(!_devicesList) {
-        spdlog::warn("UPNP Inst : upnpDiscover() {} has most probably timed out, no devices found !", protocolDescr);
-        return -998;
+    //
+    _freeDiscoveries();
+    _discoveredWithIpV6 = useIpV6;
+
+    // one M-SEARCH per interface
+    auto interfaces = _candidateInterfaces(useIpV6);
+    if(interfaces.empty() && !_pinnedInterfaces.empty()) {
+        NWC_LOG_WARN("UPNP Inst : none of the pinned interfaces can discover {}, not searching elsewhere", protocolDescr);
+        return UPNPDISCOVER_SOCKET_ERROR;
+    }
+    if(interfaces.empty()) {
+        NWC_LOG_INFO("UPNP Inst : no suitable interface to discover {}, letting the OS pick one...", protocolDescr);
+        interfaces.emplace_back();
+    }
+
+    // discover, all interfaces in parallel
+    NWC_LOG_INFO("UPNP Inst : starting discovery {} on {} interface(s)...", protocolDescr, interfaces.size());
+    auto discoveryStart = std::chrono::steady_clock::now();
+    std::vector<std::future<InterfaceDiscovery>> pending;
+    for (auto &iface : interfaces) {
+        pending.push_back(std::async(std::launch::async, [iface, useIpV6, _minissdpdpath, delay, discoveryStart]() {
+            InterfaceDiscovery discovery;
+            discovery.networkInterface = iface;
+
+            // our own search, TVs, printers and media servers answering anyway being dropped as they come
+            if(!useIpV6) {
+                SSDPSearch search;
+                if(!search.start(iface.ipv4, delay)) {
+                    discovery.error = UPNPDISCOVER_SOCKET_ERROR;
+                    return discovery;
+                }
+                search.wait();
+                _traceResponses(search.table(), discoveryStart);
+                discovery.devices = _toDeviceList(search.table());
+                return discovery;
+            }
+
+            // miniupnpc selects IPv6 multicast interfaces by name
+            const char * multicastif = iface.name.empty() ? nullptr : iface.name.c_str();
+
+            auto devices = upnpDiscover(
+                static_cast<int>(delay.count()),
+                multicastif,
+                _minissdpdpath,
+                _LOCALPORT,
+                useIpV6,
+                _TTL,
+                &discovery.error
+            );
+
+            // same filtering and root devices fallback, after the fact
+            SSDPDeviceTable candidates;
+            SSDPDeviceTable rootDevices(32, 8 * 1024, isRootDeviceTarget);
+            for (auto device = devices; device; device = device->pNext) {
+                auto &table = isRootDeviceTarget(device->st) ? rootDevices : candidates;
+                table.insert(device->usn, device->st, device->descURL, std::string_view(), device->scope_id);
+            }
+            freeUPNPDevlist(devices);
+            auto &found = candidates.empty() ? rootDevices : candidates;
+            _traceResponses(found, discoveryStart);
+            discovery.devices = _toDeviceList(found);
+
+            return discovery;
+        }));
     }
 
+    for (auto &future : pending) {
+        _discoveries.push_back(future.get());
+    }
+
+    int lastError = 0;
+    bool hasDevices = false;
     bool hasIGDv2 = false;
 
     // iterate through devices discovered
-    UPNPDev* device;
-    spdlog::info("UPNP Inst : List of {} UPNP devices found on the network :", protocolDescr);
-    for (device = _devicesList; device; device = device->pNext) {
-        // log each
-        spdlog::info("UPNP Inst : -> desc: {} st: {}", device->descURL, device->st);
-        
-        // if IPv6 search, check if this device is v2 compatible
-        if(useIpV6 && !hasIGDv2 && _isIGDv2(device->st)) {
-            hasIGDv2 = true;
+    NWC_LOG_INFO("UPNP Inst : List of {} IGD candidates found on the network :", protocolDescr);
+    for (auto &discovery : _discoveries) {
+        auto &ifName = discovery.networkInterface.name;
+
+        // if error
+        if(discovery.error) {
+            NWC_LOG_WARN("UPNP Inst : [{}] discovery {} error code= {}", ifName, protocolDescr, discovery.error);
+            lastError = discovery.error;
+            continue;
+        }
+
+        for (auto device = discovery.devices; device; device = device->pNext) {
+            // log each
+            NWC_LOG_DEBUG("UPNP Inst : [{}] -> desc: {} st: {}", ifName, device->descURL, device->st);
+            hasDevices = true;
+
+            // if IPv6 search, check if this device is v2 compatible
+            if(useIpV6 && !hasIGDv2 && _isIGDv2(device->st)) {
+                hasIGDv2 = true;
+            }
         }
     }
 
+    // if not devices found, either errors or most probably a timeout
+    if(!hasDevices) {
+        _freeDiscoveries();
+        if(lastError) return lastError;
+        NWC_LOG_WARN("UPNP Inst : discovery {} has most probably timed out, no devices found !", protocolDescr);
+        return -998;
+    }
+
     // if using IPv6 but has no IGDv2 device, error !
     if(useIpV6 && !hasIGDv2) {
-        spdlog::warn("UPNP Inst : upnpDiscover() did not find an appropriate IGDv2 device compatible with IPv6");
-        freeUPNPDevlist(_devicesList);
+        NWC_LOG_WARN("UPNP Inst : upnpDiscover() did not find an appropriate IGDv2 device compatible with IPv6");
+        _freeDiscoveries();
         return -996;
     }
 
@@ -199,64 +894,180 @@ int NetworkCandy::uPnPHandler::_discoverDevices(bool useIpV6, const char * proto
     return 0;
 }
 
-// returns if succeeded
-bool NetworkCandy::uPnPHandler::_getExternalIP() {
-    // request
-    int r = UPNP_GetExternalIPAddress(
-        _urls.controlURL,
-        _IGDData.first.servicetype,
-        _externalIPAddress
-    );
+// returns error code if any
+int NetworkCandy::uPnPHandler::_getExternalIP(RetryPolicy::Clock::time_point deadline) {
+    // request, answered once for every handler asking at the same time
+    TraceArguments outputs;
+    auto key = std::string(_urls.controlURL) + '|' + _IGDData.first.servicetype + "#GetExternalIPAddress";
+    int r = _scheduler->run(SOAPPriority::Check, key, [this](TraceArguments& out) {
+        char externalIP[sizeof(_externalIPAddress)] = "";
+        auto start = std::chrono::steady_clock::now();
+        int r = UPNP_GetExternalIPAddress(
+            _urls.controlURL,
+            _IGDData.first.servicetype,
+            externalIP
+        );
+        if (r == UPNPCOMMAND_SUCCESS) out = { {"NewExternalIPAddress", externalIP} };
+        TraceRecorder::recordSOAP(_urls.controlURL, _IGDData.first.servicetype, "GetExternalIPAddress", {}, r, out, start);
+        return r;
+    }, &outputs, deadline);
+    // the gateway telling it has none (WAN down...) makes what we knew stale; no answer tells nothing
+    auto address = r == UPNPCOMMAND_SUCCESS && !outputs.empty() ? outputs.front().second : std::string();
+    auto isKnown = !address.empty() && address != "0.0.0.0";
+    {
+        std::lock_guard<std::mutex> lock(_addressMutex);
+        if (isKnown) {
+            std::strncpy(_externalIPAddress, address.c_str(), sizeof(_externalIPAddress) - 1);
+        } else if (r >= 0) {
+            std::strcpy(_externalIPAddress, "unset");
+        }
+        _isExternalIPFresh = isKnown;
+    }
 
     // if failed
     if (r != UPNPCOMMAND_SUCCESS) {
-        spdlog::warn("UPNP GetExternalIPAddress : Cannot fetch external IP !");
-        return false;
+        NWC_LOG_WARN("UPNP GetExternalIPAddress : Cannot fetch external IP !");
+        return r;
+    }
+    if (!isKnown) {
+        NWC_LOG_WARN("UPNP GetExternalIPAddress : IGD has no external IP yet ({}) !", address);
+        return 0;
     }
 
     // succeeded !
-    spdlog::info("UPNP GetExternalIPAddress : ext. IP address = {}", _externalIPAddress);
-    return true;
+    NWC_LOG_INFO("UPNP GetExternalIPAddress : ext. IP address = {}", _externalIPAddress);
+    return 0;
 }
 
 // returns if succeeded
-bool NetworkCandy::uPnPHandler::_getValidIGD() {
-    // request
-    spdlog::info("UPNP Inst : Fetching UPNP Internet Gateway Devices...");
-    auto result = UPNP_GetValidIGD(
-        _devicesList, 
-        &_urls, 
-        &_IGDData, 
-        _localIPAddress, 
-        sizeof(_localIPAddress)
-    );
+bool NetworkCandy::uPnPHandler::_getValidIGD(std::chrono::milliseconds timeout) {
+    // previous run
+    if(_IGDFound) {
+        _deleteIGDImplementations();
+        FreeUPNPUrls(&_urls);
+        _IGDFound = false;
+    }
+
+    // request, per device; the lower the result, the better the IGD
+    NWC_LOG_INFO("UPNP Inst : Fetching UPNP Internet Gateway Devices...");
+    int result = 0;
+    std::string description;
+    auto fetchedAt = std::chrono::steady_clock::now();
+    auto giveUpAt = fetchedAt + timeout;
+    auto remaining = [&giveUpAt]() {
+        return std::max(std::chrono::milliseconds(0),
+                        std::chrono::duration_cast<std::chrono::milliseconds>(giveUpAt - std::chrono::steady_clock::now()));
+    };
+
+    // known description, no discovery involved
+    if(!_gatewayDescriptionURL.empty()) {
+        _gatewayInterface = NetworkInterface();
+        result = _rateDevice(
+            _gatewayDescriptionURL.c_str(),
+            0,
+            false,
+            &_urls,
+            &_IGDData,
+            _localIPAddress,
+            sizeof(_localIPAddress),
+            &description,
+            remaining()
+        );
+    }
+
+    for (auto &discovery : _discoveries) {
+        for (auto device = discovery.devices; device && result != 1; device = device->pNext) {
+            UPNPUrls urls;
+            IGDdatas data;
+            char lanAddress[sizeof(_localIPAddress)] = "unset";
+            std::string xml;
+            auto start = std::chrono::steady_clock::now();
+            auto found = _rateDevice(device->descURL, device->scope_id, true, &urls, &data, lanAddress, sizeof(lanAddress), &xml, remaining());
+            if(!found) continue;
+
+            // not better than the one we have
+            if(result && found >= result) {
+                FreeUPNPUrls(&urls);
+                continue;
+            }
+
+            if(result) FreeUPNPUrls(&_urls);
+            result = found;
+            _urls = urls;
+            _IGDData = data;
+            _gatewayInterface = discovery.networkInterface;
+            std::memcpy(_localIPAddress, lanAddress, sizeof(_localIPAddress));
+            description = std::move(xml);
+            fetchedAt = start;
+        }
+
+        // connected IGD, cannot do better
+        if(result == 1) break;
+    }
+
+    // candidates are of no use once one is picked, validation may be retried otherwise
+    if(result) _freeDiscoveries();
 
     // handle returns
     switch (result) {
         case 0: {
-            spdlog::warn("UPNP Inst : No valid UPNP Internet Gateway Device found.");
+            NWC_LOG_WARN("UPNP Inst : No valid UPNP Internet Gateway Device found.");
             return false;
         }
         break;
         case 1:
-            spdlog::info("UPNP Inst : Found valid IGD : {}", _urls.controlURL);
+            NWC_LOG_INFO("UPNP Inst : Found valid IGD : {}", _urls.controlURL);
             break;
         case 2:
-            spdlog::info("UPNP Inst : Found a (not connected?) IGD : {}", _urls.controlURL);
-            spdlog::info("UPNP Inst : Trying to continue anyway");
+            NWC_LOG_INFO("UPNP Inst : Found a (not connected?) IGD : {}", _urls.controlURL);
+            NWC_LOG_INFO("UPNP Inst : Trying to continue anyway");
             break;
         case 3:
-            spdlog::info("UPNP Inst : UPnP device found. Is it an IGD ? : {}", _urls.controlURL);
-            spdlog::info("UPNP Inst : Trying to continue anyway");
+            NWC_LOG_INFO("UPNP Inst : UPnP device found. Is it an IGD ? : {}", _urls.controlURL);
+            NWC_LOG_INFO("UPNP Inst : Trying to continue anyway");
             break;
         default:
-            spdlog::info("UPNP Inst : Found device (igd ?) : {}", _urls.controlURL);
-            spdlog::info("UPNP Inst : Trying to continue anyway");
+            NWC_LOG_INFO("UPNP Inst : Found device (igd ?) : {}", _urls.controlURL);
+            NWC_LOG_INFO("UPNP Inst : Trying to continue anyway");
             break;
     }
 
+    // map to the addresses of the interface the IGD was found on
+    _localIPv4 = _gatewayInterface.ipv4;
+    _localIPv6 = _gatewayInterface.ipv6;
+    auto &sameFamilyIP = _discoveredWithIpV6 ? _localIPv6 : _localIPv4;
+    if(sameFamilyIP.empty()) {
+        sameFamilyIP = _localIPAddress;
+    } else {
+        std::strncpy(_localIPAddress, sameFamilyIP.c_str(), sizeof(_localIPAddress) - 1);
+    }
+
     //
-    spdlog::info("UPNP Inst : Local LAN ip address {}", _localIPAddress);
+    NWC_LOG_INFO("UPNP Inst : Local LAN ip address {} (on interface {})", _localIPAddress, _gatewayInterface.name);
+
+    // the description in use, as fetched
+    TraceRecorder::recordDescription(_urls.rootdescURL, description, fetchedAt);
+
+    // what worked with this model before
+    _gatewayIdentity = GatewayIdentity();
+    if(!parseGatewayIdentity(description, &_gatewayIdentity)) {
+        // unidentified, at least remember this very device
+        _gatewayIdentity.model = _urls.rootdescURL;
+    }
+    _profile = GatewayProfiles::shared().find(_gatewayIdentity);
+    GatewayProfiles::shared().update(_gatewayIdentity, [](GatewayProfile& profile) {
+        profile.sessions++;
+    });
+    NWC_LOG_INFO("UPNP Inst : Gateway profile [{}]", _gatewayIdentity.key());
+
+    // WAN counters, when exposed
+    if(_urls.controlURL_CIF && _IGDData.CIF.servicetype[0] != '\0') {
+        _wanLink.setService(_urls.controlURL_CIF, _IGDData.CIF.servicetype);
+        _wanLink.setConnectionService(_urls.controlURL, _IGDData.first.servicetype);
+    }
+
+    // paced along with every other handler talking to it
+    _scheduler = SOAPScheduler::forGateway(_urls.controlURL);
 
     // succeeded !
     _IGDFound = true;
@@ -269,31 +1080,130 @@ bool NetworkCandy::uPnPHandler::_initUPnP() {
     #ifdef _WIN32
         auto nResult = WSAStartup(_requestedVersion, &_wsaData);
         if (nResult != NO_ERROR) {
-            spdlog::warn("UPNP Inst : Cannot init socket with WSAStartup !");
+            NWC_LOG_WARN("UPNP Inst : Cannot init socket with WSAStartup !");
             return false;
         }
     #endif
 
-    /* discover devices from IPv4 */
-    if (_discoverDevicesIPv6() != 0) {
-        /* discover devices IPv6 */
-        if(_discoverDevicesIPv4() != 0) {
-            // fails !
-            spdlog::warn("UPNP Inst : No IGD UPnP Device found on the network !");
+    // STUN raced against discovery, unless already answered for this gateway or still running
+    std::vector<std::string> stunServers;
+    {
+        std::lock_guard<std::mutex> lock(_addressMutex);
+        _externalAddressAnnounced = false;
+        _isExternalIPFresh = false;
+        _isUPnPPending = true;
+        if ((!_IGDFound || _stunExternalIP.empty()) && !_isStunRunning) stunServers = _stunServers;
+        if (!stunServers.empty()) _isStunRunning = _isTopologyPending = true;
+    }
+    if (!stunServers.empty()) {
+        // over already, as not running
+        if (_stunThread.joinable()) _stunThread.join();
+
+        _stunThread = std::thread([this, stunServers]() {
+            StunClient client;
+            auto result = client.start(stunServers) ? client.wait() : StunResult();
+            if (result.succeeded) _announceExternalAddress(result.address, ExternalAddressSource::Stun);
+
+            std::lock_guard<std::mutex> lock(_addressMutex);
+            if (result.succeeded) _stunExternalIP = result.address;
+            _isStunRunning = false;
+            _classifyNAT();
+        });
+    }
+
+    auto succeeded = _initIGD();
+
+    // only what the gateway just answered
+    std::string address;
+    {
+        std::lock_guard<std::mutex> lock(_addressMutex);
+        _isUPnPPending = false;
+        if (_isExternalIPFresh) address = _externalIPAddress;
+        _classifyNAT();
+    }
+    if (!address.empty()) _announceExternalAddress(address, ExternalAddressSource::UPnP);
+
+    return succeeded;
+}
+
+// cross-checks both views, once both known
+void NetworkCandy::uPnPHandler::_classifyNAT() {
+    if (!_isTopologyPending || _isUPnPPending || _isStunRunning) return;
+    _isTopologyPending = false;
+
+    std::string gatewayView = _isExternalIPFresh ? _externalIPAddress : "";
+    _natTopology = classifyNAT(_localIPv4, gatewayView, _stunExternalIP);
+
+    if (_natTopology == NATTopology::Double) {
+        NWC_LOG_WARN("UPNP Inst : IGD reports {} but STUN sees {}, another NAT stands behind it; mappings will not make us reachable !",
+            gatewayView, _stunExternalIP);
+    } else if (_natTopology == NATTopology::CarrierGrade) {
+        NWC_LOG_WARN("UPNP Inst : IGD WAN address {} is carrier-grade NAT; mappings will not make us reachable !", gatewayView);
+    }
+}
+
+// returns if succeeded
+bool NetworkCandy::uPnPHandler::_initIGD() {
+    // returns error code if any
+    auto validateIGD = [this]() {
+        return _policy.run(GatewayOperation::Validation, _deadline, [this](std::chrono::milliseconds timeout) {
+            return _getValidIGD(timeout) ? 0 : -1;
+        });
+    };
+
+    /* gateway still valid, no need to discover again */
+    if(_IGDFound) {
+        NWC_LOG_INFO("UPNP Inst : Reusing known IGD : {}", _urls.controlURL);
+    } else if(!_gatewayDescriptionURL.empty()) {
+        /* description given, straight to the IGD */
+        if(validateIGD() != 0) {
             return false;
         }
-    }
+    } else {
+        /* discover devices from IPv6, a single probe as most gateways have no IGDv2 */
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(_deadline - RetryPolicy::Clock::now());
+        auto probe = std::min(_policy.attemptTimeout(GatewayOperation::Discovery, 0), remaining);
+        if (probe.count() <= 0 || _discoverDevicesIPv6(probe) != 0) {
+            /* discover devices IPv4 */
+            auto discovered = _policy.run(GatewayOperation::Discovery, _deadline, [this](std::chrono::milliseconds delay) {
+                return _discoverDevicesIPv4(delay);
+            });
+            if(discovered != 0) {
+                // fails !
+                NWC_LOG_WARN("UPNP Inst : No IGD UPnP Device found on the network !");
+                return false;
+            }
+        }
 
-    /* get IGD */
-    if(!_getValidIGD()) {
-        return false;
+        /* get IGD */
+        if(validateIGD() != 0) {
+            return false;
+        }
     }
 
     /* get external IP */
-    if(!_getExternalIP()) {
+    auto externalIP = _policy.run(GatewayOperation::Check, _deadline, [this](std::chrono::milliseconds timeout) {
+        return _getExternalIP(_attemptDeadline(timeout));
+    });
+    // turned down by our own scheduler, too many requests queued : nothing wrong with the gateway
+    if(externalIP == SOAPScheduler::QUEUE_FULL || externalIP == SOAPScheduler::QUEUE_TIMEOUT) {
+        NWC_LOG_WARN("UPNP Inst : GetExternalIPAddress not sent ({}), gateway busy, mapping anyway.", externalIP);
+        return true;
+    }
+
+    // no answer, or a broken one
+    if(externalIP == UPNPCOMMAND_HTTP_ERROR || externalIP == UPNPCOMMAND_INVALID_RESPONSE) {
+        // gateway may be gone, rediscover next time
+        _invalidateGateway();
         return false;
     }
 
+    // answered with an error, still usable to map; STUN may know the address
+    if(externalIP != 0) {
+        NWC_LOG_WARN("UPNP Inst : IGD answered GetExternalIPAddress with {}, mapping anyway.", externalIP);
+        return true;
+    }
+
     // succeeded !
     return true;
 }
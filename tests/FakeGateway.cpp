@@ -0,0 +1,537 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include "FakeGateway.h"
+#include "Sockets.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+using namespace NetworkCandy;
+
+namespace {
+
+const char * _DEFAULT_DESCRIPTION =
+    "<?xml version=\"1.0\"?>"
+    "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+    "<specVersion><major>1</major><minor>0</minor></specVersion>"
+    "<device>"
+    "<deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>"
+    "<manufacturer>NetworkCandy</manufacturer><modelName>FakeGateway</modelName><modelNumber>1</modelNumber>"
+    "<deviceList><device>"
+    "<deviceType>urn:schemas-upnp-org:device:WANDevice:1</deviceType>"
+    "<serviceList><service>"
+    "<serviceType>urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1</serviceType>"
+    "<serviceId>urn:upnp-org:serviceId:WANCommonIFC1</serviceId>"
+    "<controlURL>/ctl/CmnIfCfg</controlURL><eventSubURL>/evt/CmnIfCfg</eventSubURL><SCPDURL>/WANCfg.xml</SCPDURL>"
+    "</service></serviceList>"
+    "<deviceList><device>"
+    "<deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:1</deviceType>"
+    "<serviceList><service>"
+    "<serviceType>urn:schemas-upnp-org:service:WANIPConnection:1</serviceType>"
+    "<serviceId>urn:upnp-org:serviceId:WANIPConn1</serviceId>"
+    "<controlURL>/ctl/IPConn</controlURL><eventSubURL>/evt/IPConn</eventSubURL><SCPDURL>/WANIPCn.xml</SCPDURL>"
+    "</service></serviceList>"
+    "</device></deviceList>"
+    "</device></deviceList>"
+    "</device>"
+    "</root>";
+
+// what a plain, well-behaved gateway answers
+FakeGateway::Reply _defaultReply(const std::string& action) {
+    FakeGateway::Reply reply;
+    if (action == "GetExternalIPAddress") {
+        reply.outputs = { {"NewExternalIPAddress", "203.0.113.7"} };
+    } else if (action == "GetSpecificPortMappingEntry") {
+        reply.resultCode = 714;  // NoSuchEntryInArray
+    } else if (action == "GetStatusInfo") {
+        reply.outputs = { {"NewConnectionStatus", "Connected"}, {"NewLastConnectionError", "ERROR_NONE"}, {"NewUptime", "1"} };
+    } else if (action.rfind("GetTotal", 0) == 0) {
+        reply.outputs = { {"New" + action.substr(3), "0"} };
+    } else if (action == "GetCommonLinkProperties") {
+        reply.outputs = { {"NewWANAccessType", "Ethernet"}, {"NewLayer1UpstreamMaxBitRate", "100000000"},
+                          {"NewLayer1DownstreamMaxBitRate", "100000000"}, {"NewPhysicalLinkStatus", "Up"} };
+    } else if (action == "GetFirewallStatus") {
+        reply.outputs = { {"FirewallEnabled", "1"}, {"InboundPinholeAllowed", "1"} };
+    } else if (action == "AddPinhole") {
+        reply.outputs = { {"UniqueID", "1"} };
+    } else if (action != "AddPortMapping" && action != "DeletePortMapping" && action != "DeletePinhole") {
+        reply.resultCode = 401;  // InvalidAction
+    }
+    return reply;
+}
+
+// "host:port" of an absolute URL
+std::string _hostOf(const std::string& url) {
+    auto begin = url.find("://");
+    if (begin == std::string::npos) return std::string();
+    begin += 3;
+    return url.substr(begin, url.find('/', begin) - begin);
+}
+
+std::string _headerValue(const std::string& headers, const std::string& name) {
+    auto at = headers.find(name + ":");
+    if (at == std::string::npos) return std::string();
+    at += name.size() + 1;
+    auto end = headers.find("\r\n", at);
+    auto value = headers.substr(at, end - at);
+    auto begin = value.find_first_not_of(" \t\"");
+    auto last = value.find_last_not_of(" \t\"");
+    if (begin == std::string::npos) return std::string();
+    return value.substr(begin, last - begin + 1);
+}
+
+void _sendAll(Sockets::socket_t socket, const std::string& data) {
+    std::size_t sent = 0;
+    while (sent < data.size()) {
+        auto r = send(socket, data.data() + sent, (int)(data.size() - sent), 0);
+        if (r <= 0) return;
+        sent += r;
+    }
+}
+
+// value of a SOAP argument, "<name>value</name>"
+std::string _argument(const std::string& body, const std::string& name) {
+    auto begin = body.find("<" + name + ">");
+    if (begin == std::string::npos) return std::string();
+    begin += name.size() + 2;
+    return body.substr(begin, body.find("</" + name + ">", begin) - begin);
+}
+
+// pipes both ways until either side closes or running turns false
+void _relay(Sockets::socket_t a, Sockets::socket_t b, const std::atomic<bool>& running) {
+    char buffer[4096];
+    while (running) {
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET(a, &set);
+        FD_SET(b, &set);
+        timeval timeout { 0, 100000 };
+        auto ready = select((int)std::max(a, b) + 1, &set, NULL, NULL, &timeout);
+        if (ready < 0) break;
+        if (ready == 0) continue;
+
+        auto from = FD_ISSET(a, &set) ? a : b;
+        auto to = from == a ? b : a;
+        auto received = recv(from, buffer, sizeof(buffer), 0);
+        if (received <= 0) break;
+        _sendAll(to, std::string(buffer, received));
+    }
+    Sockets::close(a);
+    Sockets::close(b);
+}
+
+std::string _httpResponse(const char * status, const std::string& body) {
+    return std::string("HTTP/1.1 ") + status + "\r\n"
+        "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n"
+        "\r\n" + body;
+}
+
+std::string _soapEnvelope(const std::string& body) {
+    return "<?xml version=\"1.0\"?>"
+        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+        "<s:Body>" + body + "</s:Body>"
+        "</s:Envelope>";
+}
+
+}  // namespace
+
+FakeGateway::FakeGateway() : _description(_DEFAULT_DESCRIPTION) {}
+
+FakeGateway::~FakeGateway() {
+    stop();
+}
+
+bool FakeGateway::start() {
+    if (_running) return true;
+    if (!Sockets::init()) return false;
+
+    auto socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket == Sockets::INVALID) return false;
+
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    socklen_t length = sizeof(address);
+    if (bind(socket, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(socket, 16) != 0 ||
+        getsockname(socket, (sockaddr*)&address, &length) != 0) {
+        Sockets::close(socket);
+        return false;
+    }
+
+    _port = ntohs(address.sin_port);
+    _listenSocket = Sockets::toHandle(socket);
+    _running = true;
+    _thread = std::thread(&FakeGateway::_serve, this);
+    return true;
+}
+
+void FakeGateway::stop() {
+    if (!_running.exchange(false)) return;
+    if (_thread.joinable()) _thread.join();
+
+    Sockets::close(Sockets::fromHandle(_listenSocket));
+    _listenSocket = -1;
+
+    for (auto &client : _clients) {
+        if (client.joinable()) client.join();
+    }
+    _clients.clear();
+
+    std::vector<unsigned short> ports;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto &forwarded : _forwarded) ports.push_back(forwarded.first);
+    }
+    for (auto port : ports) _unforward(port);
+}
+
+unsigned short FakeGateway::port() const {
+    return _port;
+}
+
+std::string FakeGateway::descriptionURL() const {
+    return "http://127.0.0.1:" + std::to_string(_port) + "/rootDesc.xml";
+}
+
+void FakeGateway::load(const Trace& trace) {
+    for (auto &event : trace.events) {
+        switch (event.kind) {
+            case TraceEvent::Kind::Description: {
+                // URLBase and absolute control URLs must point to us now
+                auto body = event.body;
+                auto host = _hostOf(event.url);
+                auto ours = "127.0.0.1:" + std::to_string(_port);
+                for (auto at = body.find(host); !host.empty() && at != std::string::npos; at = body.find(host, at + ours.size())) {
+                    body.replace(at, host.size(), ours);
+                }
+                setDescription(body, event.durationMs);
+            }
+            break;
+
+            case TraceEvent::Kind::SOAP: {
+                Reply reply;
+                reply.resultCode = event.resultCode;
+                reply.outputs = event.outputs;
+                reply.delayMs = event.durationMs;
+                script(event.action, reply);
+            }
+            break;
+
+            // discovery is bypassed, see uPnPHandler::setGatewayDescriptionURL()
+            case TraceEvent::Kind::SSDPResponse:
+                break;
+        }
+    }
+}
+
+void FakeGateway::script(const std::string& action, const Reply& reply) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _replies[action].push_back(reply);
+}
+
+void FakeGateway::setDescription(const std::string& xml, int64_t delayMs) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _description = xml;
+    _descriptionDelayMs = delayMs;
+}
+
+void FakeGateway::setModel(const std::string& modelName) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto begin = _description.find("<modelName>");
+    if (begin == std::string::npos) return;
+    begin += 11;
+    _description.replace(begin, _description.find("</modelName>", begin) - begin, modelName);
+}
+
+void FakeGateway::setFirewallControl() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto begin = _description.find("<serviceType>urn:schemas-upnp-org:service:WANIPConnection:1</serviceType>");
+    if (begin == std::string::npos) return;
+    auto end = _description.find("</service>", begin) + 10;
+    _description.insert(end,
+        "<service>"
+        "<serviceType>urn:schemas-upnp-org:service:WANIPv6FirewallControl:1</serviceType>"
+        "<serviceId>urn:upnp-org:serviceId:WANIPv6Firewall1</serviceId>"
+        "<controlURL>/ctl/IP6FCtl</controlURL><eventSubURL>/evt/IP6FCtl</eventSubURL><SCPDURL>/WANIP6FC.xml</SCPDURL>"
+        "</service>"
+    );
+}
+
+void FakeGateway::setTimeScale(double scale) {
+    _timeScale = scale;
+}
+
+void FakeGateway::setFaults(const Faults& faults) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _faults = faults;
+}
+
+unsigned int FakeGateway::requestCount(const std::string& action) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _requests.find(action);
+    return found == _requests.end() ? 0 : found->second;
+}
+
+void FakeGateway::setForwarding(bool forwards, const std::string& externalIP) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _forwards = forwards;
+    _externalIP = externalIP;
+}
+
+void FakeGateway::_forward(unsigned short externalPort, const std::string& internalClient, unsigned short internalPort) {
+    std::string externalIP;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_forwards || _forwarded.count(externalPort)) return;
+        externalIP = _externalIP;
+    }
+
+    sockaddr_in external {};
+    external.sin_family = AF_INET;
+    external.sin_port = htons(externalPort);
+    inet_pton(AF_INET, externalIP.c_str(), &external.sin_addr);
+
+    sockaddr_in internal {};
+    internal.sin_family = AF_INET;
+    internal.sin_port = htons(internalPort);
+    inet_pton(AF_INET, internalClient.c_str(), &internal.sin_addr);
+
+    auto socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket == Sockets::INVALID) return;
+
+    int reuse = 1;
+    setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    if (bind(socket, (sockaddr*)&external, sizeof(external)) != 0 || listen(socket, 16) != 0) {
+        Sockets::close(socket);
+        return;
+    }
+
+    auto forward = std::make_unique<Forward>();
+    forward->listenSocket = Sockets::toHandle(socket);
+    auto raw = forward.get();
+    forward->thread = std::thread([raw, internal, socket]() {
+        while (raw->running) {
+            if (Sockets::waitReadable(socket, 100) <= 0) continue;
+
+            auto incoming = accept(socket, nullptr, nullptr);
+            if (incoming == Sockets::INVALID) continue;
+
+            // internal host down : the connection is dropped, as most NATs do
+            auto outgoing = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (outgoing == Sockets::INVALID || connect(outgoing, (sockaddr*)&internal, sizeof(internal)) != 0) {
+                Sockets::close(outgoing);
+                Sockets::close(incoming);
+                continue;
+            }
+
+            raw->relays.emplace_back(_relay, incoming, outgoing, std::cref(raw->running));
+        }
+    });
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _forwarded[externalPort] = std::move(forward);
+}
+
+void FakeGateway::_unforward(unsigned short externalPort) {
+    std::unique_ptr<Forward> forward;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto found = _forwarded.find(externalPort);
+        if (found == _forwarded.end()) return;
+        forward = std::move(found->second);
+        _forwarded.erase(found);
+    }
+
+    forward->running = false;
+    if (forward->thread.joinable()) forward->thread.join();
+    for (auto &relay : forward->relays) {
+        if (relay.joinable()) relay.join();
+    }
+    Sockets::close(Sockets::fromHandle(forward->listenSocket));
+}
+
+void FakeGateway::_serve() {
+    auto listenSocket = Sockets::fromHandle(_listenSocket);
+    while (_running) {
+        if (Sockets::waitReadable(listenSocket, 100) <= 0) continue;
+
+        auto client = accept(listenSocket, nullptr, nullptr);
+        if (client == Sockets::INVALID) continue;
+
+        // concurrent requests, as both families are mapped at once
+        _clients.emplace_back(&FakeGateway::_handle, this, Sockets::toHandle(client));
+    }
+}
+
+void FakeGateway::_handle(intptr_t handle) {
+    auto client = Sockets::fromHandle(handle);
+
+    // headers, then body as announced
+    std::string request;
+    std::size_t headersEnd = std::string::npos;
+    std::size_t expected = 0;
+    char buffer[2048];
+    while (headersEnd == std::string::npos || request.size() < expected) {
+        if (Sockets::waitReadable(client, 2000) <= 0) break;
+        auto received = recv(client, buffer, sizeof(buffer), 0);
+        if (received <= 0) break;
+        request.append(buffer, received);
+
+        if (headersEnd == std::string::npos) {
+            headersEnd = request.find("\r\n\r\n");
+            if (headersEnd != std::string::npos) {
+                auto length = _headerValue(request.substr(0, headersEnd), "Content-Length");
+                if (length.empty()) length = _headerValue(request.substr(0, headersEnd), "CONTENT-LENGTH");
+                expected = headersEnd + 4 + std::atoi(length.c_str());
+            }
+        }
+    }
+
+    if (headersEnd == std::string::npos) {
+        Sockets::close(client);
+        return;
+    }
+
+    auto headers = request.substr(0, headersEnd);
+
+    // description
+    if (headers.rfind("GET ", 0) == 0) {
+        std::string description;
+        int64_t delayMs;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _requests["GET"]++;
+            description = _description;
+            delayMs = _descriptionDelayMs;
+        }
+        _sleep(delayMs);
+        if (_injectFaults(false, nullptr)) {
+            Sockets::close(client);
+            return;
+        }
+        _sendAll(client, _httpResponse("200 OK", description));
+        Sockets::close(client);
+        return;
+    }
+
+    // SOAP, "serviceType#Action"
+    auto soapAction = _headerValue(headers, "SOAPAction");
+    if (soapAction.empty()) soapAction = _headerValue(headers, "SOAPACTION");
+    auto hash = soapAction.find('#');
+    auto serviceType = soapAction.substr(0, hash);
+    auto action = hash == std::string::npos ? std::string() : soapAction.substr(hash + 1);
+
+    auto reply = _nextReply(action);
+    _sleep(reply.delayMs);
+    if (_injectFaults(true, &reply)) {
+        Sockets::close(client);
+        return;
+    }
+
+    // NAT side effects of what the gateway answers
+    auto body = request.substr(headersEnd + 4);
+    auto externalPort = (unsigned short)std::atoi(_argument(body, "NewExternalPort").c_str());
+    if (reply.resultCode == 0 && action == "AddPortMapping") {
+        _forward(externalPort, _argument(body, "NewInternalClient"),
+                 (unsigned short)std::atoi(_argument(body, "NewInternalPort").c_str()));
+    } else if (reply.resultCode == 0 && action == "DeletePortMapping") {
+        _unforward(externalPort);
+    } else if (reply.resultCode == 0 && action == "GetExternalIPAddress") {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_externalIP.empty()) reply.outputs = { {"NewExternalIPAddress", _externalIP} };
+    }
+
+    // transport failure
+    if (reply.resultCode < 0) {
+        Sockets::close(client);
+        return;
+    }
+
+    if (reply.resultCode == 0) {
+        std::string outputs;
+        for (auto &pair : reply.outputs) {
+            outputs += "<" + pair.first + ">" + pair.second + "</" + pair.first + ">";
+        }
+        _sendAll(client, _httpResponse("200 OK", _soapEnvelope(
+            "<u:" + action + "Response xmlns:u=\"" + serviceType + "\">" + outputs + "</u:" + action + "Response>"
+        )));
+    } else {
+        _sendAll(client, _httpResponse("500 Internal Server Error", _soapEnvelope(
+            "<s:Fault><faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring><detail>"
+            "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">"
+            "<errorCode>" + std::to_string(reply.resultCode) + "</errorCode>"
+            "<errorDescription>FakeGateway</errorDescription>"
+            "</UPnPError></detail></s:Fault>"
+        )));
+    }
+
+    Sockets::close(client);
+}
+
+FakeGateway::Reply FakeGateway::_nextReply(const std::string& action) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _requests[action]++;
+
+    auto found = _replies.find(action);
+    if (found == _replies.end() || found->second.empty()) return _defaultReply(action);
+
+    auto reply = found->second.front();
+    if (found->second.size() > 1) found->second.pop_front();
+    return reply;
+}
+
+bool FakeGateway::_injectFaults(bool isSOAP, Reply* reply) {
+    int64_t latencyMs;
+    bool isLost;
+    bool isError;
+    Faults faults;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        faults = _faults;
+        std::uniform_int_distribution<int64_t> jitter(-faults.jitterMs, faults.jitterMs);
+        std::uniform_real_distribution<double> draw(0, 1);
+        latencyMs = std::max<int64_t>(0, faults.latencyMs + jitter(_random));
+        isLost = draw(_random) < faults.lossRate;
+        isError = draw(_random) < faults.errorRate;
+    }
+
+    if (isLost) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(faults.lossStallMs));
+        return true;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(latencyMs));
+    if (isSOAP && isError) {
+        reply->resultCode = faults.errorCode;
+        reply->outputs.clear();
+    }
+    return false;
+}
+
+void FakeGateway::_sleep(int64_t delayMs) const {
+    auto scaled = (int64_t)(delayMs * _timeScale.load());
+    if (scaled > 0) std::this_thread::sleep_for(std::chrono::milliseconds(scaled));
+}
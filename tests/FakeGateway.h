@@ -0,0 +1,125 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#pragma once
+
+#include <nw-candy/Trace.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Minimal IGD on loopback : serves a root description and answers SOAP actions,
+// either replaying a recorded Trace or following scripted replies.
+class FakeGateway {
+ public:
+    struct Reply {
+        int resultCode = 0;  // UPnP error code, negative drops the connection
+        NetworkCandy::TraceArguments outputs;
+        int64_t delayMs = 0;
+    };
+
+    // misbehaviours, drawn for each request
+    struct Faults {
+        int64_t latencyMs = 0;
+        int64_t jitterMs = 0;  // latency +/- this
+        double lossRate = 0;  // requests never answered, the connection dropping after lossStallMs
+        int64_t lossStallMs = 0;
+        double errorRate = 0;  // SOAP actions failing with errorCode
+        int errorCode = 501;
+    };
+
+    FakeGateway();
+    ~FakeGateway();
+
+    // returns if listening
+    bool start();
+    void stop();
+
+    unsigned short port() const;
+    std::string descriptionURL() const;
+
+    // recorded description and SOAP replies, per action and in order; the last one of each action repeats
+    void load(const NetworkCandy::Trace& trace);
+
+    // queued after what is already known for this action
+    void script(const std::string& action, const Reply& reply);
+    void setDescription(const std::string& xml, int64_t delayMs = 0);
+
+    // modelName of the description, so that gateway profiles learnt against another fake are not reused
+    void setModel(const std::string& modelName);
+
+    // adds a WANIPv6FirewallControl service next to WANIPConnection, so that IPv6 gets pinholed
+    void setFirewallControl();
+
+    // recorded delays are multiplied by this (0 answers at once)
+    void setTimeScale(double scale);
+
+    void setFaults(const Faults& faults);
+
+    unsigned int requestCount(const std::string& action) const;
+
+    // AddPortMapping then relays TCP from externalIP:NewExternalPort to the internal client, as a NAT would;
+    // not forwarding, connections to the mapped port are refused
+    void setForwarding(bool forwards, const std::string& externalIP = "127.0.0.2");
+
+ private:
+    struct Forward {
+        intptr_t listenSocket = -1;
+        std::atomic<bool> running {true};
+        std::thread thread;
+        std::vector<std::thread> relays;
+    };
+
+    void _forward(unsigned short externalPort, const std::string& internalClient, unsigned short internalPort);
+    void _unforward(unsigned short externalPort);
+
+    void _serve();
+    void _handle(intptr_t client);
+    Reply _nextReply(const std::string& action);
+    void _sleep(int64_t delayMs) const;
+
+    // returns if the request is to be dropped, after the injected latency
+    bool _injectFaults(bool isSOAP, Reply* reply);
+
+    intptr_t _listenSocket = -1;
+    unsigned short _port = 0;
+    std::atomic<bool> _running {false};
+    std::thread _thread;
+    std::vector<std::thread> _clients;
+
+    mutable std::mutex _mutex;
+    std::string _description;
+    int64_t _descriptionDelayMs = 0;
+    std::map<std::string, std::deque<Reply>> _replies;
+    std::map<std::string, unsigned int> _requests;
+    std::atomic<double> _timeScale {1.0};
+    Faults _faults;
+    std::mt19937 _random {42};
+
+    bool _forwards = false;
+    std::string _externalIP;
+    std::map<unsigned short, std::unique_ptr<Forward>> _forwarded;
+};
@@ -0,0 +1,341 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// Linux only : measures how fast ConnectivityManager reports link, address and default route changes,
+// and what it costs under storms, within a private network namespace (needs CAP_NET_ADMIN / CAP_SYS_ADMIN).
+//
+// connectivityBench [iterations per scenario] [storm duration in seconds]
+
+#include <nw-candy/ConnectivityManager.h>
+#include "Netlink.h"
+
+#include <spdlog/spdlog.h>
+
+#include <arpa/inet.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+namespace Netlink = NetworkCandy::Netlink;
+
+namespace {
+
+const char * _LINK = "nwc0";
+const char * _PEER = "nwc1";
+const char * _LOCAL_ADDRESS = "10.77.0.2";
+const char * _GATEWAY_ADDRESS = "10.77.0.1";
+
+// rtnetlink message with its attributes, built in place
+class Message {
+ public:
+    Message(uint16_t type, uint16_t flags, const void* payload, std::size_t payloadSize) {
+        _header()->nlmsg_len = NLMSG_LENGTH(payloadSize);
+        _header()->nlmsg_type = type;
+        _header()->nlmsg_flags = flags;
+        std::memcpy(NLMSG_DATA(_header()), payload, payloadSize);
+    }
+
+    rtattr* add(uint16_t type, const void* data = nullptr, std::size_t size = 0) {
+        auto attr = (rtattr*)(_buffer + NLMSG_ALIGN(_header()->nlmsg_len));
+        attr->rta_type = type;
+        attr->rta_len = RTA_LENGTH(size);
+        if (size) std::memcpy(RTA_DATA(attr), data, size);
+        _header()->nlmsg_len = NLMSG_ALIGN(_header()->nlmsg_len) + RTA_ALIGN(attr->rta_len);
+        return attr;
+    }
+
+    rtattr* add(uint16_t type, const char * value) {
+        return add(type, value, std::strlen(value) + 1);
+    }
+
+    // raw bytes within a nested attribute (VETH_INFO_PEER starts with an ifinfomsg)
+    void append(const void* data, std::size_t size) {
+        std::memcpy(_buffer + _header()->nlmsg_len, data, size);
+        _header()->nlmsg_len += NLMSG_ALIGN(size);
+    }
+
+    // closes a nested attribute opened with add(type)
+    void close(rtattr* nested) {
+        nested->rta_len = (unsigned short)(_buffer + _header()->nlmsg_len - (char*)nested);
+    }
+
+    bool send(int fd) {
+        return Netlink::request(fd, _header());
+    }
+
+ private:
+    alignas(nlmsghdr) char _buffer[1024] {};
+    nlmsghdr* _header() { return (nlmsghdr*)_buffer; }
+};
+
+bool _createVethPair(int fd) {
+    ifinfomsg info {};
+    info.ifi_family = AF_UNSPEC;
+
+    Message msg(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &info, sizeof(info));
+    msg.add(IFLA_IFNAME, _LINK);
+    auto linkInfo = msg.add(IFLA_LINKINFO);
+    msg.add(IFLA_INFO_KIND, "veth");
+    auto data = msg.add(IFLA_INFO_DATA);
+    auto peer = msg.add(VETH_INFO_PEER);
+    msg.append(&info, sizeof(info));
+    msg.add(IFLA_IFNAME, _PEER);
+    msg.close(peer);
+    msg.close(data);
+    msg.close(linkInfo);
+    return msg.send(fd);
+}
+
+bool _setLinkUp(int fd, int index, bool up) {
+    ifinfomsg info {};
+    info.ifi_family = AF_UNSPEC;
+    info.ifi_index = index;
+    info.ifi_flags = up ? IFF_UP : 0;
+    info.ifi_change = IFF_UP;
+
+    Message msg(RTM_NEWLINK, 0, &info, sizeof(info));
+    return msg.send(fd);
+}
+
+bool _setAddress(int fd, int index, bool add) {
+    ifaddrmsg address {};
+    address.ifa_family = AF_INET;
+    address.ifa_prefixlen = 24;
+    address.ifa_index = index;
+
+    in_addr local;
+    inet_pton(AF_INET, _LOCAL_ADDRESS, &local);
+
+    Message msg(add ? RTM_NEWADDR : RTM_DELADDR, add ? NLM_F_CREATE | NLM_F_REPLACE : 0, &address, sizeof(address));
+    msg.add(IFA_LOCAL, &local, sizeof(local));
+    msg.add(IFA_ADDRESS, &local, sizeof(local));
+    return msg.send(fd);
+}
+
+bool _setDefaultRoute(int fd, int index, bool add) {
+    rtmsg route {};
+    route.rtm_family = AF_INET;
+    route.rtm_table = RT_TABLE_MAIN;
+    route.rtm_protocol = RTPROT_BOOT;
+    route.rtm_scope = RT_SCOPE_UNIVERSE;
+    route.rtm_type = RTN_UNICAST;
+
+    in_addr gateway;
+    inet_pton(AF_INET, _GATEWAY_ADDRESS, &gateway);
+
+    Message msg(add ? RTM_NEWROUTE : RTM_DELROUTE, add ? NLM_F_CREATE | NLM_F_EXCL : 0, &route, sizeof(route));
+    msg.add(RTA_GATEWAY, &gateway, sizeof(gateway));
+    msg.add(RTA_OIF, &index, sizeof(index));
+    return msg.send(fd);
+}
+
+// records when each report comes, and lets the bench wait for a given state
+class BenchConnectivityManager : public NetworkCandy::ConnectivityManager {
+ public:
+    // returns the delay since "since", or a negative duration if "isConnected" was not reported within 2s
+    Clock::duration waitFor(bool isConnected, Clock::time_point since) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto reported = _cv.wait_for(lock, std::chrono::seconds(2), [&]() {
+            return _reports > 0 && _isConnected == isConnected && _reportedAt >= since;
+        });
+        if (!reported) return Clock::duration(-1);
+        return _reportedAt - since;
+    }
+
+    unsigned long reports() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _reports;
+    }
+
+ protected:
+    void _connectivityChanged(bool isConnectedToInternet) override {
+        auto now = Clock::now();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _isConnected = isConnectedToInternet;
+            _reportedAt = now;
+            _reports++;
+        }
+        _cv.notify_all();
+    }
+
+ private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _isConnected = false;
+    Clock::time_point _reportedAt;
+    unsigned long _reports = 0;
+};
+
+void _printDistribution(const char * scenario, std::vector<double> samplesUs, unsigned int missed) {
+    if (samplesUs.empty()) {
+        std::cout << scenario << " : no report received (" << missed << " missed)\n";
+        return;
+    }
+
+    std::sort(samplesUs.begin(), samplesUs.end());
+    auto percentile = [&samplesUs](double p) {
+        return samplesUs[std::min(samplesUs.size() - 1, (std::size_t)(p * samplesUs.size()))];
+    };
+
+    std::cout << scenario << " : n=" << samplesUs.size() << " missed=" << missed
+              << " p50=" << percentile(0.5) << "us p90=" << percentile(0.9) << "us p99=" << percentile(0.99)
+              << "us max=" << samplesUs.back() << "us\n";
+}
+
+// runs "disconnect" then "reconnect" in turns, timing the report of each transition
+void _measure(BenchConnectivityManager& cm, const char * scenario, unsigned int iterations,
+              const std::function<bool()>& disconnect, const std::function<bool()>& reconnect) {
+    std::vector<double> samplesUs;
+    unsigned int missed = 0;
+
+    for (unsigned int i = 0; i < iterations * 2; i++) {
+        auto connecting = i % 2 == 1;
+        auto since = Clock::now();
+        if (!(connecting ? reconnect() : disconnect())) {
+            std::cout << scenario << " : netlink request refused, scenario aborted\n";
+            return;
+        }
+
+        auto latency = cm.waitFor(connecting, since);
+        if (latency.count() < 0) {
+            missed++;
+            continue;
+        }
+        samplesUs.push_back(std::chrono::duration<double, std::micro>(latency).count());
+    }
+
+    _printDistribution(scenario, samplesUs, missed);
+}
+
+double _threadCpuMs(std::thread& thread) {
+    clockid_t clock;
+    timespec ts {};
+    if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0 || clock_gettime(clock, &ts) != 0) return -1;
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    auto iterations = argc > 1 ? (unsigned int)std::atoi(argv[1]) : 200u;
+    auto stormSeconds = argc > 2 ? std::atof(argv[2]) : 2.0;
+
+    spdlog::set_level(spdlog::level::warn);
+
+    // before any thread is spawned, so that they all live in the namespace
+    if (unshare(CLONE_NEWNET) != 0) {
+        std::cout << "connectivityBench : cannot create a network namespace (" << std::strerror(errno)
+                  << "), needs CAP_NET_ADMIN; skipped.\n";
+        return 0;
+    }
+
+    auto fd = Netlink::open();
+    if (fd < 0 || !_createVethPair(fd)) {
+        std::cout << "connectivityBench : cannot create a veth pair; skipped.\n";
+        return 0;
+    }
+
+    int link = if_nametoindex(_LINK);
+    int peer = if_nametoindex(_PEER);
+    auto ok = _setLinkUp(fd, peer, true) && _setLinkUp(fd, link, true) &&
+              _setAddress(fd, link, true) && _setDefaultRoute(fd, link, true);
+    if (!ok) {
+        std::cout << "connectivityBench : cannot set the namespace up; skipped.\n";
+        return 0;
+    }
+
+    BenchConnectivityManager cm;
+    cm.initCOM();
+    std::thread listener([&cm]() { cm.listenForConnectivityChanges(); });
+
+    // carrier comes up asynchronously, wait for the initial report
+    if (cm.waitFor(true, Clock::time_point()).count() < 0) {
+        std::cout << "connectivityBench : namespace never reported as connected; skipped.\n";
+        cm.stopListening();
+        listener.join();
+        cm.releaseCOM();
+        return 0;
+    }
+
+    std::cout << "connectivityBench : " << iterations << " transitions each way per scenario\n";
+
+    _measure(cm, "default route del/add", iterations,
+        [&]() { return _setDefaultRoute(fd, link, false); },
+        [&]() { return _setDefaultRoute(fd, link, true); }
+    );
+
+    // removing the address takes the route depending on it away
+    _measure(cm, "address del/add", iterations,
+        [&]() { return _setAddress(fd, link, false); },
+        [&]() { return _setAddress(fd, link, true) && _setDefaultRoute(fd, link, true); }
+    );
+
+    // carrier loss, the route stays; goes through the kernel linkwatch, which may defer it
+    _measure(cm, "peer link down/up", iterations,
+        [&]() { return _setLinkUp(fd, peer, false); },
+        [&]() { return _setLinkUp(fd, peer, true); }
+    );
+
+    // storm : flap the default route as fast as netlink acknowledges, and see what the listener burns
+    {
+        auto reportsBefore = cm.reports();
+        auto cpuBefore = _threadCpuMs(listener);
+        auto start = Clock::now();
+        auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(stormSeconds));
+
+        unsigned long flaps = 0;
+        while (Clock::now() < deadline) {
+            if (!_setDefaultRoute(fd, link, false) || !_setDefaultRoute(fd, link, true)) break;
+            flaps++;
+        }
+
+        // settle, last report must be "connected"
+        cm.waitFor(true, start);
+        auto elapsedS = std::chrono::duration<double>(Clock::now() - start).count();
+        auto cpuMs = _threadCpuMs(listener) - cpuBefore;
+        auto reports = cm.reports() - reportsBefore;
+
+        std::cout << "storm : " << flaps << " flaps in " << elapsedS << "s (" << (unsigned long)(flaps / elapsedS) << "/s), "
+                  << reports << " reports, listener CPU " << cpuMs << "ms ("
+                  << (flaps ? cpuMs * 1000 / flaps : 0) << "us per flap, " << (cpuMs / 10 / elapsedS) << "% of a core)\n";
+    }
+
+    cm.stopListening();
+    listener.join();
+    cm.releaseCOM();
+    Netlink::close(fd);
+    return 0;
+}
@@ -0,0 +1,155 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// SSDP answers floods of a crowded LAN (hundreds of TVs, consoles, printers and media servers, each answering several
+// times), ingested the way upnpDiscover() keeps them, one malloc'd UPNPDev per answer, vs into SSDPDeviceTable.
+//
+// discoveryBench [devices] [answers per device] [rounds]
+
+#include <nw-candy/SSDP.h>
+#include <nw-candy/SSDPDeviceTable.h>
+
+#include <miniupnpc/upnpdev.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace NetworkCandy;
+
+namespace {
+
+std::vector<std::string> _flood(unsigned int devices, unsigned int answers) {
+    static const char * targets[] = {
+        "upnp:rootdevice",
+        "urn:schemas-upnp-org:device:MediaRenderer:1",
+        "urn:schemas-upnp-org:device:MediaServer:1",
+        "urn:schemas-upnp-org:device:Printer:1",
+        "urn:dial-multiscreen-org:service:dial:1"
+    };
+
+    std::vector<std::string> datagrams;
+    for (unsigned int a = 0; a < answers; a++) {
+        for (unsigned int d = 0; d < devices; d++) {
+            // a couple of gateways among them
+            std::string st = d % 250 == 0 ? "urn:schemas-upnp-org:device:InternetGatewayDevice:1" : targets[d % 5];
+            auto uuid = "uuid:" + std::to_string(100000 + d) + "-0000-1000-8000-00e04c000000";
+            datagrams.push_back(
+                "HTTP/1.1 200 OK\r\n"
+                "CACHE-CONTROL: max-age=1800\r\n"
+                "DATE: Mon, 19 Oct 2026 06:00:00 GMT\r\n"
+                "EXT:\r\n"
+                "LOCATION: http://192.168.1." + std::to_string(d % 250 + 2) + ":" + std::to_string(49152 + d) + "/description.xml\r\n"
+                "SERVER: Linux/5.4 UPnP/1.0 SomeStack/1.0\r\n"
+                "ST: " + st + "\r\n"
+                "USN: " + uuid + "::" + st + "\r\n"
+                "\r\n");
+        }
+    }
+    return datagrams;
+}
+
+struct Result {
+    double nsPerAnswer = 0;
+    std::size_t kept = 0;
+    std::size_t bytes = 0;
+    std::size_t reserved = 0;  // allocated, used or not
+};
+
+// what miniupnpc does with each answer
+Result _keepAll(const std::vector<std::string>& datagrams, unsigned int rounds) {
+    Result result;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        UPNPDev* list = nullptr;
+        result.kept = result.bytes = 0;
+        for (auto &datagram : datagrams) {
+            SSDPMessage message;
+            if (!parseSSDPMessage(datagram.data(), datagram.size(), &message)) continue;
+
+            auto length = message.location.size() + message.st.size() + message.usn.size() + 3;
+            auto device = (UPNPDev*)std::malloc(sizeof(UPNPDev) + length);
+            device->descURL = device->buffer;
+            device->st = device->descURL + message.location.size() + 1;
+            device->usn = device->st + message.st.size() + 1;
+            std::memcpy(device->descURL, message.location.data(), message.location.size());
+            device->descURL[message.location.size()] = '\0';
+            std::memcpy(device->st, message.st.data(), message.st.size());
+            device->st[message.st.size()] = '\0';
+            std::memcpy(device->usn, message.usn.data(), message.usn.size());
+            device->usn[message.usn.size()] = '\0';
+            device->scope_id = 0;
+            device->pNext = list;
+            list = device;
+
+            result.kept++;
+            result.bytes += sizeof(UPNPDev) + length;
+        }
+        result.reserved = result.bytes;
+        freeUPNPDevlist(list);
+    }
+    result.nsPerAnswer = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (rounds * datagrams.size());
+    return result;
+}
+
+Result _table(const std::vector<std::string>& datagrams, unsigned int rounds) {
+    Result result;
+    SSDPDeviceTable table;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        table.clear();
+        for (auto &datagram : datagrams) {
+            SSDPMessage message;
+            if (!parseSSDPMessage(datagram.data(), datagram.size(), &message)) continue;
+            table.insert(message);
+        }
+    }
+    result.nsPerAnswer = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (rounds * datagrams.size());
+    result.kept = table.size();
+    result.bytes = table.bytes();
+    result.reserved = table.reservedBytes();
+    return result;
+}
+
+void _print(const char * name, const Result& result) {
+    std::cout << name << " : " << result.nsPerAnswer << "ns/answer, " << result.kept << " kept for validation, "
+              << result.bytes << " bytes held, " << result.reserved << " allocated\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    auto devices = argc > 1 ? (unsigned int)std::atoi(argv[1]) : 500u;
+    auto answers = argc > 2 ? (unsigned int)std::atoi(argv[2]) : 3u;
+    auto rounds = argc > 3 ? (unsigned int)std::atoi(argv[3]) : 200u;
+
+    auto datagrams = _flood(devices, answers);
+    std::cout << devices << " devices answering " << answers << " times, " << datagrams.size() << " answers, "
+              << rounds << " rounds\n";
+
+    auto keepAll = _keepAll(datagrams, rounds);
+    auto table = _table(datagrams, rounds);
+    _print("UPNPDev list ", keepAll);
+    _print("device table ", table);
+
+    return table.kept == (devices + 249) / 250 ? 0 : 1;
+}
@@ -0,0 +1,516 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// uPnPHandler behaviours, one case each, against a loopback gateway.
+
+#include <nw-candy/GatewayProfiles.h>
+#include <nw-candy/NetworkInterfaces.h>
+#include <nw-candy/RetryPolicy.h>
+#include <nw-candy/uPnPHandler.h>
+
+#include "FakeGateway.h"
+#include "Sockets.h"
+
+#include <spdlog/spdlog.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace NetworkCandy;
+
+namespace {
+
+bool _expect(bool condition, const char * what) {
+    std::cout << (condition ? "OK   " : "FAIL ") << what << '\n';
+    return condition;
+}
+
+// discovery candidates : every multicast interface, pinned / excluded ones applied
+bool _interfaces() {
+    auto succeeded = true;
+
+    auto interfaces = listMulticastInterfaces();
+    auto isValid = true;
+    for (auto &iface : interfaces) isValid &= !iface.name.empty() && iface.index != 0 && iface.ipv4 != "127.0.0.1";
+    succeeded &= _expect(isValid, "interfaces : named, indexed, loopback left out");
+
+    // a described gateway is not bound to any of them, whatever is excluded
+    FakeGateway gateway;
+    if (!gateway.start()) return _expect(false, "interfaces : fake gateway started");
+
+    std::vector<std::string> names;
+    for (auto &iface : interfaces) names.push_back(iface.name);
+
+    uPnPHandler handler("31140", "handlerTests");
+    handler.excludeInterfaces(names);
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+    succeeded &= _expect(handler.ensurePortMapping() && handler.gatewayInterface().empty(), "interfaces : described gateway used as is");
+    handler.mayDeletePortMapping();
+
+    gateway.stop();
+    return succeeded;
+}
+
+// IPv4 mapping and IPv6 pinhole held at once, each reported on its own
+bool _families() {
+    auto succeeded = true;
+
+    // IGDv1 only, no FirewallControl to pinhole through
+    {
+        FakeGateway gateway;
+        if (!gateway.start()) return _expect(false, "families : fake gateway started");
+
+        uPnPHandler handler("31140", "handlerTests");
+        handler.setGatewayDescriptionURL(gateway.descriptionURL());
+        succeeded &= _expect(handler.ensurePortMapping(), "families : mapped");
+        succeeded &= _expect(handler.hasPortMapping(AddressFamily::IPv4) && !handler.hasPortMapping(AddressFamily::IPv6),
+                             "families : IPv4 mapped, no IPv6 pinhole");
+
+        handler.mayDeletePortMapping();
+        succeeded &= _expect(!handler.hasPortMapping(AddressFamily::IPv4) && gateway.requestCount("DeletePortMapping") == 1,
+                             "families : IPv4 unmapped");
+    }
+
+    // with FirewallControl, both at once
+    {
+        FakeGateway gateway;
+        gateway.setModel("PinholingGateway");
+        gateway.setFirewallControl();
+        if (!gateway.start()) return _expect(false, "families : fake gateway started");
+
+        uPnPHandler handler("31140", "handlerTests");
+        handler.setGatewayDescriptionURL(gateway.descriptionURL());
+        succeeded &= _expect(handler.ensurePortMapping() && handler.hasPortMapping(AddressFamily::IPv4) &&
+                             handler.hasPortMapping(AddressFamily::IPv6) && gateway.requestCount("AddPinhole") == 1,
+                             "families : IPv4 mapped and IPv6 pinholed");
+
+        handler.mayDeletePortMapping();
+        succeeded &= _expect(!handler.hasPortMapping(AddressFamily::IPv4) && !handler.hasPortMapping(AddressFamily::IPv6) &&
+                             gateway.requestCount("DeletePortMapping") == 1 && gateway.requestCount("DeletePinhole") == 1,
+                             "families : both torn down");
+    }
+
+    return succeeded;
+}
+
+// handlers pinholing the same port at once each get their own pinhole, torn down on its own
+bool _pinholes() {
+    FakeGateway gateway;
+    gateway.setModel("SharedPinholeGateway");
+    gateway.setFirewallControl();
+    if (!gateway.start()) return _expect(false, "pinholes : fake gateway started");
+    gateway.script("AddPinhole", { 0, { {"UniqueID", "1"} }, 100 });
+    gateway.script("AddPinhole", { 0, { {"UniqueID", "2"} }, 100 });
+
+    uPnPHandler first("31140", "handlerTests");
+    uPnPHandler second("31140", "handlerTests");
+    first.setGatewayDescriptionURL(gateway.descriptionURL());
+    second.setGatewayDescriptionURL(gateway.descriptionURL());
+
+    std::thread other([&second]() { second.ensurePortMapping(); });
+    first.ensurePortMapping();
+    other.join();
+
+    auto succeeded = _expect(first.hasPortMapping(AddressFamily::IPv6) && second.hasPortMapping(AddressFamily::IPv6) &&
+                             gateway.requestCount("AddPinhole") == 2, "pinholes : one each, not merged");
+
+    first.mayDeletePortMapping();
+    succeeded &= _expect(gateway.requestCount("DeletePinhole") == 1 && second.hasPortMapping(AddressFamily::IPv6),
+                         "pinholes : the other one left in place");
+
+    second.mayDeletePortMapping();
+    succeeded &= _expect(gateway.requestCount("DeletePinhole") == 2, "pinholes : both torn down");
+    return succeeded;
+}
+
+// single AddPortMapping when it goes well, never mistaking another host's mapping for ours
+bool _optimistic() {
+    auto succeeded = true;
+    auto map = [](FakeGateway& gateway) {
+        uPnPHandler handler("31140", "handlerTests");
+        handler.setGatewayDescriptionURL(gateway.descriptionURL());
+        handler.setOptimisticMapping(true);
+        handler.ensurePortMapping();
+        auto isMapped = handler.hasPortMapping(AddressFamily::IPv4);
+        handler.mayDeletePortMapping();
+        return isMapped;
+    };
+
+    {
+        FakeGateway gateway;
+        gateway.setModel("OptimisticGateway");
+        if (!gateway.start()) return _expect(false, "optimistic : fake gateway started");
+        succeeded &= _expect(map(gateway) && gateway.requestCount("AddPortMapping") == 1 &&
+                             gateway.requestCount("GetSpecificPortMappingEntry") == 0, "optimistic : single round-trip");
+    }
+
+    // ActionFailed, then the check tells the port is someone else's
+    {
+        FakeGateway gateway;
+        gateway.setModel("AmbiguousGateway");
+        if (!gateway.start()) return _expect(false, "optimistic : fake gateway started");
+        gateway.script("AddPortMapping", { 501, {} });
+        gateway.script("GetSpecificPortMappingEntry",
+                       { 0, { {"NewInternalClient", "192.0.2.50"}, {"NewInternalPort", "31140"}, {"NewLeaseDuration", "0"} } });
+        succeeded &= _expect(!map(gateway) && gateway.requestCount("GetSpecificPortMappingEntry") == 1,
+                             "optimistic : ambiguous answer, port held by another host");
+    }
+
+    {
+        FakeGateway gateway;
+        gateway.setModel("ConflictingGateway");
+        if (!gateway.start()) return _expect(false, "optimistic : fake gateway started");
+        gateway.script("AddPortMapping", { 718, {} });
+        succeeded &= _expect(!map(gateway) && gateway.requestCount("AddPortMapping") == 1 &&
+                             gateway.requestCount("GetSpecificPortMappingEntry") == 0, "optimistic : conflict is a failure");
+    }
+
+    return succeeded;
+}
+
+// learns what the gateway lacks, not what went wrong once, and tries again once the failure is old
+bool _profiles() {
+    auto path = (std::filesystem::temp_directory_path() / "handlerTests-gateways.ini").string();
+    std::filesystem::remove(path);
+    auto &profiles = GatewayProfiles::shared();
+    profiles.setPersistencePath(path);
+
+    auto succeeded = true;
+    auto map = [](FakeGateway& gateway) {
+        uPnPHandler handler("31140", "handlerTests");
+        handler.setGatewayDescriptionURL(gateway.descriptionURL());
+        handler.ensurePortMapping();
+        auto isMapped = handler.hasPortMapping(AddressFamily::IPv4);
+        handler.mayDeletePortMapping();
+        return isMapped;
+    };
+    auto identity = [](const char * model) {
+        GatewayIdentity identity;
+        identity.manufacturer = "NetworkCandy";
+        identity.model = model;
+        identity.firmware = "1";
+        return identity;
+    };
+
+    {
+        FakeGateway gateway;
+        gateway.setModel("ProfiledGateway");
+        if (!gateway.start()) return _expect(false, "profiles : fake gateway started");
+        map(gateway);
+
+        std::ifstream file(path);
+        std::stringstream content;
+        content << file.rdbuf();
+        succeeded &= _expect(content.str().find("[NetworkCandy|ProfiledGateway|1]") != std::string::npos &&
+                             content.str().find("ipv4.mapping = works") != std::string::npos, "profiles : persisted");
+        succeeded &= _expect(content.str().find("[*|*|*]") == std::string::npos && content.str().find("addSuccess") == std::string::npos,
+                             "profiles : seeds not copied into learnt ones");
+        succeeded &= _expect(profiles.find(identity("ProfiledGateway")).ipv4.isAddSuccess(501), "profiles : seeds still merged on lookup");
+    }
+
+    // the port is someone else's, says nothing about the gateway
+    {
+        FakeGateway gateway;
+        gateway.setModel("ConflictedGateway");
+        if (!gateway.start()) return _expect(false, "profiles : fake gateway started");
+        gateway.script("AddPortMapping", { 718, {} });
+        succeeded &= _expect(!map(gateway) && profiles.find(identity("ConflictedGateway")).ipv4.mapping != Support::Fails,
+                             "profiles : conflict not learnt as a failure");
+    }
+
+    {
+        FakeGateway gateway;
+        gateway.setModel("UnsupportedGateway");
+        if (!gateway.start()) return _expect(false, "profiles : fake gateway started");
+        gateway.script("AddPortMapping", { 401, {} });
+        map(gateway);
+        auto learnt = profiles.find(identity("UnsupportedGateway")).ipv4;
+        succeeded &= _expect(learnt.mapping == Support::Fails && learnt.failedAt > 0, "profiles : missing action learnt");
+
+        auto tried = gateway.requestCount("AddPortMapping");
+        map(gateway);
+        succeeded &= _expect(gateway.requestCount("AddPortMapping") == tried, "profiles : missing action not tried again");
+    }
+
+    // learnt long ago, the firmware may have been updated since
+    {
+        FakeGateway gateway;
+        gateway.setModel("UpdatedGateway");
+        if (!gateway.start()) return _expect(false, "profiles : fake gateway started");
+        profiles.parse("[NetworkCandy|UpdatedGateway|1]\nipv4.mapping = fails\nipv4.failedAt = 1\n");
+        succeeded &= _expect(map(gateway) && profiles.find(identity("UpdatedGateway")).ipv4.mapping == Support::Works,
+                             "profiles : old failure probed again");
+    }
+
+    profiles.setPersistencePath("");
+    std::filesystem::remove(path);
+    return succeeded;
+}
+
+// discovery finding nothing has waited enough already, and nothing starts unbounded once the budget is spent
+bool _discoveryBudget() {
+    auto succeeded = true;
+    RetryPolicy policy;
+
+    auto attempts = 0;
+    auto result = policy.run(GatewayOperation::Discovery, RetryPolicy::Clock::now() + std::chrono::seconds(30), [&](std::chrono::milliseconds) {
+        attempts++;
+        return -998;
+    });
+    succeeded &= _expect(result == -998 && attempts == 1, "discovery budget : no devices found, not retried");
+
+    attempts = 0;
+    std::chrono::milliseconds given {0};
+    policy.run(GatewayOperation::Discovery, RetryPolicy::Clock::now() - std::chrono::seconds(1), [&](std::chrono::milliseconds timeout) {
+        attempts++;
+        given = timeout;
+        return -101;
+    });
+    succeeded &= _expect(attempts == 1 && given <= policy.options().minAttemptTimeout,
+                         "discovery budget : spent budget, single brief attempt");
+
+    // discovery pinned to loopback, where no interface can search : nothing leaves this host
+    uPnPHandler handler("31140", "handlerTests");
+    handler.pinInterfaces({ "lo" });
+    auto budget = std::chrono::milliseconds(1500);
+    auto start = std::chrono::steady_clock::now();
+    auto isMapped = handler.ensurePortMapping(budget);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    handler.mayDeletePortMapping();
+    succeeded &= _expect(!isMapped, "discovery budget : nothing found on loopback");
+
+    // the last attempt started as the budget ran out
+    auto tolerance = policy.options().minAttemptTimeout + std::chrono::milliseconds(1000);
+    succeeded &= _expect(elapsed <= budget + tolerance, "discovery budget : ensurePortMapping() within budget");
+
+    return succeeded;
+}
+
+// mapping again keeps what reachability checks learnt meanwhile
+bool _reachabilityKept() {
+    FakeGateway gateway;
+    gateway.setModel("ReachableGateway");
+    gateway.setForwarding(true);
+    if (!gateway.start()) return _expect(false, "reachability kept : fake gateway started");
+
+    GatewayIdentity identity { "NetworkCandy", "ReachableGateway", "1" };
+    uPnPHandler handler("31140", "handlerTests");
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+    auto succeeded = _expect(handler.ensurePortMapping() && handler.checkReachability().isReachable,
+                             "reachability kept : mapped and reachable through hairpin");
+    auto checked = GatewayProfiles::shared().find(identity).ipv4;
+
+    succeeded &= _expect(handler.ensurePortMapping(), "reachability kept : mapped again");
+    auto remapped = GatewayProfiles::shared().find(identity).ipv4;
+    succeeded &= _expect(remapped.reachable == Support::Works && remapped.hairpin == Support::Works &&
+                         remapped.reachLatencyMs > 0 && remapped.reachLatencyMs == checked.reachLatencyMs,
+                         "reachability kept : reachable, hairpin and latency survive");
+
+    handler.mayDeletePortMapping();
+    return succeeded;
+}
+
+// WAN throughput from the gateway counters, across a 32 bits wraparound
+bool _wanLink() {
+    FakeGateway gateway;
+    if (!gateway.start()) return _expect(false, "WAN link : fake gateway started");
+    gateway.script("GetTotalBytesReceived", { 0, { {"NewTotalBytesReceived", "4294967000"} } });
+    gateway.script("GetTotalBytesReceived", { 0, { {"NewTotalBytesReceived", "1000"} } });
+
+    auto succeeded = true;
+    uPnPHandler handler("31140", "handlerTests");
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+    succeeded &= _expect(handler.ensurePortMapping(), "WAN link : mapped");
+
+    auto &sampler = handler.wanLinkSampler();
+    WANLinkQuality wan;
+    succeeded &= _expect(sampler.sampleOnce() && !sampler.latest(&wan), "WAN link : first sample, no rate yet");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    succeeded &= _expect(sampler.sampleOnce() && sampler.latest(&wan), "WAN link : second sample, rate computed");
+
+    // 1296 bytes in at least 200ms, not a negative delta gone huge
+    succeeded &= _expect(wan.rxBytesPerSec > 0 && wan.rxBytesPerSec <= 1296 / 0.2 && wan.downstreamMaxBitRate == 100000000,
+                         "WAN link : wrapped counter, link capacity");
+
+    handler.mayDeletePortMapping();
+    gateway.stop();
+
+    // same counters, but the connection just came up : started over, not wrapped
+    {
+        FakeGateway restarted;
+        restarted.setModel("RestartedGateway");
+        if (!restarted.start()) return _expect(false, "WAN link : fake gateway started");
+        restarted.script("GetTotalBytesReceived", { 0, { {"NewTotalBytesReceived", "3000000000"} } });
+        restarted.script("GetTotalBytesReceived", { 0, { {"NewTotalBytesReceived", "1000"} } });
+        restarted.script("GetStatusInfo", { 0, { {"NewConnectionStatus", "Connected"}, {"NewLastConnectionError", "ERROR_NONE"}, {"NewUptime", "0"} } });
+
+        uPnPHandler restartedHandler("31140", "handlerTests");
+        restartedHandler.setGatewayDescriptionURL(restarted.descriptionURL());
+        restartedHandler.ensurePortMapping();
+
+        auto &restartedSampler = restartedHandler.wanLinkSampler();
+        restartedSampler.sampleOnce();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        succeeded &= _expect(restartedSampler.sampleOnce() && !restartedSampler.latest(&wan), "WAN link : counters reset with the connection");
+
+        // rebooted, as SSDP tells : whatever the counters, the next sample only sets the baseline
+        restartedSampler.resetCounters();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        succeeded &= _expect(restartedSampler.sampleOnce() && !restartedSampler.latest(&wan), "WAN link : first sample after a reboot dropped");
+
+        restartedHandler.mayDeletePortMapping();
+    }
+
+    return succeeded;
+}
+
+// our own scheduler refusing requests says nothing about the gateway, which is kept
+bool _busyScheduler() {
+    FakeGateway gateway;
+    if (!gateway.start()) return _expect(false, "busy scheduler : fake gateway started");
+
+    SOAPSchedulerOptions refusing;
+    refusing.maxQueue = 0;
+    SOAPScheduler::setDefaultOptions(refusing);
+
+    uPnPHandler handler("31140", "handlerTests");
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+    auto isMapped = handler.ensurePortMapping(std::chrono::milliseconds(1000));
+    auto succeeded = _expect(!isMapped && gateway.requestCount("GetExternalIPAddress") == 0 && handler.soapScheduler(),
+                             "busy scheduler : gateway not invalidated");
+
+    SOAPScheduler::setDefaultOptions(SOAPSchedulerOptions());
+    gateway.stop();
+    return succeeded;
+}
+
+// only an address the gateway just answered is announced, and it is forgotten along with the gateway
+bool _externalAddress() {
+    auto succeeded = true;
+    auto announced = [](const FakeGateway::Reply& reply, std::string* externalIP) {
+        FakeGateway gateway;
+        if (!gateway.start()) return std::string("not started");
+        gateway.script("GetExternalIPAddress", reply);
+
+        std::string address;
+        uPnPHandler handler("31140", "handlerTests");
+        handler.setGatewayDescriptionURL(gateway.descriptionURL());
+        handler.setExternalAddressCallback([&address](const std::string& value, ExternalAddressSource) { address = value; });
+        handler.ensurePortMapping();
+        *externalIP = handler.externalIP();
+        handler.mayDeletePortMapping();
+        return address;
+    };
+
+    std::string externalIP;
+    succeeded &= _expect(announced({ 0, { {"NewExternalIPAddress", "198.51.100.20"} } }, &externalIP) == "198.51.100.20" &&
+                         externalIP == "198.51.100.20", "external address : announced");
+    succeeded &= _expect(announced({ 0, { {"NewExternalIPAddress", "0.0.0.0"} } }, &externalIP).empty() && externalIP == "unset",
+                         "external address : none yet, not announced");
+    succeeded &= _expect(announced({ 501, {} }, &externalIP).empty() && externalIP == "unset", "external address : error, not announced");
+
+    FakeGateway gateway;
+    if (!gateway.start()) return _expect(false, "external address : fake gateway started");
+    uPnPHandler handler("31140", "handlerTests");
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+    handler.ensurePortMapping();
+    handler.mayDeletePortMapping();
+    handler.invalidateGateway();
+    succeeded &= _expect(handler.externalIP() == "unset", "external address : forgotten with the gateway");
+
+    return succeeded;
+}
+
+// announces the gateway to ourselves, unicast
+void _notify(const std::string& location, const std::string& bootId) {
+    auto notify = std::string("NOTIFY * HTTP/1.1\r\n") +
+        "HOST: 239.255.255.250:1900\r\n"
+        "NT: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+        "NTS: ssdp:alive\r\n"
+        "USN: uuid:fake::urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+        "LOCATION: " + location + "\r\n"
+        "BOOTID.UPNP.ORG: " + bootId + "\r\n"
+        "\r\n";
+    auto sender = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in to {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(SSDP_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &to.sin_addr);
+    sendto(sender, notify.data(), (int)notify.size(), 0, (sockaddr*)&to, sizeof(to));
+    Sockets::close(sender);
+}
+
+// remaps once the watched gateway announces it rebooted, off the listener thread
+bool _watch() {
+    FakeGateway gateway;
+    if (!gateway.start()) return _expect(false, "watch : fake gateway started");
+
+    auto succeeded = true;
+    uPnPHandler handler("31140", "handlerTests");
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+    succeeded &= _expect(handler.ensurePortMapping(), "watch : mapped");
+    if (!handler.watchGateway()) {
+        std::cout << "SKIP watch, cannot bind port " << SSDP_PORT << '\n';
+        return succeeded;
+    }
+
+    // first announcement of the gateway in use, nothing to do
+    _notify(gateway.descriptionURL(), "1");
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    succeeded &= _expect(gateway.requestCount("AddPortMapping") == 1, "watch : known gateway announced, not remapped");
+
+    _notify(gateway.descriptionURL(), "2");
+    auto giveUpAt = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (gateway.requestCount("AddPortMapping") < 2 && std::chrono::steady_clock::now() < giveUpAt) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    succeeded &= _expect(gateway.requestCount("AddPortMapping") == 2, "watch : rebooted gateway, remapped");
+
+    handler.stopWatchingGateway();
+    handler.mayDeletePortMapping();
+    gateway.stop();
+    return succeeded;
+}
+
+}  // namespace
+
+int main() {
+    spdlog::set_level(spdlog::level::warn);
+
+    auto succeeded = true;
+    succeeded &= _interfaces();
+    succeeded &= _families();
+    succeeded &= _pinholes();
+    succeeded &= _wanLink();
+    succeeded &= _watch();
+    succeeded &= _optimistic();
+    succeeded &= _profiles();
+    succeeded &= _reachabilityKept();
+    succeeded &= _discoveryBudget();
+    succeeded &= _busyScheduler();
+    succeeded &= _externalAddress();
+
+    return succeeded ? 0 : 1;
+}
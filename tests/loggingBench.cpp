@@ -0,0 +1,96 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// cost of logging per mapping operation, synchronous spdlog logger vs nw-candy's asynchronous one,
+// against a loopback gateway answering at once; messages below NW_CANDY_LOG_LEVEL are not even formatted.
+//
+// loggingBench [iterations]
+
+#include <nw-candy/Logging.h>
+#include <nw-candy/uPnPHandler.h>
+
+#include "FakeGateway.h"
+
+#include <spdlog/sinks/basic_file_sink.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+
+// returns the mean duration of a map / unmap cycle, in microseconds
+double _measure(NetworkCandy::uPnPHandler& handler, unsigned int iterations) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < iterations; i++) {
+        handler.ensurePortMapping();
+        handler.mayDeletePortMapping();
+    }
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    auto iterations = argc > 1 ? (unsigned int)std::atoi(argv[1]) : 500u;
+
+    // both loggers write to the same file, as an application would
+    auto sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("loggingBench.log", true);
+    spdlog::set_default_logger(std::make_shared<spdlog::logger>("loggingBench", sink));
+
+    // measuring logging, not the gateway pacing
+    NetworkCandy::SOAPSchedulerOptions unpaced;
+    unpaced.requestsPerSecond = 1e6;
+    unpaced.burst = 1e6;
+    NetworkCandy::SOAPScheduler::setDefaultOptions(unpaced);
+
+    FakeGateway gateway;
+    if (!gateway.start()) {
+        std::cerr << "Cannot start fake gateway\n";
+        return 1;
+    }
+    gateway.setTimeScale(0);
+
+    NetworkCandy::uPnPHandler handler("31137", "loggingBench");
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+
+    // discovery and profile lookup out of the way
+    if (!handler.ensurePortMapping()) {
+        std::cerr << "Cannot map against fake gateway\n";
+        return 1;
+    }
+
+    NetworkCandy::setLogger(std::make_shared<spdlog::logger>("nw-candy", sink));
+    auto synchronousUs = _measure(handler, iterations);
+
+    NetworkCandy::setLogger(nullptr);
+    auto asynchronousUs = _measure(handler, iterations);
+
+    NetworkCandy::setLogger(std::make_shared<spdlog::logger>("nw-candy", sink));
+    NetworkCandy::logger().set_level(spdlog::level::off);
+    auto silentUs = _measure(handler, iterations);
+
+    std::cout << "per map / unmap cycle, over " << iterations << " :\n";
+    std::cout << "  synchronous logger  : " << synchronousUs << "us\n";
+    std::cout << "  asynchronous logger : " << asynchronousUs << "us\n";
+    std::cout << "  logging off         : " << silentUs << "us\n";
+
+    gateway.stop();
+    return 0;
+}
@@ -0,0 +1,247 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// drives SSDPSearch, SSDPListener and ConnectivityManager from a single caller-owned select() loop,
+// no library thread involved; a loopback responder stands for the gateway.
+
+#include <nw-candy/ConnectivityManager.h>
+#include <nw-candy/SSDPListener.h>
+#include <nw-candy/SSDPSearch.h>
+
+#include "Sockets.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace NetworkCandy;
+
+namespace {
+
+using Clock = Pollable::Clock;
+
+// the caller's event loop, until "isDone" or "timeout"
+void _loop(const std::vector<Pollable*>& pollables, const std::function<bool()>& isDone, std::chrono::milliseconds timeout) {
+    auto giveUpAt = Clock::now() + timeout;
+    while (!isDone() && Clock::now() < giveUpAt) {
+        fd_set set;
+        FD_ZERO(&set);
+        Sockets::socket_t maxFd = 0;
+        auto deadline = giveUpAt;
+        for (auto pollable : pollables) {
+            for (auto fd : pollable->fds()) {
+                FD_SET(Sockets::fromHandle(fd), &set);
+                maxFd = std::max(maxFd, Sockets::fromHandle(fd));
+            }
+            deadline = std::min(deadline, pollable->nextDeadline());
+        }
+
+        auto waitMs = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count());
+        timeval tv { (long)(waitMs / 1000), (long)((waitMs % 1000) * 1000) };
+        if (select((int)maxFd + 1, &set, NULL, NULL, &tv) < 0) break;
+
+        for (auto pollable : pollables) {
+            std::vector<intptr_t> ready;
+            for (auto fd : pollable->fds()) {
+                if (FD_ISSET(Sockets::fromHandle(fd), &set)) ready.push_back(fd);
+            }
+            pollable->process(ready);
+        }
+    }
+}
+
+// answers M-SEARCH like an IGD would, plus a media server that should be ignored; or, as some gateways do, only
+// root device searches
+class Responder {
+ public:
+    explicit Responder(bool isRootDeviceOnly = false) : _isRootDeviceOnly(isRootDeviceOnly) {}
+
+    ~Responder() {
+        _running = false;
+        if (_thread.joinable()) _thread.join();
+        Sockets::close(_socket);
+    }
+
+    // returns the port listened on, 0 on failure
+    unsigned short start() {
+        _socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(_socket, (sockaddr*)&address, sizeof(address)) != 0 || getsockname(_socket, (sockaddr*)&address, &length) != 0) return 0;
+
+        _running = true;
+        _thread = std::thread([this]() {
+            char buffer[2048];
+            while (_running) {
+                if (Sockets::waitReadable(_socket, 100) <= 0) continue;
+                sockaddr_in from {};
+                socklen_t fromLength = sizeof(from);
+                auto received = recvfrom(_socket, buffer, sizeof(buffer), 0, (sockaddr*)&from, &fromLength);
+                if (received <= 0) continue;
+
+                SSDPMessage search;
+                if (!parseSSDPMessage(buffer, received, &search)) continue;
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _targets.emplace(search.st);
+                }
+
+                std::vector<std::string> answers;
+                if (_isRootDeviceOnly) {
+                    if (search.st == "upnp:rootdevice") answers.push_back(_answer("upnp:rootdevice", "uuid:igd"));
+                } else {
+                    answers = { _answer("urn:schemas-upnp-org:device:MediaServer:1", "uuid:media"),
+                                _answer("urn:schemas-upnp-org:device:InternetGatewayDevice:1", "uuid:igd") };
+                }
+                for (auto &answer : answers) {
+                    sendto(_socket, answer.data(), (int)answer.size(), 0, (sockaddr*)&from, fromLength);
+                }
+            }
+        });
+        return ntohs(address.sin_port);
+    }
+
+    // search targets received so far
+    std::set<std::string> targets() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _targets;
+    }
+
+ private:
+    bool _isRootDeviceOnly;
+    std::mutex _mutex;
+    std::set<std::string> _targets;
+    Sockets::socket_t _socket = Sockets::INVALID;
+    std::atomic<bool> _running {false};
+    std::thread _thread;
+
+    static std::string _answer(const std::string& st, const std::string& uuid) {
+        return "HTTP/1.1 200 OK\r\n"
+            "CACHE-CONTROL: max-age=120\r\n"
+            "ST: " + st + "\r\n"
+            "USN: " + uuid + "::" + st + "\r\n"
+            "LOCATION: http://127.0.0.1:5000/" + uuid.substr(5) + ".xml\r\n"
+            "SERVER: pollTests UPnP/1.1\r\n"
+            "\r\n";
+    }
+};
+
+bool _expect(bool condition, const char * what) {
+    std::cout << (condition ? "OK   " : "FAIL ") << what << '\n';
+    return condition;
+}
+
+#ifndef _WIN32
+class Connectivity : public ConnectivityManager {
+ public:
+    int reports = 0;
+
+ protected:
+    void _connectivityChanged(bool) override { reports++; }
+};
+#endif
+
+}  // namespace
+
+int main() {
+    spdlog::set_level(spdlog::level::warn);
+    if (!Sockets::init()) return 1;
+
+    auto succeeded = true;
+
+    // discovery, unicast to the responder
+    Responder responder;
+    auto port = responder.start();
+    SSDPSearch search;
+    succeeded &= _expect(port && search.start("127.0.0.1", std::chrono::milliseconds(300), "127.0.0.1", port), "M-SEARCH sent");
+
+    // announcements, unicast to ourselves
+    std::vector<GatewayEvent> events;
+    SSDPListener listener([&events](GatewayEvent event, const GatewayPresence&) { events.push_back(event); });
+    auto isListening = listener.start(std::string(), false);
+
+    std::vector<Pollable*> pollables { &search, &listener };
+
+    #ifndef _WIN32
+        Connectivity connectivity;
+        connectivity.initCOM();
+        pollables.push_back(&connectivity);
+    #endif
+
+    if (isListening) {
+        auto notify = std::string("NOTIFY * HTTP/1.1\r\n") +
+            "HOST: 239.255.255.250:1900\r\n"
+            "NT: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+            "NTS: ssdp:alive\r\n"
+            "USN: uuid:igd::urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+            "LOCATION: http://127.0.0.1:5000/igd.xml\r\n"
+            "\r\n";
+        auto sender = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in to {};
+        to.sin_family = AF_INET;
+        to.sin_port = htons(SSDP_PORT);
+        inet_pton(AF_INET, "127.0.0.1", &to.sin_addr);
+        sendto(sender, notify.data(), (int)notify.size(), 0, (sockaddr*)&to, sizeof(to));
+        Sockets::close(sender);
+    }
+
+    _loop(pollables, [&search]() { return search.isDone(); }, std::chrono::milliseconds(2000));
+
+    auto devices = search.devices();
+    succeeded &= _expect(search.isDone(), "search over once waited");
+    succeeded &= _expect(devices.size() == 1 && devices.front().usn.rfind("uuid:igd", 0) == 0, "single IGD found, media server ignored, resend deduplicated");
+    succeeded &= _expect(responder.targets() == std::set<std::string> {
+        "urn:schemas-upnp-org:device:InternetGatewayDevice:1", "urn:schemas-upnp-org:service:WANIPConnection:1",
+        "urn:schemas-upnp-org:service:WANPPPConnection:1", "upnp:rootdevice"
+    }, "IGD, WAN connection services and root devices searched");
+
+    // no IGD answer, the root device is kept instead
+    {
+        Responder rootOnly(true);
+        auto rootPort = rootOnly.start();
+        SSDPSearch rootSearch;
+        if (rootPort && rootSearch.start("127.0.0.1", std::chrono::milliseconds(300), "127.0.0.1", rootPort)) rootSearch.wait();
+        auto roots = rootSearch.devices();
+        succeeded &= _expect(roots.size() == 1 && roots.front().st == "upnp:rootdevice", "root device fallback");
+    }
+
+    if (isListening) {
+        succeeded &= _expect(events.size() == 1 && events.front() == GatewayEvent::Appeared, "announcement received");
+    } else {
+        std::cout << "SKIP announcement, cannot bind port " << SSDP_PORT << '\n';
+    }
+
+    #ifndef _WIN32
+        succeeded &= _expect(connectivity.reports == 1, "initial connectivity reported");
+        connectivity.releaseCOM();
+    #endif
+
+    listener.stop();
+    return succeeded ? 0 : 1;
+}
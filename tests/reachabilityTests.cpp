@@ -0,0 +1,176 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// mapped-port self-test against a loopback gateway relaying what it maps, as a NAT would, then not relaying;
+// through the hairpin path and through a local echo reflector.
+
+#include <nw-candy/GatewayProfiles.h>
+#include <nw-candy/uPnPHandler.h>
+
+#include "FakeGateway.h"
+#include "Sockets.h"
+
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace NetworkCandy;
+
+namespace {
+
+// stand-in for an echo reflector outside the LAN, see ReachabilityProbe
+class Reflector {
+ public:
+    ~Reflector() {
+        _running = false;
+        if (_thread.joinable()) _thread.join();
+        Sockets::close(_socket);
+    }
+
+    // returns "host:port" to reach it, empty on failure
+    std::string start() {
+        _socket = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(_socket, (sockaddr*)&address, sizeof(address)) != 0 || listen(_socket, 4) != 0 ||
+            getsockname(_socket, (sockaddr*)&address, &length) != 0) {
+            return std::string();
+        }
+
+        _running = true;
+        _thread = std::thread(&Reflector::_serve, this);
+        return "127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+    }
+
+ private:
+    Sockets::socket_t _socket = Sockets::INVALID;
+    std::atomic<bool> _running {false};
+    std::thread _thread;
+
+    static std::string _readLine(Sockets::socket_t socket) {
+        std::string line;
+        char c;
+        while (Sockets::waitReadable(socket, 1000) > 0 && recv(socket, &c, 1, 0) == 1 && c != '\n') line += c;
+        return line;
+    }
+
+    static void _send(Sockets::socket_t socket, const std::string& data) {
+        send(socket, data.data(), (int)data.size(), 0);
+    }
+
+    void _serve() {
+        while (_running) {
+            if (Sockets::waitReadable(_socket, 100) <= 0) continue;
+            auto client = accept(_socket, nullptr, nullptr);
+            if (client == Sockets::INVALID) continue;
+
+            // "NWC-PROBE <ip> <port> <nonce>"
+            std::istringstream request(_readLine(client));
+            std::string verb, ip, nonce;
+            unsigned short port = 0;
+            request >> verb >> ip >> port >> nonce;
+
+            sockaddr_in target {};
+            target.sin_family = AF_INET;
+            target.sin_port = htons(port);
+            auto isValid = verb == "NWC-PROBE" && inet_pton(AF_INET, ip.c_str(), &target.sin_addr) == 1;
+
+            auto connection = isValid ? ::socket(AF_INET, SOCK_STREAM, 0) : Sockets::INVALID;
+            auto isReached = connection != Sockets::INVALID && connect(connection, (sockaddr*)&target, sizeof(target)) == 0;
+            if (isReached) _send(connection, nonce + "\n");
+            Sockets::close(connection);
+
+            _send(client, isReached ? "OK\n" : "FAIL\n");
+            Sockets::close(client);
+        }
+    }
+};
+
+bool _expect(bool condition, const char * what) {
+    std::cout << (condition ? "OK   " : "FAIL ") << what << '\n';
+    return condition;
+}
+
+}  // namespace
+
+int main() {
+    spdlog::set_level(spdlog::level::warn);
+
+    FakeGateway gateway;
+    Reflector reflector;
+    auto reflectorAddress = reflector.start();
+    if (!gateway.start() || reflectorAddress.empty()) {
+        std::cerr << "Cannot start fake gateway or reflector\n";
+        return 1;
+    }
+
+    auto succeeded = true;
+    GatewayIdentity identity { "NetworkCandy", "FakeGateway", "1" };
+
+    // forwarding gateway
+    {
+        gateway.setForwarding(true);
+        uPnPHandler handler("31138", "reachabilityTests");
+        handler.setGatewayDescriptionURL(gateway.descriptionURL());
+        succeeded &= _expect(handler.ensurePortMapping(), "mapped");
+
+        auto hairpin = handler.checkReachability();
+        succeeded &= _expect(hairpin.isReachable && hairpin.isVerified, "reachable through hairpin");
+
+        handler.setReflector(reflectorAddress);
+        auto reflected = handler.checkReachability();
+        succeeded &= _expect(reflected.isReachable && reflected.isVerified, "reachable through reflector");
+        std::cout << "     connect latency " << hairpin.latencyMs << "ms (hairpin), " << reflected.latencyMs << "ms (reflector)\n";
+
+        auto profile = GatewayProfiles::shared().find(identity);
+        succeeded &= _expect(profile.ipv4.reachable == Support::Works && profile.ipv4.hairpin == Support::Works, "profile says reachable");
+
+        handler.mayDeletePortMapping();
+    }
+
+    // gateway answering AddPortMapping without forwarding anything
+    {
+        gateway.setForwarding(false);
+        uPnPHandler handler("31138", "reachabilityTests");
+        handler.setGatewayDescriptionURL(gateway.descriptionURL());
+        succeeded &= _expect(handler.ensurePortMapping(), "mapped, supposedly");
+
+        auto hairpin = handler.checkReachability(std::chrono::milliseconds(1000));
+        succeeded &= _expect(!hairpin.isReachable, "unreachable through hairpin");
+
+        handler.setReflector(reflectorAddress);
+        auto reflected = handler.checkReachability(std::chrono::milliseconds(1000));
+        succeeded &= _expect(!reflected.isReachable, "unreachable through reflector");
+
+        auto profile = GatewayProfiles::shared().find(identity);
+        succeeded &= _expect(profile.ipv4.reachable == Support::Fails && profile.ipv4.hairpin == Support::Fails, "profile says unreachable");
+
+        handler.mayDeletePortMapping();
+    }
+
+    gateway.stop();
+    return succeeded ? 0 : 1;
+}
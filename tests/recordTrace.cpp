@@ -0,0 +1,41 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include <nw-candy/uPnPHandler.h>
+#include <nw-candy/Trace.h>
+
+#include <iostream>
+
+// recordTrace <trace file>
+// maps and unmaps against the gateway of this network, capturing what was exchanged for replayTests
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage : recordTrace <trace file>\n";
+        return 1;
+    }
+
+    NetworkCandy::TraceRecorder::start(argv[1]);
+    NetworkCandy::uPnPHandler uPnPHandler("31137", "recordTrace");
+    auto isMapped = uPnPHandler.ensurePortMapping();
+    uPnPHandler.mayDeletePortMapping();
+    NetworkCandy::TraceRecorder::stop();
+
+    std::cout << (isMapped ? "Mapped" : "Not mapped") << ", trace written to " << argv[1] << '\n';
+    return 0;
+}
@@ -0,0 +1,87 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+#include <nw-candy/uPnPHandler.h>
+#include <nw-candy/Trace.h>
+
+#include "FakeGateway.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+// replayTests [trace file] [time scale]
+// replays a trace recorded with "recordTrace <trace file>" against a loopback gateway and reports timings;
+// without a trace, replays a slow gateway answering AddPortMapping with the 501 quirk.
+int main(int argc, char** argv) {
+    NetworkCandy::Trace trace;
+    if (argc > 1) {
+        if (!trace.load(argv[1])) {
+            std::cerr << "Cannot load trace " << argv[1] << '\n';
+            return 1;
+        }
+    } else {
+        auto soap = [](const char * action, int resultCode, NetworkCandy::TraceArguments outputs, int64_t durationMs) {
+            NetworkCandy::TraceEvent event;
+            event.action = action;
+            event.resultCode = resultCode;
+            event.outputs = std::move(outputs);
+            event.durationMs = durationMs;
+            return event;
+        };
+        trace.events.push_back(soap("GetExternalIPAddress", 0, { {"NewExternalIPAddress", "198.51.100.20"} }, 40));
+        trace.events.push_back(soap("GetSpecificPortMappingEntry", 714, {}, 120));
+        trace.events.push_back(soap("AddPortMapping", 501, {}, 250));
+        trace.events.push_back(soap("DeletePortMapping", 0, {}, 80));
+    }
+    auto timeScale = argc > 2 ? std::atof(argv[2]) : 1.0;
+
+    FakeGateway gateway;
+    if (!gateway.start()) {
+        std::cerr << "Cannot start fake gateway\n";
+        return 1;
+    }
+    gateway.setTimeScale(timeScale);
+    gateway.load(trace);
+
+    NetworkCandy::uPnPHandler uPnPHandler("31137", "replayTests");
+    uPnPHandler.setGatewayDescriptionURL(gateway.descriptionURL());
+
+    auto elapsedMs = [](std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - since).count();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    auto isMapped = uPnPHandler.ensurePortMapping();
+    auto mappingMs = elapsedMs(start);
+
+    start = std::chrono::steady_clock::now();
+    uPnPHandler.mayDeletePortMapping();
+    auto unmappingMs = elapsedMs(start);
+
+    std::cout << "events replayed : " << trace.events.size() << " (time scale " << timeScale << ")\n";
+    std::cout << "ensurePortMapping : " << (isMapped ? "OK" : "KO") << " in " << mappingMs << "ms\n";
+    std::cout << "mayDeletePortMapping : " << unmappingMs << "ms\n";
+    for (auto action : { "GET", "GetExternalIPAddress", "GetSpecificPortMappingEntry", "AddPortMapping", "DeletePortMapping" }) {
+        std::cout << "  " << action << " : " << gateway.requestCount(action) << '\n';
+    }
+
+    gateway.stop();
+    return isMapped ? 0 : 1;
+}
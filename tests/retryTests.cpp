@@ -0,0 +1,121 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// tail latency of map / unmap cycles against a loopback gateway injecting latency, losses and errors,
+// without retries and with nw-candy's retry policy; fails if any cycle overran its budget.
+//
+// retryTests [cycles] [budget in ms]
+
+#include <nw-candy/uPnPHandler.h>
+
+#include "FakeGateway.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+struct Outcome {
+    unsigned int mapped = 0;
+    std::vector<double> durationsMs;
+};
+
+Outcome _run(FakeGateway& gateway, const NetworkCandy::RetryOptions& options, unsigned int cycles, std::chrono::milliseconds budget) {
+    NetworkCandy::uPnPHandler handler("31137", "retryTests");
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+    handler.setRetryOptions(options);
+
+    Outcome outcome;
+    for (unsigned int i = 0; i < cycles; i++) {
+        // validation included in each cycle
+        handler.invalidateGateway();
+
+        auto start = std::chrono::steady_clock::now();
+        if (handler.ensurePortMapping(budget)) outcome.mapped++;
+        outcome.durationsMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+        handler.mayDeletePortMapping(budget);
+    }
+
+    std::sort(outcome.durationsMs.begin(), outcome.durationsMs.end());
+    return outcome;
+}
+
+void _print(const char * name, const Outcome& outcome) {
+    auto &d = outcome.durationsMs;
+    auto percentile = [&d](double p) { return d[std::min(d.size() - 1, (std::size_t)(p * d.size()))]; };
+    std::cout << name << " : mapped " << outcome.mapped << "/" << d.size()
+              << ", p50=" << percentile(0.5) << "ms p99=" << percentile(0.99) << "ms max=" << d.back() << "ms\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    auto cycles = argc > 1 ? (unsigned int)std::atoi(argv[1]) : 100u;
+    auto budget = std::chrono::milliseconds(argc > 2 ? std::atoi(argv[2]) : 3000);
+
+    spdlog::set_level(spdlog::level::warn);
+
+    // measuring retries, not the gateway pacing
+    NetworkCandy::SOAPSchedulerOptions unpaced;
+    unpaced.requestsPerSecond = 1e6;
+    unpaced.burst = 1e6;
+    NetworkCandy::SOAPScheduler::setDefaultOptions(unpaced);
+
+    FakeGateway gateway;
+    if (!gateway.start()) {
+        std::cerr << "Cannot start fake gateway\n";
+        return 1;
+    }
+
+    FakeGateway::Faults faults;
+    faults.latencyMs = 30;
+    faults.jitterMs = 20;
+    faults.lossRate = 0.15;
+    faults.lossStallMs = 200;
+    faults.errorRate = 0.10;
+    faults.errorCode = 501;
+    gateway.setFaults(faults);
+
+    NetworkCandy::RetryOptions noRetry;
+    noRetry.maxAttempts = 1;
+    auto withoutRetries = _run(gateway, noRetry, cycles, budget);
+    auto withRetries = _run(gateway, NetworkCandy::RetryOptions(), cycles, budget);
+
+    std::cout << cycles << " cycles, budget " << budget.count() << "ms, latency " << faults.latencyMs << "+/-" << faults.jitterMs
+              << "ms, loss " << faults.lossRate * 100 << "%, errors " << faults.errorRate * 100 << "%\n";
+    _print("without retries", withoutRetries);
+    _print("with retries   ", withRetries);
+
+    gateway.stop();
+
+    // an attempt started within budget may end past it, by no more than one slow answer
+    auto tolerance = faults.latencyMs + faults.jitterMs + faults.lossStallMs + 100.0;
+    if (withRetries.durationsMs.back() > budget.count() + tolerance) {
+        std::cout << "budget overrun !\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// InterfaceSampler rates, threshold crossings and slot recycling, fed with scripted readings; and TimeSeries bounds.
+
+#include <nw-candy/InterfaceSampler.h>
+#include <nw-candy/TimeSeries.h>
+
+#include <spdlog/spdlog.h>
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace NetworkCandy;
+
+namespace {
+
+bool _expect(bool condition, const std::string& what) {
+    std::cout << (condition ? "OK   " : "FAIL ") << what << '\n';
+    return condition;
+}
+
+InterfaceReading _reading(unsigned int ifIndex, const std::string& name, uint64_t rxBytes, uint64_t txBytes = 0) {
+    InterfaceReading reading;
+    reading.ifIndex = ifIndex;
+    reading.name = name;
+    reading.counters.rxBytes = rxBytes;
+    reading.counters.txBytes = txBytes;
+    return reading;
+}
+
+bool _rates() {
+    InterfaceSampler sampler;
+    InterfaceQuality quality;
+
+    sampler.ingest({ _reading(1, "eth0", 1000, 500) }, 10000);
+    auto succeeded = _expect(!sampler.latest("eth0", &quality), "rates : nothing computed from a single sample");
+
+    sampler.ingest({ _reading(1, "eth0", 3000, 1500) }, 10500);
+    succeeded &= _expect(sampler.latest("eth0", &quality), "rates : computed from two samples");
+    succeeded &= _expect(std::fabs(quality.rxBytesPerSec - 4000) < 0.001, "rates : rx bytes per second");
+    succeeded &= _expect(std::fabs(quality.txBytesPerSec - 2000) < 0.001, "rates : tx bytes per second");
+    succeeded &= _expect(quality.timestampMs == 10500, "rates : stamped with the second sample");
+    return succeeded;
+}
+
+bool _crossings() {
+    InterfaceSampler sampler;
+    std::vector<bool> fired;
+    sampler.subscribe(QualityMetric::RxThroughput, 1000, [&fired](const std::string&, QualityMetric, double, bool isAbove) {
+        fired.push_back(isAbove);
+    });
+
+    // one second apart, rx rate is the delta
+    uint64_t rx = 0;
+    int64_t nowMs = 0;
+    for (auto delta : { 0, 500, 2000, 3000, 4000, 100, 200, 5000 }) {
+        rx += delta;
+        nowMs += 1000;
+        sampler.ingest({ _reading(1, "eth0", rx) }, nowMs);
+    }
+
+    return _expect(fired == std::vector<bool>({ true, false, true }), "crossings : fired once per crossing, not per sample");
+}
+
+bool _slots() {
+    InterfaceSampler sampler;
+    auto succeeded = true;
+
+    // fills every slot
+    std::vector<InterfaceReading> readings;
+    for (unsigned int i = 0; i < InterfaceSampler::MAX_INTERFACES; i++) readings.push_back(_reading(100 + i, "veth" + std::to_string(i), 0));
+    sampler.ingest(readings, 1000);
+    succeeded &= _expect(sampler.interfaces().size() == InterfaceSampler::MAX_INTERFACES, "slots : all interfaces sampled");
+
+    // no room left
+    readings.push_back(_reading(200, "extra", 0));
+    sampler.ingest(readings, 2000);
+    succeeded &= _expect(!sampler.history("extra"), "slots : ignored when full");
+
+    // the old ones are gone, the new ones take their slots
+    readings.clear();
+    for (unsigned int i = 0; i < InterfaceSampler::MAX_INTERFACES; i++) readings.push_back(_reading(300 + i, "docker" + std::to_string(i), 0));
+    sampler.ingest(readings, 3000);
+    succeeded &= _expect(!sampler.history("veth0"), "slots : released once gone");
+    succeeded &= _expect(sampler.history("docker0") && sampler.interfaces().size() == InterfaceSampler::MAX_INTERFACES, "slots : reused by new interfaces");
+
+    // recreated under the same name with another index, starts over
+    readings.resize(2);
+    readings[0].counters.rxBytes = 5000;
+    sampler.ingest(readings, 4000);
+    InterfaceQuality quality;
+    succeeded &= _expect(sampler.latest("docker0", &quality) && sampler.interfaces().size() == 2, "slots : the rest released");
+
+    readings[0] = _reading(400, "docker0", 1000000);
+    sampler.ingest(readings, 5000);
+    succeeded &= _expect(!sampler.latest("docker0", &quality), "slots : recreated interface starts without history");
+
+    readings[0] = _reading(400, "docker0", 1001000);
+    sampler.ingest(readings, 6000);
+    succeeded &= _expect(sampler.latest("docker0", &quality) && std::fabs(quality.rxBytesPerSec - 1000) < 0.001, "slots : recreated interface rates from its own counters");
+    return succeeded;
+}
+
+bool _timeSeries() {
+    TimeSeries<int, 4> series;
+    int value = 0;
+    auto succeeded = _expect(!series.at(0, &value) && !series.latest(&value), "time series : empty");
+
+    series.push(1);
+    series.push(2);
+    succeeded &= _expect(series.at(1, &value) && value == 1, "time series : oldest written");
+    succeeded &= _expect(!series.at(2, &value), "time series : no older than written");
+
+    // wraps around
+    for (int i = 3; i <= 10; i++) series.push(i);
+    succeeded &= _expect(series.at(0, &value) && value == 10, "time series : newest after wrap-around");
+    succeeded &= _expect(series.at(3, &value) && value == 7, "time series : oldest kept after wrap-around");
+    succeeded &= _expect(!series.at(4, &value), "time series : no older than capacity");
+    succeeded &= _expect(series.size() == 4, "time series : size capped");
+    return succeeded;
+}
+
+}  // namespace
+
+int main() {
+    spdlog::set_level(spdlog::level::warn);
+
+    auto succeeded = true;
+    succeeded &= _rates();
+    succeeded &= _crossings();
+    succeeded &= _slots();
+    succeeded &= _timeSeries();
+
+    return succeeded ? 0 : 1;
+}
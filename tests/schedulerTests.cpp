@@ -0,0 +1,276 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// SOAP pacing : token bucket rate, priorities, coalescing and bounded queue of SOAPScheduler on its own,
+// then many handlers mapping at once against a single loopback gateway.
+//
+// schedulerTests [handlers]
+
+#include <nw-candy/SOAPScheduler.h>
+#include <nw-candy/uPnPHandler.h>
+
+#include "FakeGateway.h"
+
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace NetworkCandy;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+bool _expect(bool condition, const std::string& what) {
+    std::cout << (condition ? "OK   " : "FAIL ") << what << '\n';
+    return condition;
+}
+
+double _elapsedMs(Clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+void _print(const SOAPSchedulerStats& stats) {
+    std::cout << "     executed " << stats.executed << ", coalesced " << stats.coalesced << ", rejected " << stats.rejected
+              << ", max queue " << stats.maxQueueDepth << ", wait mean " << stats.meanWaitMs << "ms max " << stats.maxWaitMs << "ms\n";
+}
+
+// call blocking until "release" is set, to fill the queue behind it
+SOAPScheduler::Call _blocking(std::atomic<bool>& started, std::atomic<bool>& release) {
+    return [&started, &release](TraceArguments&) {
+        started = true;
+        while (!release) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return 0;
+    };
+}
+
+void _waitFor(const std::atomic<bool>& flag) {
+    while (!flag) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+void _waitForQueue(const SOAPScheduler& scheduler, std::size_t depth) {
+    while (scheduler.stats().queueDepth < depth) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+bool _rate() {
+    SOAPSchedulerOptions options;
+    options.requestsPerSecond = 20;
+    options.burst = 2;
+    options.maxInFlight = 8;
+    SOAPScheduler scheduler(options);
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 10; i++) {
+        threads.emplace_back([&scheduler, i]() {
+            scheduler.run(SOAPPriority::Check, "request" + std::to_string(i), [](TraceArguments&) { return 0; });
+        });
+    }
+    for (auto &thread : threads) thread.join();
+
+    // 2 at once, then one every 50ms
+    auto elapsed = _elapsedMs(start);
+    _print(scheduler.stats());
+    return _expect(elapsed >= 380 && elapsed < 1000, "10 requests at 20/s with a burst of 2 took " + std::to_string((int)elapsed) + "ms");
+}
+
+bool _priorities() {
+    SOAPSchedulerOptions options;
+    options.requestsPerSecond = 1000;
+    options.maxInFlight = 1;
+    SOAPScheduler scheduler(options);
+
+    std::atomic<bool> started {false}, release {false};
+    std::thread blocker([&]() { scheduler.run(SOAPPriority::Check, "blocker", _blocking(started, release)); });
+    _waitFor(started);
+
+    std::mutex mutex;
+    std::vector<std::string> order;
+    auto record = [&](const std::string& name) {
+        return [&, name](TraceArguments&) {
+            std::lock_guard<std::mutex> lock(mutex);
+            order.push_back(name);
+            return 0;
+        };
+    };
+
+    std::thread poll([&]() { scheduler.run(SOAPPriority::Poll, "poll", record("poll")); });
+    _waitForQueue(scheduler, 1);
+    std::thread check([&]() { scheduler.run(SOAPPriority::Check, "check", record("check")); });
+    _waitForQueue(scheduler, 2);
+    std::thread add([&]() { scheduler.run(SOAPPriority::Mapping, "add", record("add")); });
+    _waitForQueue(scheduler, 3);
+
+    release = true;
+    for (auto thread : { &blocker, &poll, &check, &add }) thread->join();
+
+    return _expect(order == std::vector<std::string> { "add", "check", "poll" }, "adds before checks before polls");
+}
+
+bool _coalescing() {
+    SOAPSchedulerOptions options;
+    options.requestsPerSecond = 1000;
+    options.maxInFlight = 1;
+    SOAPScheduler scheduler(options);
+
+    std::atomic<bool> started {false}, release {false};
+    std::thread blocker([&]() { scheduler.run(SOAPPriority::Check, "blocker", _blocking(started, release)); });
+    _waitFor(started);
+
+    // all asking for the external address while the gateway is busy
+    std::atomic<int> sent {0};
+    std::atomic<int> answered {0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 20; i++) {
+        threads.emplace_back([&]() {
+            TraceArguments outputs;
+            auto result = scheduler.run(SOAPPriority::Check, "GetExternalIPAddress", [&sent](TraceArguments& out) {
+                sent++;
+                out = { {"NewExternalIPAddress", "203.0.113.7"} };
+                return 0;
+            }, &outputs);
+            if (result == 0 && outputs.size() == 1 && outputs.front().second == "203.0.113.7") answered++;
+        });
+    }
+    while (scheduler.stats().coalesced < 19) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    release = true;
+    blocker.join();
+    for (auto &thread : threads) thread.join();
+
+    _print(scheduler.stats());
+    return _expect(sent == 1 && answered == 20, "20 identical requests sent once, all answered");
+}
+
+bool _boundedQueue() {
+    SOAPSchedulerOptions options;
+    options.maxInFlight = 1;
+    options.maxQueue = 2;
+    SOAPScheduler scheduler(options);
+
+    std::atomic<bool> started {false}, release {false};
+    std::thread blocker([&]() { scheduler.run(SOAPPriority::Check, "blocker", _blocking(started, release)); });
+    _waitFor(started);
+
+    std::vector<std::thread> queued;
+    for (int i = 0; i < 2; i++) {
+        queued.emplace_back([&scheduler, i]() { scheduler.run(SOAPPriority::Poll, "queued" + std::to_string(i), [](TraceArguments&) { return 0; }); });
+    }
+    _waitForQueue(scheduler, 2);
+
+    auto refused = scheduler.run(SOAPPriority::Poll, "one too many", [](TraceArguments&) { return 0; });
+
+    release = true;
+    blocker.join();
+    for (auto &thread : queued) thread.join();
+
+    return _expect(refused == SOAPScheduler::QUEUE_FULL && scheduler.stats().rejected == 1, "refused once the queue is full");
+}
+
+// the caller's deadline bounds the wait in queue, well before maxWait
+bool _deadline() {
+    SOAPSchedulerOptions options;
+    options.maxInFlight = 1;
+    SOAPScheduler scheduler(options);
+
+    std::atomic<bool> started {false}, release {false};
+    std::thread blocker([&]() { scheduler.run(SOAPPriority::Check, "blocker", _blocking(started, release)); });
+    _waitFor(started);
+
+    // queued behind the blocker, and joined by another one in a hurry
+    std::atomic<int> patient {0};
+    std::thread queued([&]() { patient = scheduler.run(SOAPPriority::Poll, "queued", [](TraceArguments&) { return 0; }); });
+    _waitForQueue(scheduler, 1);
+
+    auto start = Clock::now();
+    auto joined = scheduler.run(SOAPPriority::Poll, "queued", [](TraceArguments&) { return 0; }, nullptr,
+                                Clock::now() + std::chrono::milliseconds(100));
+    auto joinedMs = _elapsedMs(start);
+
+    start = Clock::now();
+    auto timedOut = scheduler.run(SOAPPriority::Poll, "hurried", [](TraceArguments&) { return 0; }, nullptr,
+                                  Clock::now() + std::chrono::milliseconds(100));
+    auto timedOutMs = _elapsedMs(start);
+
+    release = true;
+    blocker.join();
+    queued.join();
+
+    auto succeeded = _expect(timedOut == SOAPScheduler::QUEUE_TIMEOUT && timedOutMs < 1000, "gave up at the caller's deadline");
+    succeeded &= _expect(joined == SOAPScheduler::QUEUE_TIMEOUT && joinedMs < 1000, "joined request gave up at its own deadline");
+    succeeded &= _expect(patient == 0, "request joined by a hurried one still sent");
+    return succeeded;
+}
+
+// handlers of a process, all mapping at once against the same gateway
+bool _handlers(unsigned int count) {
+    FakeGateway gateway;
+    if (!gateway.start()) return _expect(false, "fake gateway started");
+
+    std::vector<std::unique_ptr<uPnPHandler>> handlers;
+    for (unsigned int i = 0; i < count; i++) {
+        handlers.push_back(std::make_unique<uPnPHandler>(std::to_string(31200 + i), "schedulerTests"));
+        handlers.back()->setGatewayDescriptionURL(gateway.descriptionURL());
+    }
+
+    std::atomic<unsigned int> mapped {0};
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (auto &handler : handlers) {
+        threads.emplace_back([&mapped, &handler]() { if (handler->ensurePortMapping()) mapped++; });
+    }
+    for (auto &thread : threads) thread.join();
+    auto elapsed = _elapsedMs(start);
+
+    auto scheduler = handlers.front()->soapScheduler();
+    if (scheduler) _print(scheduler->stats());
+    std::cout << "     " << gateway.requestCount("GetExternalIPAddress") << " GetExternalIPAddress sent for " << count
+              << " handlers, " << (int)elapsed << "ms\n";
+
+    auto succeeded = _expect(mapped == count, std::to_string(mapped) + "/" + std::to_string(count) + " handlers mapped");
+    succeeded &= _expect(gateway.requestCount("GetExternalIPAddress") < count, "external address requests merged");
+
+    for (auto &handler : handlers) handler->mayDeletePortMapping();
+    gateway.stop();
+    return succeeded;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    auto handlers = argc > 1 ? (unsigned int)std::atoi(argv[1]) : 16u;
+    spdlog::set_level(spdlog::level::warn);
+
+    auto succeeded = _rate();
+    succeeded &= _priorities();
+    succeeded &= _coalescing();
+    succeeded &= _boundedQueue();
+    succeeded &= _deadline();
+    succeeded &= _handlers(handlers);
+
+    return succeeded ? 0 : 1;
+}
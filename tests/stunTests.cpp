@@ -0,0 +1,240 @@
+// NetworkCandy
+// Network system notifications and uPnP shenanigans
+// Copyright (C) 2020-2021 Guillaume Vara
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Any graphical or audio resources available within the source code may
+// use a different license and copyright : please refer to their metadata
+// for further details. Resources without explicit references to a
+// different license and copyright still refer to this GPL.
+
+// STUN external address probe against local stand-ins for STUN servers (answering, dropping, silent, RFC 3489),
+// then raced against a loopback gateway to tell single, double and carrier-grade NAT apart.
+
+#include <nw-candy/Stun.h>
+#include <nw-candy/uPnPHandler.h>
+
+#include "FakeGateway.h"
+#include "Sockets.h"
+
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace NetworkCandy;
+
+namespace {
+
+// stand-in for a STUN server, claiming to see clients from "mappedAddress"
+class StunServer {
+ public:
+    ~StunServer() {
+        _running = false;
+        if (_thread.joinable()) _thread.join();
+        Sockets::close(_socket);
+    }
+
+    // requests ignored before answering; answering with the legacy MAPPED-ADDRESS attribute only
+    void setBehaviour(unsigned int dropped, bool legacy) {
+        _dropped = dropped;
+        _legacy = legacy;
+    }
+
+    // returns "host:port" to reach it, empty on failure
+    std::string start(const std::string& mappedAddress, unsigned short mappedPort) {
+        inet_pton(AF_INET, mappedAddress.c_str(), &_mappedAddress);
+        _mappedPort = mappedPort;
+
+        _socket = ::socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(_socket, (sockaddr*)&address, sizeof(address)) != 0 || getsockname(_socket, (sockaddr*)&address, &length) != 0) {
+            return std::string();
+        }
+
+        _running = true;
+        _thread = std::thread(&StunServer::_serve, this);
+        return "127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+    }
+
+    unsigned int requestCount() const {
+        return _requests;
+    }
+
+ private:
+    Sockets::socket_t _socket = Sockets::INVALID;
+    std::atomic<bool> _running {false};
+    std::thread _thread;
+    std::atomic<unsigned int> _requests {0};
+    unsigned int _dropped = 0;
+    bool _legacy = false;
+    in_addr _mappedAddress {};
+    unsigned short _mappedPort = 0;
+
+    void _serve() {
+        while (_running) {
+            if (Sockets::waitReadable(_socket, 100) <= 0) continue;
+
+            unsigned char request[512];
+            sockaddr_in from {};
+            socklen_t fromLength = sizeof(from);
+            auto received = recvfrom(_socket, (char*)request, sizeof(request), 0, (sockaddr*)&from, &fromLength);
+            if (received < 20 || request[0] != 0x00 || request[1] != 0x01) continue;
+            if (++_requests <= _dropped) continue;
+
+            // Binding success, transaction of the request, a single address attribute
+            unsigned char response[32] = { 0x01, 0x01, 0x00, 0x0C };
+            std::memcpy(response + 4, request + 4, 16);
+            uint16_t port = _mappedPort;
+            uint32_t address = ntohl(_mappedAddress.s_addr);
+            if (!_legacy) {
+                port ^= 0x2112;
+                address ^= 0x2112A442;
+            }
+            unsigned char attribute[12] = {
+                0x00, (unsigned char)(_legacy ? 0x01 : 0x20), 0x00, 0x08, 0x00, 0x01,
+                (unsigned char)(port >> 8), (unsigned char)port,
+                (unsigned char)(address >> 24), (unsigned char)(address >> 16), (unsigned char)(address >> 8), (unsigned char)address
+            };
+            std::memcpy(response + 20, attribute, sizeof(attribute));
+
+            sendto(_socket, (const char*)response, sizeof(response), 0, (sockaddr*)&from, fromLength);
+        }
+    }
+};
+
+bool _expect(bool condition, const char * what) {
+    std::cout << (condition ? "OK   " : "FAIL ") << what << '\n';
+    return condition;
+}
+
+// gateway reporting "gatewayIP", STUN server seeing "stunIP"
+NATTopology _topology(const std::string& gatewayIP, const std::string& stunIP, std::string* firstAddress) {
+    FakeGateway gateway;
+    StunServer server;
+    auto serverAddress = server.start(stunIP, 40000);
+    if (!gateway.start() || serverAddress.empty()) return NATTopology::Unknown;
+    gateway.script("GetExternalIPAddress", { 0, { {"NewExternalIPAddress", gatewayIP} } });
+
+    uPnPHandler handler("31139", "stunTests");
+    handler.setGatewayDescriptionURL(gateway.descriptionURL());
+    handler.setStunServers({ serverAddress });
+    handler.setExternalAddressCallback([firstAddress](const std::string& address, ExternalAddressSource) {
+        *firstAddress = address;
+    });
+    handler.ensurePortMapping();
+    handler.mayDeletePortMapping();
+
+    // STUN may answer after the mapping is done
+    auto giveUpAt = std::chrono::steady_clock::now() + std::chrono::seconds(3);
+    while (handler.natTopology() == NATTopology::Unknown && std::chrono::steady_clock::now() < giveUpAt) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    gateway.stop();
+    return handler.natTopology();
+}
+
+}  // namespace
+
+int main() {
+    spdlog::set_level(spdlog::level::warn);
+    auto succeeded = true;
+
+    // client alone
+    {
+        StunServer server;
+        auto address = server.start("198.51.100.9", 40000);
+        StunClient client;
+        client.start({ address });
+        auto result = client.wait();
+        succeeded &= _expect(result.succeeded && result.address == "198.51.100.9" && result.port == 40000, "XOR-MAPPED-ADDRESS read");
+        std::cout << "     answered in " << result.rttMs << "ms\n";
+    }
+    {
+        StunServer server;
+        server.setBehaviour(0, true);
+        StunClient client;
+        client.start({ server.start("198.51.100.9", 40000) });
+        auto result = client.wait();
+        succeeded &= _expect(result.succeeded && result.address == "198.51.100.9", "MAPPED-ADDRESS read");
+    }
+    {
+        StunServer server;
+        server.setBehaviour(2, false);
+        StunClient client;
+        client.start({ server.start("198.51.100.9", 40000) }, std::chrono::milliseconds(1000), std::chrono::milliseconds(50));
+        auto result = client.wait();
+        succeeded &= _expect(result.succeeded && server.requestCount() == 3, "answered once retransmitted");
+    }
+    {
+        StunServer silent, answering;
+        silent.setBehaviour(1000, false);
+        auto silentAddress = silent.start("192.0.2.1", 1);
+        auto answeringAddress = answering.start("198.51.100.9", 40000);
+        StunClient client;
+        client.start({ silentAddress, answeringAddress });
+        auto result = client.wait();
+        succeeded &= _expect(result.succeeded && result.server == answeringAddress, "first answering server wins");
+
+        auto start = std::chrono::steady_clock::now();
+        client.start({ silentAddress }, std::chrono::milliseconds(300));
+        result = client.wait();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        succeeded &= _expect(!result.succeeded && elapsed < std::chrono::milliseconds(600), "gives up in time");
+    }
+
+    // views compared
+    succeeded &= _expect(classifyNAT("192.168.1.2", "198.51.100.9", "198.51.100.9") == NATTopology::Single, "single NAT");
+    succeeded &= _expect(classifyNAT("192.168.1.2", "198.51.100.9", "203.0.113.5") == NATTopology::Double, "double NAT");
+    succeeded &= _expect(classifyNAT("192.168.1.2", "10.0.0.2", "") == NATTopology::Double, "double NAT, private WAN address");
+    succeeded &= _expect(classifyNAT("192.168.1.2", "100.72.3.4", "203.0.113.5") == NATTopology::CarrierGrade, "carrier-grade NAT");
+    succeeded &= _expect(classifyNAT("198.51.100.9", "", "198.51.100.9") == NATTopology::None, "no NAT");
+    succeeded &= _expect(classifyNAT("192.168.1.2", "0.0.0.0", "203.0.113.5") == NATTopology::Unknown, "unknown");
+
+    // raced against the gateway
+    std::string first;
+    succeeded &= _expect(_topology("198.51.100.9", "198.51.100.9", &first) == NATTopology::Single && first == "198.51.100.9",
+                         "handler : single NAT");
+    succeeded &= _expect(_topology("198.51.100.9", "203.0.113.5", &first) == NATTopology::Double && !first.empty(), "handler : double NAT");
+    succeeded &= _expect(_topology("100.72.3.4", "203.0.113.5", &first) == NATTopology::CarrierGrade, "handler : carrier-grade NAT");
+
+    // no gateway at all, STUN still tells
+    {
+        StunServer server;
+        auto serverAddress = server.start("203.0.113.5", 40000);
+
+        RetryOptions once;
+        once.maxAttempts = 1;
+        once.initialAttemptTimeout = std::chrono::milliseconds(500);
+        uPnPHandler handler("31139", "stunTests");
+        handler.setRetryOptions(once);
+        handler.setGatewayDescriptionURL("http://127.0.0.1:1/rootDesc.xml");
+        handler.setStunServers({ serverAddress });
+        succeeded &= _expect(!handler.ensurePortMapping(std::chrono::milliseconds(2000)), "handler : no gateway");
+
+        auto giveUpAt = std::chrono::steady_clock::now() + std::chrono::seconds(3);
+        while (handler.externalIP() != "203.0.113.5" && std::chrono::steady_clock::now() < giveUpAt) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        succeeded &= _expect(handler.externalIP() == "203.0.113.5", "handler : external address from STUN");
+    }
+
+    return succeeded ? 0 : 1;
+}